@@ -4,6 +4,10 @@
 appname = Perspector
 authors = Pierre Neidhardt
 cmdname = perspector
+batchname = ${cmdname}-batch
+servername = ${cmdname}-server
+## Major version of the shared library.
+soversion = 1
 url = http://ambrevar.bitbucket.org/perspector
 version = 1.0
 year = 2014
@@ -18,4 +22,27 @@ testdir = tests
 ## Optional compilation flags.
 CFLAGS ?= -pedantic -std=c99 -Wall -Wextra -Wshadow
 
+## Uncomment to disable the SIMD sampling kernels.
+# CPPFLAGS += -DNO_SIMD
+
+## Uncomment to compute positions in fixed point by default, for CPUs with slow
+## floating point. See sample.c for the accuracy.
+# CPPFLAGS += -DFIXED_POINT
+
+## Uncomment both to build without GSL. Nearly degenerate anchors are then
+## rejected instead of being solved by SVD.
+# CPPFLAGS += -DNO_GSL
+# GSL_LIBS =
+
+## Uncomment both to build without the GPU backend. OpenCL is loaded at
+## runtime, so it is needed neither to build nor to run.
+# CPPFLAGS += -DNO_GPU
+# DL_LIBS =
+
+## Uncomment the pairs to build without JPEG or TIFF support.
+# CPPFLAGS += -DNO_JPEG
+# JPEG_LIBS =
+# CPPFLAGS += -DNO_TIFF
+# TIFF_LIBS =
+
 ## END OF USER SETTINGS
@@ -0,0 +1,758 @@
+/*
+Headless batch processing.
+
+Jobs are read from a manifest, see manifest.c, one line at a time, and go
+through a pipeline of 3 stages: decoding, warping and encoding. The stages run
+concurrently with their own workers, see pipeline.c, so that I/O overlaps with
+computation. The queues between the stages are bounded, which bounds the number
+of pictures held in memory whatever the length of the manifest.
+
+A manifest may also list the frames of a sequence, most of them without anchors
+to take those of the previous frame, optionally tracked, see track.c. Warping
+workers keep the transform of their last picture and only solve it again when
+the anchors or the sizes change, so the frames of a fixed camera are solved
+once.
+
+This program does not depend on GTK.
+*/
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "cache.h"
+#include "image.h"
+#include "manifest.h"
+#include "perspector.h"
+#include "pipeline.h"
+#include "track.h"
+
+#define STR(x) #x
+#define XSTR(x) STR(x)
+
+static const char *interpolation_names[] =
+{
+    [INTERP_NEAREST] = "nearest",
+    [INTERP_BILINEAR] = "bilinear",
+    [INTERP_BICUBIC] = "bicubic",
+    [INTERP_LANCZOS3] = "lanczos3"
+};
+
+static const char *crop_names[] =
+{
+    [CROP_ENLARGE] = "enlarge",
+    [CROP_SHRINK] = "shrink",
+    [CROP_KEEP] = "keep",
+    [CROP_BIGGEST] = "biggest"
+};
+
+static const char *backend_names[] =
+{
+    [BACKEND_CPU] = "cpu",
+    [BACKEND_GPU] = "gpu"
+};
+
+static const char *mapping_names[] =
+{
+    [MAP_INVERSE] = "inverse",
+    [MAP_FORWARD] = "forward"
+};
+
+/* Index of 'name' in 'names', or -1. */
+static int lookup(const char *name, const char **names, size_t count)
+{
+    size_t i;
+    for (i = 0; i < count; i++)
+    {
+        if (!strcmp(name, names[i]))
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static void usage(const char *name)
+{
+    printf("Usage: %s [OPTIONS] [MANIFEST]\n\n", name);
+    puts("Rectify the pictures listed in MANIFEST, or in the standard input if none.\n");
+    puts("Options:");
+    puts("  -b BACKEND Where to warp: cpu (default) or gpu, which falls back to the CPU");
+    puts("             when no GPU is found. Jobs of JSON manifests may choose theirs.");
+    puts("  -c CROP    Part of the picture to keep: enlarge (default) or shrink to fit the");
+    puts("             anchors, keep the whole picture, or its biggest rectangle.");
+    puts("  -d N       Number of decoding workers (default 1).");
+    puts("  -e N       Number of encoding workers (default 1).");
+    puts("  -f         Compute positions in fixed point, for CPUs with slow floating");
+    puts("             point. Nearest and bilinear interpolations only.");
+    puts("  -h         Print this help.");
+    puts("  -i INTERP  Interpolation: nearest, bilinear (default), bicubic or lanczos3.");
+    puts("  -k RADIUS  Track the anchors of the frames without anchors from the previous");
+    puts("             frame, moving by at most RADIUS pixels. Decodes one frame at a time.");
+    puts("  -m MAP     Mapping: inverse (default) or forward.");
+    puts("  -p         Print the progress of the jobs about once per second.");
+    puts("  -q N       Length of the queues between the stages (default 2).");
+    puts("  -s ROWS    Stream the pictures in strips of ROWS rows instead of loading");
+    puts("             them whole. Inverse mapping only.");
+    puts("  -S         Print the statistics of the jobs as they are done: time per phase,");
+    puts("             pixel counts, and the radius of the hole fill.");
+    puts("  -t N       Number of threads per picture, 0 for one per processor. By default");
+    puts("             the processors are shared among the warping workers.");
+    puts("  -v         Print the jobs as they are done, with their throughput.");
+    puts("  -V         Print version.");
+    puts("  -w N       Number of warping workers (default 1).");
+    puts("  -z SIZE    Shrink the results to fit in SIZE x SIZE pixels, sampling halvings");
+    puts("             of the pictures to avoid aliasing. Requires whole pictures.");
+}
+
+static void version(void)
+{
+    printf("perspector-batch %s\n", XSTR(VERSION));
+    printf("Copyright © %s %s\n", XSTR(YEAR), XSTR(AUTHORS));
+}
+
+/* A job travelling through the pipeline. Once 'error' is set, the next stages
+only pass it along. */
+typedef struct
+{
+    job job;
+    unsigned long line;
+    coord sink_width, sink_height;
+    placement placement;
+    image bg, sink;
+    /* When streaming, pictures never get loaded. */
+    image_reader *reader;
+    const char *error;
+    /* Time spent warping, in seconds. */
+    double seconds;
+    stats stats;
+} task;
+
+/* What a warping worker keeps from one picture to the next: its buffers, and
+its last transform. */
+typedef struct
+{
+    workspace *ws;
+    cache cache;
+} slot;
+
+/* Shared by the workers of all the stages. */
+typedef struct
+{
+    const char *manifest;
+    options opts;
+    crop crop;
+    /* Largest side of the results, 0 for no limit. */
+    coord size;
+    /* Strip height, 0 to process whole pictures. */
+    coord strip;
+    bool verbose, progress, stats;
+    /* Anchors of the last frame that had some, moved frame after frame by
+    'tracker' if not NULL. Set as the manifest is read without tracker, by the
+    single decoder with one. */
+    pixelset anchors;
+    tracker *tracker;
+    pthread_mutex_t lock;
+    unsigned long done, failed;
+    /* Slots not in use, at most one per warping worker. */
+    slot **spares;
+    size_t spare_count;
+} batch;
+
+/* Warps borrow a slot so that the buffers and the transform of a picture are
+reused by the next ones. Return NULL if none can be allocated. */
+static slot *borrow_slot(batch *b)
+{
+    pthread_mutex_lock(&b->lock);
+    slot *s = b->spare_count ? b->spares[--b->spare_count] : NULL;
+    pthread_mutex_unlock(&b->lock);
+    if (!s && (s = malloc(sizeof *s)))
+    {
+        s->ws = workspace_new();
+        memset(&s->cache, 0, sizeof s->cache);
+        if (!s->ws)
+        {
+            free(s);
+            s = NULL;
+        }
+    }
+    return s;
+}
+
+static void return_slot(batch *b, slot *s)
+{
+    pthread_mutex_lock(&b->lock);
+    b->spares[b->spare_count++] = s;
+    pthread_mutex_unlock(&b->lock);
+}
+
+static void slot_free(slot *s)
+{
+    cache_release(&s->cache);
+    workspace_free(s->ws);
+    free(s);
+}
+
+/* Sequences with tracking: frames with anchors seed the tracker, the others
+get the anchors of the previous frame, tracked. */
+static void track(batch *b, task *t)
+{
+    if (t->job.anchors.count)
+    {
+        tracker_seed(b->tracker, t->bg.data, t->bg.width, t->bg.height, &t->job.anchors);
+        b->anchors = t->job.anchors;
+    }
+    else if (b->anchors.count)
+    {
+        tracker_update(b->tracker, t->bg.data, t->bg.width, t->bg.height, &b->anchors);
+        t->job.anchors = b->anchors;
+    }
+}
+
+static void decode(void *item, void *data)
+{
+    task *t = item;
+    batch *b = data;
+
+    coord width, height;
+    if (b->strip)
+    {
+        /* Only the header is decoded here. */
+        t->reader = image_reader_open(t->job.input, &t->error);
+        if (!t->reader)
+        {
+            return;
+        }
+        width = image_reader_width(t->reader);
+        height = image_reader_height(t->reader);
+    }
+    else if (image_load(&t->bg, t->job.input, &t->error))
+    {
+        width = t->bg.width;
+        height = t->bg.height;
+    }
+    else
+    {
+        return;
+    }
+
+    if (b->tracker)
+    {
+        track(b, t);
+    }
+    if (!t->job.anchors.count)
+    {
+        t->error = "Missing anchors.";
+    }
+    else if (!sink_geometry(&t->job.anchors, t->job.ratio, b->crop, width, height,
+                            &t->sink_width, &t->sink_height, &t->placement))
+    {
+        t->error = b->crop == CROP_ENLARGE ? "Anchors configuration is not usable."
+                   : "The picture cannot be cropped this way.";
+    }
+    if (t->error)
+    {
+        if (t->reader)
+        {
+            image_reader_close(t->reader);
+            t->reader = NULL;
+        }
+        else
+        {
+            image_free(&t->bg);
+        }
+        return;
+    }
+    sink_fit(&t->sink_width, &t->sink_height, &t->placement, b->size, b->size);
+}
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Progress of a job, for -p. */
+typedef struct
+{
+    const char *input;
+    double last;
+} meter;
+
+static bool report_progress(void *data, size_t done, size_t total)
+{
+    meter *m = data;
+    double t = now();
+    if (t - m->last >= 1)
+    {
+        m->last = t;
+        fprintf(stderr, "%s: %d%%\n", m->input, (int)(100 * done / total));
+    }
+    return true;
+}
+
+/* Once the transform is made, warps only fail when memory runs out, since
+the jobs cannot be cancelled. */
+#define WARP_ERROR "Not enough memory to warp the picture."
+
+/* Read, warp and write a picture strip by strip. */
+static void stream(task *t, const transform *tr, coord strip)
+{
+    image_writer *writer = image_writer_open(t->job.output, t->sink_width, t->sink_height, &t->error);
+    if (writer)
+    {
+        bool status = transform_stream(tr, strip, image_read_rows, t->reader, image_write_rows, writer);
+        const char *write_error = image_writer_error(writer);
+        if (!image_writer_close(writer, &t->error) || !status)
+        {
+            /* Decoding errors come first, then encoding ones. Otherwise the
+            warp itself failed, which only happens when memory runs out. */
+            const char *read_error = image_reader_error(t->reader);
+            t->error = read_error ? read_error : write_error ? write_error : status ? t->error : WARP_ERROR;
+        }
+    }
+}
+
+static void warp(void *item, void *data)
+{
+    task *t = item;
+    batch *b = data;
+    if (t->error)
+    {
+        return;
+    }
+
+    double start = now();
+    options opts = b->opts;
+    meter m = { .input = t->job.input, .last = start };
+    opts.placement = t->placement;
+    if (t->job.has_backend)
+    {
+        opts.backend = t->job.backend;
+    }
+    if (b->progress)
+    {
+        opts.progress = report_progress;
+        opts.progress_data = &m;
+    }
+    if (b->stats)
+    {
+        opts.stats = &t->stats;
+    }
+    if (!t->reader && !image_create_output(&t->sink, t->job.output, t->sink_width, t->sink_height, &t->error))
+    {
+        image_free(&t->bg);
+        return;
+    }
+
+    coord bg_width = t->reader ? image_reader_width(t->reader) : t->bg.width;
+    coord bg_height = t->reader ? image_reader_height(t->reader) : t->bg.height;
+    bool status = false, reused = false;
+    slot *s = borrow_slot(b);
+    transform *tr = s ? cache_transform(&s->cache, &t->job.anchors, t->sink_width, t->sink_height,
+                                        bg_width, bg_height, &opts, &reused)
+                    : transform_new(&t->job.anchors, t->sink_width, t->sink_height, bg_width, bg_height, &opts);
+    if (tr && t->reader)
+    {
+        stream(t, tr, b->strip);
+    }
+    else if (tr)
+    {
+        status = s ? transform_apply_in(tr, s->ws, t->sink.data, t->bg.data)
+                 : transform_apply(tr, t->sink.data, t->bg.data);
+    }
+    if (s)
+    {
+        return_slot(b, s);
+    }
+    else
+    {
+        transform_free(tr);
+    }
+    t->seconds = now() - start;
+    if (reused)
+    {
+        t->stats.solve_time = 0;
+    }
+
+    if (t->reader)
+    {
+        t->error = tr ? t->error : "Anchors configuration is not usable.";
+        image_reader_close(t->reader);
+        return;
+    }
+    /* Release the input as soon as possible to keep memory low. */
+    image_free(&t->bg);
+    if (!status)
+    {
+        t->error = tr ? WARP_ERROR : "Anchors configuration is not usable.";
+        image_free(&t->sink);
+    }
+}
+
+static void encode(void *item, void *data)
+{
+    task *t = item;
+    batch *b = data;
+
+    if (!t->error && !b->strip)
+    {
+        image_save(&t->sink, t->job.output, &t->error);
+        image_free(&t->sink);
+    }
+
+    pthread_mutex_lock(&b->lock);
+    if (t->error)
+    {
+        fprintf(stderr, "%s:%lu: %s: %s\n", b->manifest, t->line, t->job.input, t->error);
+        b->failed++;
+    }
+    else
+    {
+        b->done++;
+        if (b->verbose)
+        {
+            double pixels = (double)t->sink_width * t->sink_height;
+            printf("%s -> %s (%.3f s, %.1f Mpixel/s)\n", t->job.input, t->job.output,
+                   t->seconds, t->seconds > 0 ? pixels / t->seconds / 1e6 : 0);
+        }
+        if (b->stats)
+        {
+            const stats *s = &t->stats;
+            printf("%s: solve %.3f s, map %.3f s, fill %.3f s; %" PRIu64 " transformed, %" PRIu64 " discarded, "
+                   "%" PRIu64 " holes, radius max %.1f mean %.2f; %s\n", t->job.input, s->solve_time, s->map_time,
+                   s->fill_time, s->transformed, s->discarded, s->holes, s->radius_max, s->radius_mean,
+                   backend_names[s->backend]);
+        }
+    }
+    pthread_mutex_unlock(&b->lock);
+
+    job_free(&t->job);
+    free(t);
+}
+
+/* Parse a strictly positive number of workers or queue slots. */
+static bool parse_count(const char *arg, unsigned int *count)
+{
+    char *end;
+    unsigned long n = strtoul(arg, &end, 10);
+    if (*arg == '\0' || *end != '\0' || n == 0 || n > 1024)
+    {
+        fprintf(stderr, "Wrong count '%s'.\n", arg);
+        return false;
+    }
+    *count = n;
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    batch b = { .manifest = "-", .strip = 0, .crop = CROP_ENLARGE, .size = 0, .verbose = false, .progress = false, .stats = false, .done = 0, .failed = 0,
+                 .anchors = { .count = 0 }, .tracker = NULL, .spares = NULL, .spare_count = 0 };
+    options_init(&b.opts);
+    pthread_mutex_init(&b.lock, NULL);
+    unsigned int decoders = 1, warpers = 1, encoders = 1, slots = 2;
+    bool threads_set = false;
+    long radius = -1;
+
+    int c;
+    while ((c = getopt(argc, argv, "b:c:d:e:fhi:k:m:pq:s:St:vVw:z:")) != -1)
+    {
+        switch (c)
+        {
+        case 'b':
+            c = lookup(optarg, backend_names, sizeof backend_names / sizeof backend_names[0]);
+            if (c < 0)
+            {
+                fprintf(stderr, "Unknown backend '%s'.\n", optarg);
+                return EXIT_FAILURE;
+            }
+            b.opts.backend = c;
+            break;
+        case 'c':
+            c = lookup(optarg, crop_names, sizeof crop_names / sizeof crop_names[0]);
+            if (c < 0)
+            {
+                fprintf(stderr, "Unknown crop '%s'.\n", optarg);
+                return EXIT_FAILURE;
+            }
+            b.crop = c;
+            /* The picture is surrounded with the background color. */
+            b.opts.outside = c == CROP_KEEP ? OUTSIDE_BACKGROUND : OUTSIDE_EXTEND;
+            break;
+        case 'd':
+            if (!parse_count(optarg, &decoders))
+            {
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'e':
+            if (!parse_count(optarg, &encoders))
+            {
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'f':
+            b.opts.fixed_point = true;
+            break;
+        case 'h':
+            usage(argv[0]);
+            return EXIT_SUCCESS;
+        case 'i':
+            c = lookup(optarg, interpolation_names, sizeof interpolation_names / sizeof interpolation_names[0]);
+            if (c < 0)
+            {
+                fprintf(stderr, "Unknown interpolation '%s'.\n", optarg);
+                return EXIT_FAILURE;
+            }
+            b.opts.interpolation = c;
+            break;
+        case 'k':
+        {
+            char *end;
+            radius = strtol(optarg, &end, 10);
+            if (*optarg == '\0' || *end != '\0' || radius < 0 || radius > 1024)
+            {
+                fprintf(stderr, "Wrong tracking radius '%s'.\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        }
+        case 'm':
+            c = lookup(optarg, mapping_names, sizeof mapping_names / sizeof mapping_names[0]);
+            if (c < 0)
+            {
+                fprintf(stderr, "Unknown mapping '%s'.\n", optarg);
+                return EXIT_FAILURE;
+            }
+            b.opts.mapping = c;
+            break;
+        case 'p':
+            b.progress = true;
+            break;
+        case 'q':
+            if (!parse_count(optarg, &slots))
+            {
+                return EXIT_FAILURE;
+            }
+            break;
+        case 's':
+        {
+            char *end;
+            unsigned long strip = strtoul(optarg, &end, 10);
+            if (*optarg == '\0' || *end != '\0' || strip == 0 || strip > COORD_MAX)
+            {
+                fprintf(stderr, "Wrong strip height '%s'.\n", optarg);
+                return EXIT_FAILURE;
+            }
+            b.strip = strip;
+            break;
+        }
+        case 'S':
+            b.stats = true;
+            break;
+        case 't':
+        {
+            char *end;
+            unsigned long threads = strtoul(optarg, &end, 10);
+            if (*optarg == '\0' || *end != '\0' || threads > 1024)
+            {
+                fprintf(stderr, "Wrong number of threads '%s'.\n", optarg);
+                return EXIT_FAILURE;
+            }
+            b.opts.threads = threads;
+            threads_set = true;
+            break;
+        }
+        case 'v':
+            b.verbose = true;
+            break;
+        case 'V':
+            version();
+            return EXIT_SUCCESS;
+        case 'w':
+            if (!parse_count(optarg, &warpers))
+            {
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'z':
+        {
+            char *end;
+            unsigned long size = strtoul(optarg, &end, 10);
+            if (*optarg == '\0' || *end != '\0' || size == 0 || size > COORD_MAX)
+            {
+                fprintf(stderr, "Wrong size '%s'.\n", optarg);
+                return EXIT_FAILURE;
+            }
+            b.size = size;
+            b.opts.mipmap = true;
+            break;
+        }
+        default:
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (argc - optind > 1)
+    {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    if (b.strip && b.opts.mapping != MAP_INVERSE)
+    {
+        fprintf(stderr, "Streaming requires the inverse mapping.\n");
+        return EXIT_FAILURE;
+    }
+    if (b.strip && b.size)
+    {
+        fprintf(stderr, "Shrinking requires whole pictures.\n");
+        return EXIT_FAILURE;
+    }
+    if (b.strip && radius >= 0)
+    {
+        fprintf(stderr, "Tracking requires whole pictures.\n");
+        return EXIT_FAILURE;
+    }
+    if (radius >= 0)
+    {
+        b.tracker = tracker_new(radius);
+        if (!b.tracker)
+        {
+            return EXIT_FAILURE;
+        }
+        /* Frames are tracked in order. */
+        decoders = 1;
+    }
+
+    FILE *input = stdin;
+    if (optind < argc && strcmp(argv[optind], "-"))
+    {
+        b.manifest = argv[optind];
+        input = fopen(b.manifest, "r");
+        if (!input)
+        {
+            perror(b.manifest);
+            return EXIT_FAILURE;
+        }
+    }
+
+    /* Share the processors among the warp workers. */
+    if (!threads_set && warpers > 1)
+    {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        b.opts.threads = cpus > warpers ? cpus / warpers : 1;
+    }
+
+    b.spares = malloc(warpers * sizeof *b.spares);
+    if (!b.spares)
+    {
+        fprintf(stderr, "Cannot allocate the slots.\n");
+        return EXIT_FAILURE;
+    }
+
+    /* The reader feeds the decoders. */
+    queue to_decode, to_warp, to_encode;
+    if (!queue_init(&to_decode, slots, 1)
+            || !queue_init(&to_warp, slots, decoders)
+            || !queue_init(&to_encode, slots, warpers))
+    {
+        fprintf(stderr, "Cannot allocate the queues.\n");
+        return EXIT_FAILURE;
+    }
+    stage stages[] =
+    {
+        { .in = &to_decode, .out = &to_warp, .process = decode, .data = &b, .workers = decoders },
+        { .in = &to_warp, .out = &to_encode, .process = warp, .data = &b, .workers = warpers },
+        { .in = &to_encode, .out = NULL, .process = encode, .data = &b, .workers = encoders }
+    };
+    size_t i;
+    for (i = 0; i < sizeof stages / sizeof stages[0]; i++)
+    {
+        if (!stage_start(&stages[i]))
+        {
+            fprintf(stderr, "Cannot start the workers.\n");
+            return EXIT_FAILURE;
+        }
+    }
+
+    char *line = NULL;
+    size_t size = 0;
+    unsigned long lineno = 0;
+    while (getline(&line, &size, input) != -1)
+    {
+        lineno++;
+        task *t = malloc(sizeof *t);
+        if (!t)
+        {
+            fprintf(stderr, "%s:%lu: Cannot allocate the job.\n", b.manifest, lineno);
+            break;
+        }
+        const char *error;
+        parse_status status = job_parse(&t->job, line, &error);
+        if (status != PARSE_OK)
+        {
+            if (status == PARSE_ERROR)
+            {
+                pthread_mutex_lock(&b.lock);
+                fprintf(stderr, "%s:%lu: %s\n", b.manifest, lineno, error);
+                b.failed++;
+                pthread_mutex_unlock(&b.lock);
+            }
+            free(t);
+            continue;
+        }
+        /* Without tracker, frames without anchors take the last ones right away. */
+        if (!b.tracker && t->job.anchors.count)
+        {
+            b.anchors = t->job.anchors;
+        }
+        else if (!b.tracker)
+        {
+            t->job.anchors = b.anchors;
+        }
+        t->line = lineno;
+        t->reader = NULL;
+        t->error = NULL;
+        t->seconds = 0;
+        queue_push(&to_decode, t);
+    }
+
+    bool read_error = ferror(input);
+    if (read_error)
+    {
+        perror(b.manifest);
+    }
+    free(line);
+    if (input != stdin)
+    {
+        fclose(input);
+    }
+
+    queue_close(&to_decode);
+    for (i = 0; i < sizeof stages / sizeof stages[0]; i++)
+    {
+        stage_join(&stages[i]);
+    }
+    queue_destroy(&to_decode);
+    queue_destroy(&to_warp);
+    queue_destroy(&to_encode);
+    while (b.spare_count)
+    {
+        slot_free(b.spares[--b.spare_count]);
+    }
+    free(b.spares);
+    tracker_free(b.tracker);
+    pthread_mutex_destroy(&b.lock);
+
+    if (b.verbose)
+    {
+        printf("%lu done, %lu failed.\n", b.done, b.failed);
+    }
+    return b.failed || read_error ? EXIT_FAILURE : EXIT_SUCCESS;
+}
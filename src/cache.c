@@ -0,0 +1,48 @@
+#include <string.h>
+#include "cache.h"
+
+static bool same_anchors(const pixelset *a, const pixelset *b)
+{
+    size_t i;
+    for (i = 0; i < 4; i++)
+    {
+        if (a->pixels[i].x != b->pixels[i].x || a->pixels[i].y != b->pixels[i].y)
+        {
+            return false;
+        }
+    }
+    return a->count == b->count;
+}
+
+transform *cache_transform(cache *c, const pixelset *anchors, coord sink_width, coord sink_height,
+                           coord bg_width, coord bg_height, const options *opts, bool *reused)
+{
+    *reused = c->tr && same_anchors(&c->anchors, anchors)
+              && c->sink_width == sink_width && c->sink_height == sink_height
+              && c->bg_width == bg_width && c->bg_height == bg_height
+              && !memcmp(&c->placement, &opts->placement, sizeof c->placement) && c->backend == opts->backend;
+    if (*reused)
+    {
+        transform_set_reports(c->tr, opts->progress, opts->progress_data, opts->stats);
+        return c->tr;
+    }
+
+    transform_free(c->tr);
+    /* transform_new() sorts the anchors it is given. */
+    pixelset sorted = *anchors;
+    c->tr = transform_new(&sorted, sink_width, sink_height, bg_width, bg_height, opts);
+    c->anchors = *anchors;
+    c->sink_width = sink_width;
+    c->sink_height = sink_height;
+    c->bg_width = bg_width;
+    c->bg_height = bg_height;
+    c->placement = opts->placement;
+    c->backend = opts->backend;
+    return c->tr;
+}
+
+void cache_release(cache *c)
+{
+    transform_free(c->tr);
+    c->tr = NULL;
+}
@@ -0,0 +1,25 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include "perspector.h"
+
+/* The last transform of a worker with what it was solved for, so that the
+frames of a fixed camera are solved once. Zero-initialized, it is empty. */
+typedef struct
+{
+    transform *tr;
+    pixelset anchors;
+    coord sink_width, sink_height, bg_width, bg_height;
+    placement placement;
+    backend backend;
+} cache;
+
+/* The transform of 'anchors' with the placement and the backend of 'opts',
+solved again only if one of them or the sizes changed since the last call. It
+belongs to 'c'. Return NULL if the anchors configuration is not usable. */
+transform *cache_transform(cache *c, const pixelset *anchors, coord sink_width, coord sink_height,
+                           coord bg_width, coord bg_height, const options *opts, bool *reused);
+
+void cache_release(cache *c);
+
+#endif
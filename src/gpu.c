@@ -0,0 +1,491 @@
+/*
+GPU backend of the inverse mapping.
+
+The sink is computed by an OpenCL kernel, one work item per pixel, on the first
+GPU found. 'bg' is uploaded as a plain buffer rather than an image: the kernel
+samples it the way the portable kernels of sample.c do, with the same clamping,
+rounding and 8-bit blending weights, which the samplers of the hardware do not
+guarantee, and buffers are not bound by the maximum size of images. Positions are computed in single precision though, since many GPUs are
+slow at double precision, so a weight may differ by one step on some pixels,
+and nearest neighbours may differ where a position falls half-way between two
+pixels. Only the nearest and bilinear interpolations are supported.
+
+OpenCL is loaded at runtime, so that the program neither needs its headers to
+build nor the library to run: the few declarations below mirror those of the
+OpenCL 1.2 headers. The device, with its context and program, is set up once
+per process, on the first warp; without a library or a GPU, every warp is left
+to the CPU. Warps then take one of GPU_SLOTS slots, each holding a kernel and
+its buffers: those are reused by the next warps, and only reallocated for
+bigger pictures, so that a sequence of frames allocates nothing on the device
+after the first one. Warps finding every slot busy use temporary ones.
+
+Build with `-DNO_GPU` to leave the backend out.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "gpu.h"
+
+bool gpu_supports(interpolation interp)
+{
+    return interp == INTERP_NEAREST || interp == INTERP_BILINEAR;
+}
+
+#ifdef NO_GPU
+
+bool gpu_warp(color *sink_data, coord sink_width, coord sink_height,
+              const color *bg_data, coord bg_width, coord bg_height,
+              const double inverse[9], interpolation interp,
+              const coord *spans, color background)
+{
+    (void)sink_data;
+    (void)sink_width;
+    (void)sink_height;
+    (void)bg_data;
+    (void)bg_width;
+    (void)bg_height;
+    (void)inverse;
+    (void)interp;
+    (void)spans;
+    (void)background;
+    return false;
+}
+
+#else
+
+#include <dlfcn.h>
+
+/******************************************************************************/
+/* OpenCL declarations */
+
+typedef int32_t cl_int;
+typedef uint32_t cl_uint;
+typedef uint64_t cl_bitfield;
+typedef cl_uint cl_bool;
+typedef intptr_t cl_context_properties;
+typedef struct _cl_platform_id *cl_platform_id;
+typedef struct _cl_device_id *cl_device_id;
+typedef struct _cl_context *cl_context;
+typedef struct _cl_command_queue *cl_command_queue;
+typedef struct _cl_program *cl_program;
+typedef struct _cl_kernel *cl_kernel;
+typedef struct _cl_mem *cl_mem;
+typedef struct _cl_event *cl_event;
+
+#define CL_SUCCESS 0
+#define CL_TRUE 1
+#define CL_DEVICE_TYPE_GPU (1 << 2)
+#define CL_MEM_WRITE_ONLY (1 << 1)
+#define CL_MEM_READ_ONLY (1 << 2)
+#define CL_PROGRAM_BUILD_LOG 0x1183
+
+/* Entry points, without their 'cl' prefix. */
+typedef struct
+{
+    cl_int (*GetPlatformIDs)(cl_uint, cl_platform_id *, cl_uint *);
+    cl_int (*GetDeviceIDs)(cl_platform_id, cl_bitfield, cl_uint, cl_device_id *, cl_uint *);
+    cl_context (*CreateContext)(const cl_context_properties *, cl_uint, const cl_device_id *,
+                                void (*)(const char *, const void *, size_t, void *), void *, cl_int *);
+    cl_command_queue (*CreateCommandQueue)(cl_context, cl_device_id, cl_bitfield, cl_int *);
+    cl_program (*CreateProgramWithSource)(cl_context, cl_uint, const char **, const size_t *, cl_int *);
+    cl_int (*BuildProgram)(cl_program, cl_uint, const cl_device_id *, const char *,
+                           void (*)(cl_program, void *), void *);
+    cl_int (*GetProgramBuildInfo)(cl_program, cl_device_id, cl_uint, size_t, void *, size_t *);
+    cl_kernel (*CreateKernel)(cl_program, const char *, cl_int *);
+    cl_mem (*CreateBuffer)(cl_context, cl_bitfield, size_t, void *, cl_int *);
+    cl_int (*SetKernelArg)(cl_kernel, cl_uint, size_t, const void *);
+    cl_int (*EnqueueNDRangeKernel)(cl_command_queue, cl_kernel, cl_uint, const size_t *, const size_t *,
+                                   const size_t *, cl_uint, const cl_event *, cl_event *);
+    cl_int (*EnqueueReadBuffer)(cl_command_queue, cl_mem, cl_bool, size_t, size_t, void *,
+                                cl_uint, const cl_event *, cl_event *);
+    cl_int (*EnqueueWriteBuffer)(cl_command_queue, cl_mem, cl_bool, size_t, size_t, const void *,
+                                 cl_uint, const cl_event *, cl_event *);
+    cl_int (*ReleaseMemObject)(cl_mem);
+    cl_int (*ReleaseKernel)(cl_kernel);
+    cl_int (*ReleaseProgram)(cl_program);
+    cl_int (*ReleaseCommandQueue)(cl_command_queue);
+    cl_int (*ReleaseContext)(cl_context);
+} opencl;
+
+/******************************************************************************/
+/* Device */
+
+/* One work item per sink pixel. The matrix is the inverse mapping, in single
+precision. */
+static const char *kernel_source =
+    "__kernel void warp(__global uchar4 *sink, __global const uchar4 *bg, int bg_width, int bg_height,\n"
+    "                   __constant float *m, int bilinear,\n"
+    "                   __global const int *spans, int use_spans, uchar4 background)\n"
+    "{\n"
+    "    int x = get_global_id(0), y = get_global_id(1);\n"
+    "    __global uchar4 *out = &sink[(size_t)y * get_global_size(0) + x];\n"
+    "    if (use_spans && (x < spans[2 * y] || x >= spans[2 * y + 1]))\n"
+    "    {\n"
+    "        *out = background;\n"
+    "        return;\n"
+    "    }\n"
+    "    float r = 1 / (m[6] * x + m[7] * y + m[8]);\n"
+    "    float px = (m[0] * x + m[1] * y + m[2]) * r;\n"
+    "    float py = (m[3] * x + m[4] * y + m[5]) * r;\n"
+    "    px = px > 0 ? px : 0;\n"
+    "    px = px < bg_width - 1 ? px : bg_width - 1;\n"
+    "    py = py > 0 ? py : 0;\n"
+    "    py = py < bg_height - 1 ? py : bg_height - 1;\n"
+    "    if (!bilinear)\n"
+    "    {\n"
+    "        *out = bg[(size_t)round(py) * bg_width + (int)round(px)];\n"
+    "        return;\n"
+    "    }\n"
+    "    float fx = floor(px), fy = floor(py);\n"
+    "    int wx = (px - fx) * 256 + 0.5f, wy = (py - fy) * 256 + 0.5f;\n"
+    "    int x0 = fx, y0 = fy;\n"
+    "    int dx = x0 < bg_width - 1, dy = y0 < bg_height - 1 ? bg_width : 0;\n"
+    "    __global const uchar4 *p = &bg[(size_t)y0 * bg_width + x0];\n"
+    "    int4 c = convert_int4(p[0]) * ((256 - wx) * (256 - wy)) + convert_int4(p[dx]) * (wx * (256 - wy))\n"
+    "             + convert_int4(p[dy]) * ((256 - wx) * wy) + convert_int4(p[dy + dx]) * (wx * wy);\n"
+    "    *out = convert_uchar4((c + 32768) >> 16);\n"
+    "}\n";
+
+/* Number of warps running at once which keep their kernel and buffers. */
+#define GPU_SLOTS 4
+
+/* A kernel and the buffers of its arguments, with their sizes in bytes. Kernel
+arguments are not thread-safe, so a slot serves one warp at a time. */
+typedef struct
+{
+    cl_kernel kernel;
+    cl_mem sink, bg, matrix, spans;
+    size_t sink_size, bg_size, matrix_size, spans_size;
+    bool busy;
+} slot;
+
+typedef struct
+{
+    opencl cl;
+    cl_device_id id;
+    cl_context context;
+    cl_command_queue queue;
+    cl_program program;
+    bool ready;
+    pthread_mutex_t lock;
+    slot slots[GPU_SLOTS];
+} device;
+
+static device gpu = { .ready = false, .lock = PTHREAD_MUTEX_INITIALIZER };
+static pthread_once_t gpu_once = PTHREAD_ONCE_INIT;
+
+/* Resolve the entry points of 'library'. */
+static bool load_opencl(opencl *cl, void *library)
+{
+    static const struct
+    {
+        const char *name;
+        size_t offset;
+    } symbols[] =
+    {
+        { "clGetPlatformIDs", offsetof(opencl, GetPlatformIDs) },
+        { "clGetDeviceIDs", offsetof(opencl, GetDeviceIDs) },
+        { "clCreateContext", offsetof(opencl, CreateContext) },
+        { "clCreateCommandQueue", offsetof(opencl, CreateCommandQueue) },
+        { "clCreateProgramWithSource", offsetof(opencl, CreateProgramWithSource) },
+        { "clBuildProgram", offsetof(opencl, BuildProgram) },
+        { "clGetProgramBuildInfo", offsetof(opencl, GetProgramBuildInfo) },
+        { "clCreateKernel", offsetof(opencl, CreateKernel) },
+        { "clCreateBuffer", offsetof(opencl, CreateBuffer) },
+        { "clSetKernelArg", offsetof(opencl, SetKernelArg) },
+        { "clEnqueueNDRangeKernel", offsetof(opencl, EnqueueNDRangeKernel) },
+        { "clEnqueueReadBuffer", offsetof(opencl, EnqueueReadBuffer) },
+        { "clEnqueueWriteBuffer", offsetof(opencl, EnqueueWriteBuffer) },
+        { "clReleaseMemObject", offsetof(opencl, ReleaseMemObject) },
+        { "clReleaseKernel", offsetof(opencl, ReleaseKernel) },
+        { "clReleaseProgram", offsetof(opencl, ReleaseProgram) },
+        { "clReleaseCommandQueue", offsetof(opencl, ReleaseCommandQueue) },
+        { "clReleaseContext", offsetof(opencl, ReleaseContext) }
+    };
+    size_t i;
+    for (i = 0; i < sizeof symbols / sizeof symbols[0]; i++)
+    {
+        /* ISO C does not convert object pointers to function pointers, POSIX
+        guarantees they have the same representation. */
+        void *symbol = dlsym(library, symbols[i].name);
+        if (!symbol)
+        {
+            return false;
+        }
+        memcpy((char *)cl + symbols[i].offset, &symbol, sizeof symbol);
+    }
+    return true;
+}
+
+/* Print the build log of the program of 'd'. */
+static void build_log(const device *d)
+{
+    size_t size = 0;
+    if (d->cl.GetProgramBuildInfo(d->program, d->id, CL_PROGRAM_BUILD_LOG, 0, NULL, &size) != CL_SUCCESS)
+    {
+        return;
+    }
+    char *log = malloc(size + 1);
+    if (log && d->cl.GetProgramBuildInfo(d->program, d->id, CL_PROGRAM_BUILD_LOG, size, log, NULL) == CL_SUCCESS)
+    {
+        log[size] = '\0';
+        fprintf(stderr, "%s\n", log);
+    }
+    free(log);
+}
+
+/* Set up the first GPU of the first platform having one. */
+static void gpu_init(void)
+{
+    device *d = &gpu;
+    void *library = dlopen("libOpenCL.so.1", RTLD_NOW | RTLD_LOCAL);
+    if (!library)
+    {
+        library = dlopen("libOpenCL.so", RTLD_NOW | RTLD_LOCAL);
+    }
+    if (!library || !load_opencl(&d->cl, library))
+    {
+        fprintf(stderr, "OpenCL is not available, warping on the CPU.\n");
+        return;
+    }
+
+    cl_platform_id platforms[8];
+    cl_uint platform_count = 0, i;
+    if (d->cl.GetPlatformIDs(sizeof platforms / sizeof platforms[0], platforms, &platform_count) != CL_SUCCESS)
+    {
+        platform_count = 0;
+    }
+    /* The count is that of all the platforms, not of those written. */
+    if (platform_count > sizeof platforms / sizeof platforms[0])
+    {
+        platform_count = sizeof platforms / sizeof platforms[0];
+    }
+    cl_uint device_count = 0;
+    for (i = 0; i < platform_count && device_count == 0; i++)
+    {
+        if (d->cl.GetDeviceIDs(platforms[i], CL_DEVICE_TYPE_GPU, 1, &d->id, &device_count) != CL_SUCCESS)
+        {
+            device_count = 0;
+        }
+    }
+    if (device_count == 0)
+    {
+        fprintf(stderr, "No GPU found, warping on the CPU.\n");
+        return;
+    }
+
+    cl_int error;
+    d->context = d->cl.CreateContext(NULL, 1, &d->id, NULL, NULL, &error);
+    if (error != CL_SUCCESS)
+    {
+        fprintf(stderr, "OpenCL context creation error %d, warping on the CPU.\n", error);
+        return;
+    }
+    d->queue = d->cl.CreateCommandQueue(d->context, d->id, 0, &error);
+    if (error != CL_SUCCESS)
+    {
+        fprintf(stderr, "OpenCL queue creation error %d, warping on the CPU.\n", error);
+        d->cl.ReleaseContext(d->context);
+        return;
+    }
+    d->program = d->cl.CreateProgramWithSource(d->context, 1, &kernel_source, NULL, &error);
+    if (error == CL_SUCCESS)
+    {
+        error = d->cl.BuildProgram(d->program, 1, &d->id, NULL, NULL, NULL);
+        if (error != CL_SUCCESS)
+        {
+            build_log(d);
+            d->cl.ReleaseProgram(d->program);
+        }
+    }
+    if (error != CL_SUCCESS)
+    {
+        fprintf(stderr, "OpenCL program build error %d, warping on the CPU.\n", error);
+        d->cl.ReleaseCommandQueue(d->queue);
+        d->cl.ReleaseContext(d->context);
+        return;
+    }
+    /* The device lives as long as the process. */
+    d->ready = true;
+}
+
+/******************************************************************************/
+
+/* Release what 's' holds, e.g. after an error, so that the next warp taking it
+starts afresh. */
+static void slot_clear(const device *d, slot *s)
+{
+    cl_mem *buffers[] = { &s->sink, &s->bg, &s->matrix, &s->spans };
+    size_t i;
+    for (i = 0; i < sizeof buffers / sizeof buffers[0]; i++)
+    {
+        if (*buffers[i])
+        {
+            d->cl.ReleaseMemObject(*buffers[i]);
+        }
+        *buffers[i] = NULL;
+    }
+    if (s->kernel)
+    {
+        d->cl.ReleaseKernel(s->kernel);
+    }
+    s->kernel = NULL;
+    s->sink_size = s->bg_size = s->matrix_size = s->spans_size = 0;
+}
+
+/* Make '*buffer' hold at least 'size' bytes: it is only reallocated when it is
+too small. */
+static cl_int reserve(const device *d, cl_mem *buffer, size_t *capacity, size_t size, cl_bitfield flags)
+{
+    if (*buffer && *capacity >= size)
+    {
+        return CL_SUCCESS;
+    }
+    if (*buffer)
+    {
+        d->cl.ReleaseMemObject(*buffer);
+    }
+    cl_int error;
+    *buffer = d->cl.CreateBuffer(d->context, flags, size, NULL, &error);
+    if (error != CL_SUCCESS)
+    {
+        *buffer = NULL;
+        *capacity = 0;
+        return error;
+    }
+    *capacity = size;
+    return CL_SUCCESS;
+}
+
+/* Run one warp with the kernel and buffers of 's', allocating what is missing. */
+static cl_int slot_warp(const device *d, slot *s, color *sink_data, coord sink_width, coord sink_height,
+                        const color *bg_data, coord bg_width, coord bg_height,
+                        const float m[9], cl_int bilinear, const coord *spans, color background)
+{
+    cl_int use_spans = spans != NULL;
+    /* Without spans the kernel still needs a buffer to bind. */
+    coord none[2] = { 0, 0 };
+    size_t sink_size = (size_t)sink_width * sink_height * sizeof (color);
+    size_t bg_size = (size_t)bg_width * bg_height * sizeof (color);
+    size_t spans_size = spans ? 2 * (size_t)sink_height * sizeof *spans : sizeof none;
+    size_t matrix_size = 9 * sizeof *m;
+
+    cl_int status = CL_SUCCESS;
+    if (!s->kernel)
+    {
+        s->kernel = d->cl.CreateKernel(d->program, "warp", &status);
+        if (status != CL_SUCCESS)
+        {
+            s->kernel = NULL;
+            return status;
+        }
+    }
+    if ((status = reserve(d, &s->sink, &s->sink_size, sink_size, CL_MEM_WRITE_ONLY)) != CL_SUCCESS
+            || (status = reserve(d, &s->bg, &s->bg_size, bg_size, CL_MEM_READ_ONLY)) != CL_SUCCESS
+            || (status = reserve(d, &s->matrix, &s->matrix_size, matrix_size, CL_MEM_READ_ONLY)) != CL_SUCCESS
+            || (status = reserve(d, &s->spans, &s->spans_size, spans_size, CL_MEM_READ_ONLY)) != CL_SUCCESS)
+    {
+        return status;
+    }
+
+    /* The writes block, so that the caller may change its data as soon as the
+    warp returns, even on errors. */
+    if ((status = d->cl.EnqueueWriteBuffer(d->queue, s->bg, CL_TRUE, 0, bg_size, bg_data, 0, NULL, NULL))
+            != CL_SUCCESS
+            || (status = d->cl.EnqueueWriteBuffer(d->queue, s->matrix, CL_TRUE, 0, matrix_size, m, 0, NULL, NULL))
+            != CL_SUCCESS
+            || (status = d->cl.EnqueueWriteBuffer(d->queue, s->spans, CL_TRUE, 0, spans_size,
+                         spans ? (const void *)spans : none, 0, NULL, NULL)) != CL_SUCCESS)
+    {
+        return status;
+    }
+
+    /* The buffers may have been reallocated, so the arguments are set again. */
+    const struct
+    {
+        size_t size;
+        const void *value;
+    } args[] =
+    {
+        { sizeof s->sink, &s->sink },
+        { sizeof s->bg, &s->bg },
+        { sizeof bg_width, &bg_width },
+        { sizeof bg_height, &bg_height },
+        { sizeof s->matrix, &s->matrix },
+        { sizeof bilinear, &bilinear },
+        { sizeof s->spans, &s->spans },
+        { sizeof use_spans, &use_spans },
+        { sizeof background, &background }
+    };
+    size_t i;
+    for (i = 0; i < sizeof args / sizeof args[0] && status == CL_SUCCESS; i++)
+    {
+        status = d->cl.SetKernelArg(s->kernel, i, args[i].size, args[i].value);
+    }
+    if (status == CL_SUCCESS)
+    {
+        size_t global[2] = { sink_width, sink_height };
+        status = d->cl.EnqueueNDRangeKernel(d->queue, s->kernel, 2, NULL, global, NULL, 0, NULL, NULL);
+    }
+    if (status == CL_SUCCESS)
+    {
+        status = d->cl.EnqueueReadBuffer(d->queue, s->sink, CL_TRUE, 0, sink_size, sink_data, 0, NULL, NULL);
+    }
+    return status;
+}
+
+bool gpu_warp(color *sink_data, coord sink_width, coord sink_height,
+              const color *bg_data, coord bg_width, coord bg_height,
+              const double inverse[9], interpolation interp,
+              const coord *spans, color background)
+{
+    pthread_once(&gpu_once, gpu_init);
+    device *d = &gpu;
+    if (!d->ready || !gpu_supports(interp))
+    {
+        return false;
+    }
+
+    float m[9];
+    size_t i;
+    for (i = 0; i < 9; i++)
+    {
+        m[i] = inverse[i];
+    }
+
+    /* A free slot, or else a temporary one. */
+    slot temporary = { .busy = true };
+    slot *s = &temporary;
+    pthread_mutex_lock(&d->lock);
+    for (i = 0; i < GPU_SLOTS; i++)
+    {
+        if (!d->slots[i].busy)
+        {
+            s = &d->slots[i];
+            s->busy = true;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&d->lock);
+
+    cl_int status = slot_warp(d, s, sink_data, sink_width, sink_height, bg_data, bg_width, bg_height,
+                              m, interp == INTERP_BILINEAR, spans, background);
+    if (status != CL_SUCCESS || s == &temporary)
+    {
+        slot_clear(d, s);
+    }
+    pthread_mutex_lock(&d->lock);
+    s->busy = false;
+    pthread_mutex_unlock(&d->lock);
+
+    if (status != CL_SUCCESS)
+    {
+        fprintf(stderr, "OpenCL warp error %d, warping on the CPU.\n", status);
+        return false;
+    }
+    return true;
+}
+
+#endif
@@ -0,0 +1,18 @@
+#ifndef GPU_H
+#define GPU_H
+
+#include "perspector.h"
+
+/* Whether gpu_warp() can sample with 'interp'. */
+bool gpu_supports(interpolation interp);
+
+/* Inverse mapping of 'bg' to the sink through 'inverse' on an OpenCL device,
+see gpu.c. With 'spans', the sink pixels out of [spans[2y], spans[2y + 1][ on
+row 'y' get 'background'. Return false, having reported why, if there is no
+device or the warp fails on it: the caller then warps on the CPU. */
+bool gpu_warp(color *sink_data, coord sink_width, coord sink_height,
+              const color *bg_data, coord bg_width, coord bg_height,
+              const double inverse[9], interpolation interp,
+              const coord *spans, color background);
+
+#endif
@@ -4,20 +4,39 @@ All GUI-related features are found in this file.
 The GUI is written in GTK3. There a drawable area using Cairo where we display
 the picture and on which we can draw the anchors; this could arguably be made
 independent.
+
+The picture is kept as a pyramid of halvings. Exposed regions are painted from
+the level closest to the zoom, so that zooming out never resamples more than
+twice the pixels shown, and Cairo only rasterizes the clip. The anchors are a
+vector overlay drawn on top: moving one only invalidates the squares around its
+old and new positions.
+
+Next to it, a live preview shows the result while the anchors are placed and
+dragged. The preview is warped by a worker thread from halved copies of the
+picture, coarsest first, so that a rough result shows up at once and sharpens
+as finer levels complete. Each change of the anchors or of the ratio bumps a
+generation counter: the job in progress sees it between two strips and gives
+up, and only the latest request is kept. The main thread never warps anything
+for the preview.
+
+Processing the full picture also happens in a worker thread. It reports its
+progress to the status bar and can be cancelled, which the core notices between
+two chunks of rows.
 */
 
 /*
 TODO: When shrinking the window, status bar disappears.
 TODO: UI: center drawable_area.
 TODO: Destroy widgets properly.
-TODO: support JPG and other formats.
 */
 
 #include <gtk/gtk.h>
+#include <inttypes.h>
 #include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
 
+#include "image.h"
 #include "perspector.h"
 
 /* GUI properties */
@@ -25,25 +44,84 @@ TODO: support JPG and other formats.
 #define ZOOM_FACTOR 20
 #define ZOOM_MIN 0.2
 #define ZOOM_MAX 5
-
-/* Anchors live in the global space since their are unique. */
+/* Minimum longest side of JPEG previews, see image_load_preview(). */
+#define PREVIEW_SIZE 2048
+/* Size of the live preview pane. */
+#define LIVE_PANE 256
+/* Longest sides of the coarsest and finest live preview levels. */
+#define LIVE_MIN 128
+#define LIVE_MAX 512
+/* Most levels of the zoom pyramid, down to LIVE_MIN. */
+#define PYRAMID_LEVELS 16
+/* Rows warped between checks for newer requests. */
+#define LIVE_STRIP 16
+
+/* Anchors live in the global space since their are unique. They are in
+preview coordinates. */
 static pixelset anchors = { .count = 0 };
 
-/* Surface to store current scribbles */
-static cairo_surface_t *surface = NULL;
-/* Surface to store background */
+/* Surface to store background, a view of 'preview' */
 static cairo_surface_t *bg = NULL;
+static image preview;
+/* Halvings of 'preview', finest first: level k is 1 / 2^k of it and level 0 is
+'preview' itself. They are only changed while the live worker is idle. */
+static image levels[PYRAMID_LEVELS];
+static size_t level_count = 0;
+/* The full picture is only decoded when processing. */
+static char *bg_path = NULL;
+static int bg_scale = 1;
 /* Surface to store result of transform */
 static cairo_surface_t *sink = NULL;
 
+/* Live preview. Latest complete frame, owned by the main thread. */
+static image live_frame = { .handle = NULL };
+static GtkWidget *live_area;
+
+typedef struct
+{
+    pixelset anchors;
+    double ratio;
+    crop crop;
+} live_request;
+
+static struct
+{
+    GThread *thread;
+    GMutex lock;
+    GCond cond;
+    live_request request;
+    bool pending, busy, quit;
+    /* Read without the lock by running jobs. */
+    gint generation;
+} live;
+
+/* A frame on its way to the main thread. */
+typedef struct
+{
+    image img;
+    gint generation;
+} live_result;
+
+/* Processing job, see process_worker(). 'process_id' is only used by the main
+thread: jobs whose id is not the current one are abandoned. */
+static GThread *process_thread = NULL;
+static guint process_id = 0;
+static gint process_cancel = 0;
+static GtkWidget *process_button;
+static GtkWidget *cancel_button;
+
 static GtkWidget *ratio_width;
 static GtkWidget *ratio_height;
+/* Entries follow the order of the crop enum. */
+static GtkWidget *crop_mode;
 static GtkWidget *status;
 static GtkWidget *drawable_area;
 static GtkWidget *out;
 
 static double zoom = 0;
 static bool ctrl_pressed = false;
+/* Index of the anchor being dragged, or -1. */
+static int dragged = -1;
 
 /******************************************************************************/
 /* Tools */
@@ -80,16 +158,37 @@ char *file_suffix(const char *path, const char *suffix)
     char *result = malloc(len * sizeof (char));
     snprintf(result, len, "%s/%s%s%s", dname, bname, suffix, ext);
 
-    free(dirc);
-    free(basec);
+    /* 'ext' points into 'basec'. */
     if (*ext != '\0')
     {
         free(bname);
     }
+    free(dirc);
+    free(basec);
 
     return result;
 }
 
+/* Name of the output of 'path'. The result is written as PNG, so the
+extension is changed unless it is already PNG or raw. Return value must be
+freed. */
+static char *output_name(const char *path)
+{
+    char *name = file_suffix(path, "-new");
+    char *ext = strrchr(name, '.');
+    if (!ext || strchr(ext, '/') || !strcmp(ext, ".png") || !strcmp(ext, ".PNG") || image_raw_path(name))
+    {
+        return name;
+    }
+    size_t length = ext - name;
+    char *result = realloc(name, length + sizeof ".png");
+    if (!result)
+    {
+        return name;
+    }
+    strcpy(result + length, ".png");
+    return result;
+}
 
 /******************************************************************************/
 /* GTK tools */
@@ -123,78 +222,546 @@ double zoom_value(double z)
     }
 }
 
-/* Draw a rectangle on the surface at the given position */
-static void draw_brush(GtkWidget *widget, coord x, coord y)
+/* Draw the anchors over the picture. */
+static void draw_anchors(cairo_t *cr, double z)
+{
+    size_t i;
+    for (i = 0; i < anchors.count; i++)
+    {
+        double x = anchors.pixels[i].x * z;
+        double y = anchors.pixels[i].y * z;
+        double brush = BRUSHSZ;
+
+        cairo_set_source_rgb(cr, 1, 0, 0);
+        cairo_rectangle(cr, x - brush / 2, y - brush / 2, brush, brush);
+        cairo_fill(cr);
+
+        brush = BRUSHSZ - 3;
+        cairo_set_source_rgb(cr, 0, 0, 0);
+        cairo_rectangle(cr, x - brush / 2, y - brush / 2, brush, brush);
+        cairo_fill(cr);
+    }
+}
+
+/* Invalidate the region of the drawing area covered by an anchor at the given
+position. One more pixel on each side covers the rounding. */
+static void queue_anchor(GtkWidget *widget, coord x, coord y)
+{
+    double z = zoom_value(zoom);
+    gtk_widget_queue_draw_area(widget, x * z - BRUSHSZ / 2 - 1, y * z - BRUSHSZ / 2 - 1, BRUSHSZ + 2, BRUSHSZ + 2);
+}
+
+/* Fit the drawing area to the zoomed picture and repaint it. */
+static void resize_area(void)
 {
-    cairo_t *cr = cairo_create(surface);
+    if (!bg)
+    {
+        return;
+    }
     double z = zoom_value(zoom);
-    double brush = BRUSHSZ;
+    gtk_widget_set_size_request(drawable_area, preview.width * z, preview.height * z);
+    gtk_widget_queue_draw(drawable_area);
+}
 
-    cairo_set_source_rgb(cr, 1, 0, 0);
-    cairo_rectangle(cr, x * z - brush / 2, y * z - brush / 2, brush, brush);
-    cairo_fill(cr);
+/******************************************************************************/
+/* Zoom pyramid */
+
+/* Halve 'preview' until it fits in LIVE_MIN. */
+static void build_levels(void)
+{
+    const char *error;
+    levels[0] = preview;
+    level_count = 1;
+    while (level_count < PYRAMID_LEVELS
+            && (levels[level_count - 1].width > LIVE_MIN || levels[level_count - 1].height > LIVE_MIN)
+            && image_reduce(&levels[level_count], &levels[level_count - 1], &error))
+    {
+        level_count++;
+    }
+}
 
-    brush = BRUSHSZ - 3;
-    cairo_set_source_rgb(cr, 0, 0, 0);
-    cairo_rectangle(cr, x * z - brush / 2, y * z - brush / 2, brush, brush);
-    cairo_fill(cr);
+static void free_levels(void)
+{
+    size_t i;
+    /* Level 0 is not a copy. */
+    for (i = 1; i < level_count; i++)
+    {
+        image_free(&levels[i]);
+    }
+    level_count = 0;
+}
 
-    cairo_destroy(cr);
+/* Coarsest level with at least one pixel per screen pixel at zoom 'z'. */
+static size_t level_for_zoom(double z)
+{
+    size_t k = 0;
+    while (k + 1 < level_count && 1.0 / ((coord)1 << (k + 1)) >= z)
+    {
+        k++;
+    }
+    return k;
+}
 
-    /* Now invalidate the affected region of the drawing area. */
-    gtk_widget_queue_draw_area(widget, x * z - BRUSHSZ / 2, y * z - BRUSHSZ / 2, BRUSHSZ, BRUSHSZ);
+static inline cairo_surface_t *level_surface(size_t k)
+{
+    /* 'preview' may be a raw mapping without a surface. */
+    return k ? levels[k].handle : bg;
 }
 
-static void clear_surface(void)
+/******************************************************************************/
+
+/* Parse the ratio entries. On failure, 'error' is set to a static message. */
+static bool read_ratio(double *ratio, const char **error)
 {
-    if (!bg)
+    errno = 0;
+    double ratio_w = strtod(gtk_entry_get_text(GTK_ENTRY(ratio_width)), NULL);
+    if (errno || ratio_w <= 0)
     {
-        return;
+        *error = "Wrong value for width.";
+        return false;
+    }
+    double ratio_h = strtod(gtk_entry_get_text(GTK_ENTRY(ratio_height)), NULL);
+    if (errno || ratio_h <= 0)
+    {
+        *error = "Wrong value for height.";
+        return false;
     }
+    *ratio = ratio_w / ratio_h;
+    return true;
+}
 
-    cairo_t *cr = cairo_create(surface);
-    double z = zoom_value(zoom);
-    cairo_scale(cr, z, z);
-    cairo_set_source_surface(cr, bg, 0, 0);
+static crop read_crop(void)
+{
+    gint active = gtk_combo_box_get_active(GTK_COMBO_BOX(crop_mode));
+    return active < 0 ? CROP_ENLARGE : (crop)active;
+}
 
-    /* set a minimum size */
-    int width = cairo_image_surface_get_width(bg);
-    int height = cairo_image_surface_get_height(bg);
-    gtk_widget_set_size_request(drawable_area, width * z, height * z);
+/* Options of the warp of a picture cropped with 'mode'. */
+static void crop_options(options *opts, crop mode)
+{
+    options_init(opts);
+    /* The picture is surrounded with transparent pixels. */
+    opts->outside = mode == CROP_KEEP ? OUTSIDE_BACKGROUND : OUTSIDE_EXTEND;
+}
 
-    cairo_paint(cr);
-    cairo_destroy(cr);
+/******************************************************************************/
+/* Live preview */
+
+static bool live_read(void *data, coord begin, coord end, color *rows)
+{
+    const image *level = data;
+    memcpy(rows, level->data + (size_t)begin * level->width, (size_t)(end - begin) * level->width * sizeof (color));
+    return true;
+}
+
+typedef struct
+{
+    image *frame;
+    gint generation;
+} live_output;
+
+/* Returning false stops the warp as soon as a newer request comes. */
+static bool live_write(void *data, coord begin, coord end, const color *rows)
+{
+    live_output *output = data;
+    memcpy(output->frame->data + (size_t)begin * output->frame->width, rows,
+           (size_t)(end - begin) * output->frame->width * sizeof (color));
+    return g_atomic_int_get(&live.generation) == output->generation;
+}
+
+static gboolean live_show(gpointer data)
+{
+    live_result *result = data;
+    if (result->generation != g_atomic_int_get(&live.generation))
+    {
+        image_free(&result->img);
+    }
+    else
+    {
+        if (live_frame.handle)
+        {
+            image_free(&live_frame);
+        }
+        live_frame = result->img;
+        gtk_widget_queue_draw(live_area);
+    }
+    g_free(result);
+    return FALSE;
+}
+
+/* Warp the levels up to LIVE_MAX, coarsest first, until a newer request
+comes. */
+static void live_run(const live_request *request, gint generation)
+{
+    options opts;
+    crop_options(&opts, request->crop);
+
+    size_t i = level_count;
+    while (i-- > 0 && g_atomic_int_get(&live.generation) == generation)
+    {
+        const image *level = &levels[i];
+        /* Always warp the coarsest level, then stop past LIVE_MAX. */
+        if (i + 1 < level_count && (level->width > LIVE_MAX || level->height > LIVE_MAX))
+        {
+            break;
+        }
+        /* The box filter puts preview pixel x in level pixel x / scale. */
+        coord scale = (coord)1 << i;
+        pixelset a = request->anchors;
+        size_t j;
+        for (j = 0; j < a.count; j++)
+        {
+            a.pixels[j].x /= scale;
+            a.pixels[j].y /= scale;
+        }
+
+        coord width, height;
+        if (!sink_geometry(&a, request->ratio, request->crop, level->width, level->height,
+                           &width, &height, &opts.placement))
+        {
+            continue;
+        }
+        /* Anchors may collapse on coarse levels: try the next one. */
+        transform *t = transform_new(&a, width, height, level->width, level->height, &opts);
+        if (!t)
+        {
+            continue;
+        }
+
+        const char *error;
+        live_result *result = g_malloc(sizeof *result);
+        result->generation = generation;
+        if (!image_create(&result->img, width, height, &error))
+        {
+            g_free(result);
+            transform_free(t);
+            return;
+        }
+        live_output output = { &result->img, generation };
+        bool done = transform_stream(t, LIVE_STRIP, live_read, (void *)level, live_write, &output);
+        transform_free(t);
+        if (!done)
+        {
+            image_free(&result->img);
+            g_free(result);
+            return;
+        }
+        cairo_surface_mark_dirty(result->img.handle);
+        g_idle_add(live_show, result);
+    }
+}
+
+static gpointer live_worker(gpointer data)
+{
+    (void)data;
+
+    g_mutex_lock(&live.lock);
+    for (;;)
+    {
+        while (!live.pending && !live.quit)
+        {
+            g_cond_wait(&live.cond, &live.lock);
+        }
+        if (live.quit)
+        {
+            break;
+        }
+        live_request request = live.request;
+        gint generation = g_atomic_int_get(&live.generation);
+        live.pending = false;
+        live.busy = true;
+        g_mutex_unlock(&live.lock);
+
+        live_run(&request, generation);
+
+        g_mutex_lock(&live.lock);
+        live.busy = false;
+        g_cond_broadcast(&live.cond);
+    }
+    g_mutex_unlock(&live.lock);
+    return NULL;
+}
+
+/* Drop the frame and stop the job in progress, if any. On return the worker
+does not touch the levels. */
+static void live_stop(void)
+{
+    g_mutex_lock(&live.lock);
+    g_atomic_int_inc(&live.generation);
+    live.pending = false;
+    while (live.busy)
+    {
+        g_cond_wait(&live.cond, &live.lock);
+    }
+    g_mutex_unlock(&live.lock);
+
+    if (live_frame.handle)
+    {
+        image_free(&live_frame);
+        live_frame.handle = NULL;
+    }
+    gtk_widget_queue_draw(live_area);
+}
+
+/* Request a new preview for the current anchors. Cheap: all the work is left to
+the worker. */
+static void live_update(void)
+{
+    live_request request = { .anchors = anchors, .crop = read_crop() };
+    const char *error;
+    bool usable = bg && anchors.count == 4 && read_ratio(&request.ratio, &error);
+
+    g_mutex_lock(&live.lock);
+    g_atomic_int_inc(&live.generation);
+    live.request = request;
+    live.pending = usable;
+    g_cond_signal(&live.cond);
+    g_mutex_unlock(&live.lock);
+
+    if (!usable && live_frame.handle)
+    {
+        image_free(&live_frame);
+        live_frame.handle = NULL;
+        gtk_widget_queue_draw(live_area);
+    }
+}
+
+/******************************************************************************/
+/* Processing */
+
+/* Owned by the worker until it hands it to process_done(). */
+typedef struct
+{
+    guint id;
+    /* 'bg' and 'path' stay valid while the worker runs, see process_stop(). */
+    image bg;
+    const char *path;
+    int scale;
+    pixelset anchors;
+    double ratio;
+    crop crop;
+    /* Last percentage sent to the status bar. */
+    int percent;
+    cairo_surface_t *result;
+    const char *error;
+    stats stats;
+} process_job;
+
+typedef struct
+{
+    guint id;
+    int percent;
+} process_report;
+
+static gboolean process_show(gpointer data)
+{
+    process_report *report = data;
+    if (report->id == process_id)
+    {
+        char text[32];
+        snprintf(text, sizeof text, "Processing: %d%%", report->percent);
+        gtk_label_set_text(GTK_LABEL(status), text);
+    }
+    g_free(report);
+    return FALSE;
+}
+
+/* Called by the warp threads, one at a time. */
+static bool process_progress(void *data, size_t done, size_t total)
+{
+    process_job *job = data;
+    int percent = total ? (int)(100 * done / total) : 100;
+    if (percent != job->percent)
+    {
+        process_report *report = g_malloc(sizeof *report);
+        report->id = job->id;
+        report->percent = job->percent = percent;
+        g_idle_add(process_show, report);
+    }
+    return !g_atomic_int_get(&process_cancel);
+}
+
+static void process_buttons(bool running)
+{
+    gtk_widget_set_sensitive(process_button, !running);
+    gtk_widget_set_sensitive(cancel_button, running);
+}
+
+static gboolean process_done(gpointer data)
+{
+    process_job *job = data;
+    if (job->id == process_id)
+    {
+        g_thread_join(process_thread);
+        process_thread = NULL;
+        process_buttons(false);
+
+        /* A cancelled job leaves the previous result alone. */
+        if (job->result || !g_atomic_int_get(&process_cancel))
+        {
+            if (sink)
+            {
+                cairo_surface_destroy(sink);
+            }
+            sink = job->result;
+            job->result = NULL;
+        }
+        if (job->error)
+        {
+            gtk_label_set_text(GTK_LABEL(status), job->error);
+        }
+        else
+        {
+            const stats *s = &job->stats;
+            char text[192];
+            snprintf(text, sizeof text, "Transformation applied: solve %.3f s, map %.3f s, fill %.3f s, "
+                     "%" PRIu64 " pixels discarded, %" PRIu64 " holes (radius max %.1f, mean %.2f).",
+                     s->solve_time, s->map_time, s->fill_time, s->discarded, s->holes, s->radius_max, s->radius_mean);
+            gtk_label_set_text(GTK_LABEL(status), text);
+        }
+    }
+    if (job->result)
+    {
+        cairo_surface_destroy(job->result);
+    }
+    g_free(job);
+    return FALSE;
+}
+
+static gpointer process_worker(gpointer data)
+{
+    process_job *job = data;
 
-    /* Draw anchors. */
+    /* The anchors were picked on the preview: decode the full picture now and
+    put them at the center of the pixels they cover. */
+    image full = job->bg;
+    if (job->scale > 1 && !image_load(&full, job->path, &job->error))
+    {
+        g_idle_add(process_done, job);
+        return NULL;
+    }
     size_t i;
-    for (i = 0; i < anchors.count; i++)
+    for (i = 0; i < job->anchors.count; i++)
+    {
+        pixel *p = &job->anchors.pixels[i];
+        p->x = p->x * job->scale + job->scale / 2 < full.width ? p->x * job->scale + job->scale / 2 : full.width - 1;
+        p->y = p->y * job->scale + job->scale / 2 < full.height ? p->y * job->scale + job->scale / 2 : full.height - 1;
+    }
+
+    coord sink_width, sink_height;
+    options opts;
+    crop_options(&opts, job->crop);
+    opts.progress = process_progress;
+    opts.progress_data = job;
+    opts.stats = &job->stats;
+    if (!sink_geometry(&job->anchors, job->ratio, job->crop, full.width, full.height,
+                       &sink_width, &sink_height, &opts.placement))
+    {
+        job->error = job->crop == CROP_ENLARGE ? "Anchors configuration is not usable."
+                     : "The picture cannot be cropped this way.";
+    }
+    else
+    {
+        job->result = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, sink_width, sink_height);
+        if (cairo_surface_status(job->result) != CAIRO_STATUS_SUCCESS)
+        {
+            job->error = cairo_status_to_string(cairo_surface_status(job->result));
+        }
+        else if (!perspector_opts((color *)cairo_image_surface_get_data(job->result), sink_width, sink_height,
+                                  full.data, full.width, full.height, &job->anchors, &opts))
+        {
+            job->error = g_atomic_int_get(&process_cancel) ? "Processing cancelled." : "Anchors configuration is not usable.";
+        }
+        else
+        {
+            cairo_surface_mark_dirty(job->result);
+        }
+        if (job->error)
+        {
+            cairo_surface_destroy(job->result);
+            job->result = NULL;
+        }
+    }
+    if (job->scale > 1)
     {
-        draw_brush(drawable_area, anchors.pixels[i].x, anchors.pixels[i].y);
+        image_free(&full);
     }
+
+    g_idle_add(process_done, job);
+    return NULL;
 }
 
-static void load_image(const char *path)
+/* Cancel the job in progress, if any, and wait for it. Its result is then
+dropped. */
+static void process_stop(void)
+{
+    if (!process_thread)
+    {
+        return;
+    }
+    g_atomic_int_set(&process_cancel, 1);
+    g_thread_join(process_thread);
+    process_thread = NULL;
+    process_id++;
+    process_buttons(false);
+}
+
+/******************************************************************************/
+
+static void free_image(void)
 {
-    cairo_surface_t *oldbg = bg;
-    bg = cairo_image_surface_create_from_png(path);
-    cairo_status_t cstatus = cairo_surface_status(bg);
-    if (cstatus)
+    process_stop();
+    live_stop();
+    free_levels();
+    if (bg)
     {
-        gtk_label_set_text(GTK_LABEL(status), cairo_status_to_string(cstatus));
         cairo_surface_destroy(bg);
-        bg = oldbg;
+        image_free(&preview);
+        bg = NULL;
+    }
+    free(bg_path);
+    bg_path = NULL;
+}
+
+static void load_image(const char *path)
+{
+    image loaded;
+    int scale;
+    const char *error;
+    if (!image_load_preview(&loaded, path, PREVIEW_SIZE, &scale, &error))
+    {
+        gtk_label_set_text(GTK_LABEL(status), error);
+        return;
+    }
+
+    free_image();
+    preview = loaded;
+    bg_scale = scale;
+    bg_path = strdup(path);
+    bg = cairo_image_surface_create_for_data((unsigned char *)preview.data, CAIRO_FORMAT_ARGB32,
+            preview.width, preview.height, preview.width * sizeof (color));
+    build_levels();
+
+    /* Reset anchors */
+    anchors.count = 0;
+    dragged = -1;
+    resize_area();
+
+#define LOAD_TEXT_LEN 128
+    char text[LOAD_TEXT_LEN];
+    if (scale > 1)
+    {
+        snprintf(text, LOAD_TEXT_LEN, "File loaded, previewed at 1/%d.", scale);
     }
     else
     {
-        clear_surface();
-        gtk_label_set_text(GTK_LABEL(status), "File loaded.");
-        /* Reset anchors */
-        anchors.count = 0;
-        char *outname = file_suffix(path, "-new");
-        gtk_entry_set_text(GTK_ENTRY(out), outname);
-        free(outname);
+        snprintf(text, LOAD_TEXT_LEN, "File loaded.");
     }
+    gtk_label_set_text(GTK_LABEL(status), text);
 
+    char *outname = output_name(path);
+    gtk_entry_set_text(GTK_ENTRY(out), outname);
+    free(outname);
 }
 
 /******************************************************************************/
@@ -225,39 +792,57 @@ static void event_open(GtkWidget *widget, gpointer data)
     gtk_widget_destroy(dialog);
 }
 
-/* Create a new surface of the appropriate size to store our scribbles */
-static gboolean event_configure(GtkWidget *widget, GdkEventConfigure *event, gpointer data)
+/* Paint the exposed region from the pyramid, then the anchors. Note that the
+::draw signal receives a ready-to-be-used cairo_t that is already clipped to
+only draw the exposed areas of the widget. */
+static gboolean event_draw(GtkWidget *widget, cairo_t *cr, gpointer data)
 {
-    (void)event;
+    (void)widget;
     (void)data;
-
-    if (surface)
+    if (!bg)
     {
-        cairo_surface_destroy(surface);
+        return FALSE;
     }
 
-    surface = gdk_window_create_similar_surface(gtk_widget_get_window(widget),
-              CAIRO_CONTENT_COLOR,
-              gtk_widget_get_allocated_width(widget),
-              gtk_widget_get_allocated_height(widget));
+    double z = zoom_value(zoom);
+    size_t k = level_for_zoom(z);
+    double level_zoom = z * ((coord)1 << k);
+    cairo_save(cr);
+    cairo_scale(cr, level_zoom, level_zoom);
+    cairo_set_source_surface(cr, level_surface(k), 0, 0);
+    cairo_paint(cr);
+    cairo_restore(cr);
 
-    clear_surface();
-    return TRUE;
+    draw_anchors(cr, z);
+    return FALSE;
 }
 
-/* Redraw the screen from the surface. Note that the ::draw signal receives a
-ready-to-be-used cairo_t that is already clipped to only draw the exposed areas
-of the widget. */
-static gboolean event_draw(GtkWidget *widget, cairo_t *cr, gpointer data)
+/* Fit the latest live frame to the pane. Coarse frames are simply stretched. */
+static gboolean event_live_draw(GtkWidget *widget, cairo_t *cr, gpointer data)
 {
-    (void)widget;
     (void)data;
-    cairo_set_source_surface(cr, surface, 0, 0);
+    if (!live_frame.handle)
+    {
+        return FALSE;
+    }
+
+    double zx = (double)gtk_widget_get_allocated_width(widget) / live_frame.width;
+    double zy = (double)gtk_widget_get_allocated_height(widget) / live_frame.height;
+    double z = zx < zy ? zx : zy;
+    cairo_scale(cr, z, z);
+    cairo_set_source_surface(cr, live_frame.handle, 0, 0);
     cairo_paint(cr);
 
     return FALSE;
 }
 
+static void event_ratio_changed(GtkWidget *widget, gpointer data)
+{
+    (void)widget;
+    (void)data;
+    live_update();
+}
+
 static gboolean event_scroll(GtkWidget *widget, GdkEvent *event, gpointer zoom_status)
 {
     (void)widget;
@@ -275,8 +860,7 @@ static gboolean event_scroll(GtkWidget *widget, GdkEvent *event, gpointer zoom_s
         {
             zoom--;
         }
-        clear_surface();
-        gtk_widget_queue_draw(widget);
+        resize_area();
 
 #define ZOOM_TEXT_LEN 128
         char text[ZOOM_TEXT_LEN];
@@ -289,16 +873,35 @@ static gboolean event_scroll(GtkWidget *widget, GdkEvent *event, gpointer zoom_s
     return FALSE;
 }
 
-/* Handle button press events by either drawing a rectangle or clearing the
- * surface, depending on which button was pressed. The ::button-press signal
- * handler receives a GdkEventButton struct which contains this information.
+/* Index of the last anchor under (x, y), or -1. We loop backward in case
+rectangles are stacked, so that the last one gets picked first. */
+static int find_anchor(coord x, coord y, double z)
+{
+    coord radius = BRUSHSZ / 2 / z;
+    int i;
+    for (i = anchors.count - 1; i >= 0; i--)
+    {
+        if (x <= anchors.pixels[i].x + radius &&
+                x >= anchors.pixels[i].x - radius &&
+                y <= anchors.pixels[i].y + radius &&
+                y >= anchors.pixels[i].y - radius)
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/* Handle button press events by either drawing a rectangle, starting to drag
+ * one or clearing it, depending on which button was pressed. The
+ * ::button-press signal handler receives a GdkEventButton struct which
+ * contains this information.
  */
 static gboolean event_button_press(GtkWidget *drawable, GdkEventButton *event, gpointer data)
 {
     (void)data;
 
-    /* Paranoia check, in case we haven't gotten a configure event. */
-    if (surface == NULL)
+    if (bg == NULL)
     {
         return FALSE;
     }
@@ -315,61 +918,52 @@ static gboolean event_button_press(GtkWidget *drawable, GdkEventButton *event, g
         return FALSE;
     }
 
+    int i = find_anchor(x, y, z);
     if (event->button == GDK_BUTTON_PRIMARY)
     {
-        if (anchors.count >= sizeof anchors.pixels / sizeof anchors.pixels[0])
+        if (i >= 0)
+        {
+            dragged = i;
+        }
+        else if (anchors.count >= sizeof anchors.pixels / sizeof anchors.pixels[0])
         {
             gtk_label_set_text(GTK_LABEL(status), "Max number of anchors reached.");
         }
         else
         {
-            size_t i;
-            for (i = 0; i < anchors.count; i++)
-            {
-                if (anchors.pixels[i].x == x && anchors.pixels[i].y == y)
-                {
-                    /* Pixel is already an anchor. */
-                    return TRUE;
-                }
-            }
             anchors.pixels[anchors.count].x = x;
             anchors.pixels[anchors.count].y = y;
-            draw_brush(drawable, x, y);
+            queue_anchor(drawable, x, y);
             anchors.count++;
+            live_update();
         }
     }
-    else if (event->button == GDK_BUTTON_SECONDARY)
+    else if (event->button == GDK_BUTTON_SECONDARY && i >= 0)
     {
-        coord radius = BRUSHSZ / 2 / z;
-
-        /* We loop backward in case rectangles are stack, then last one gets erased
-        * first. */
-        if (anchors.count > 0)
-        {
-            size_t i = anchors.count - 1;
-            do
-            {
-                if (x <= anchors.pixels[i].x + radius &&
-                        x >= anchors.pixels[i].x - radius &&
-                        y <= anchors.pixels[i].y + radius &&
-                        y >= anchors.pixels[i].y - radius)
-                {
-                    anchors.count--;
-                    anchors.pixels[i] = anchors.pixels[anchors.count];
-                    clear_surface();
-                    gtk_widget_queue_draw(drawable);
-                    gtk_label_set_text(GTK_LABEL(status), "");
-                    break;
-                }
-            }
-            while (i-- != 0);
-        }
+        queue_anchor(drawable, anchors.pixels[i].x, anchors.pixels[i].y);
+        anchors.count--;
+        anchors.pixels[i] = anchors.pixels[anchors.count];
+        dragged = -1;
+        gtk_label_set_text(GTK_LABEL(status), "");
+        live_update();
     }
 
     /* We have handled the event, stop processing. */
     return TRUE;
 }
 
+static gboolean event_button_release(GtkWidget *drawable, GdkEventButton *event, gpointer data)
+{
+    (void)drawable;
+    (void)data;
+
+    if (event->button == GDK_BUTTON_PRIMARY)
+    {
+        dragged = -1;
+    }
+    return FALSE;
+}
+
 static gboolean event_key_press(GtkWidget *widget, GdkEventKey *event, gpointer data)
 {
     (void)widget;
@@ -390,9 +984,8 @@ static gboolean event_key_press(GtkWidget *widget, GdkEventKey *event, gpointer
 
 static gboolean event_motion_notify(GtkWidget *widget, GdkEventMotion *event, gpointer coord_status)
 {
-    (void)widget;
 
-    if (surface == NULL)
+    if (bg == NULL)
     {
         return FALSE;
     }
@@ -402,6 +995,26 @@ static gboolean event_motion_notify(GtkWidget *widget, GdkEventMotion *event, gp
     snprintf(text, COORD_TEXT_LEN, "(%i, %i)", (gint)event->x, (gint)event->y);
     gtk_label_set_text(GTK_LABEL(coord_status), text);
 
+    if (dragged >= 0)
+    {
+        /* Keep the anchor on the picture. */
+        double z = zoom_value(zoom);
+        coord x = event->x < 0 ? 0 : (coord)(event->x / z);
+        coord y = event->y < 0 ? 0 : (coord)(event->y / z);
+        coord width = cairo_image_surface_get_width(bg);
+        coord height = cairo_image_surface_get_height(bg);
+        x = x < width ? x : width - 1;
+        y = y < height ? y : height - 1;
+        if (x != anchors.pixels[dragged].x || y != anchors.pixels[dragged].y)
+        {
+            queue_anchor(widget, anchors.pixels[dragged].x, anchors.pixels[dragged].y);
+            anchors.pixels[dragged].x = x;
+            anchors.pixels[dragged].y = y;
+            queue_anchor(widget, x, y);
+            live_update();
+        }
+    }
+
     return TRUE;
 }
 
@@ -410,96 +1023,45 @@ static void event_process(GtkWidget *widget, gpointer data)
     (void)widget;
     (void)data;
 
-    if (anchors.count != 4)
+    if (process_thread)
     {
-        gtk_label_set_text(GTK_LABEL(status), "4 anchors required.");
         return;
     }
-
-    cairo_format_t format = cairo_image_surface_get_format(bg);
-    if (format != CAIRO_FORMAT_RGB24 && format != CAIRO_FORMAT_ARGB32)
+    if (anchors.count != 4)
     {
-        gtk_label_set_text(GTK_LABEL(status), "Unsupported format.");
+        gtk_label_set_text(GTK_LABEL(status), "4 anchors required.");
         return;
     }
 
-    /* Flush to ensure all writing to the image was done */
-    cairo_surface_flush(bg);
-
-    /* Initialize sink. Width and height is the smallest rectangle containing */
-    /* the anchors and fitting the ratio. */
-    coord sink_width, sink_height;
-    size_t i;
-    coord minx = anchors.pixels[0].x;
-    coord miny = anchors.pixels[0].y;
-    coord maxx = anchors.pixels[0].x;
-    coord maxy = anchors.pixels[0].y;
-    for (i = 0; i < anchors.count; i++)
-    {
-        if (anchors.pixels[i].x < minx)
-        {
-            minx = anchors.pixels[i].x;
-        }
-        if (anchors.pixels[i].y < miny)
-        {
-            miny = anchors.pixels[i].y;
-        }
-        if (anchors.pixels[i].x > maxx)
-        {
-            maxx = anchors.pixels[i].x;
-        }
-        if (anchors.pixels[i].y > maxy)
-        {
-            maxy = anchors.pixels[i].y;
-        }
-    }
-    /* The following cannot be negative. */
-    sink_width = maxx - minx;
-    sink_height = maxy - miny;
-
-    errno = 0;
-    double ratio_w = strtod(gtk_entry_get_text(GTK_ENTRY(ratio_width)), NULL);
-    if (errno || ratio_w <= 0)
-    {
-        gtk_label_set_text(GTK_LABEL(status), "Wrong value for width.");
-        return;
-    }
-    double ratio_h = strtod(gtk_entry_get_text(GTK_ENTRY(ratio_height)), NULL);
-    if (errno || ratio_h <= 0)
+    double ratio;
+    const char *error;
+    if (!read_ratio(&ratio, &error))
     {
-        gtk_label_set_text(GTK_LABEL(status), "Wrong value for height.");
+        gtk_label_set_text(GTK_LABEL(status), error);
         return;
     }
 
-    double ratio = ratio_w / ratio_h;
-    if (sink_height < sink_height * ratio)
-    {
-        sink_height = sink_width * ratio;
-    }
-    else if (sink_height > sink_height * ratio)
+    process_job *job = g_malloc(sizeof *job);
+    *job = (process_job)
     {
-        sink_width = sink_height * ratio_h / ratio_w;
-    }
-
-    sink = cairo_surface_create_similar_image(bg, CAIRO_FORMAT_ARGB32, sink_width, sink_height);
-    unsigned char *sink_data = cairo_image_surface_get_data(sink);
+        .id = ++process_id, .bg = preview, .path = bg_path, .scale = bg_scale,
+        .anchors = anchors, .ratio = ratio, .crop = read_crop(), .percent = -1, .result = NULL, .error = NULL
+    };
+    g_atomic_int_set(&process_cancel, 0);
+    process_buttons(true);
+    gtk_label_set_text(GTK_LABEL(status), "Processing...");
+    process_thread = g_thread_new("process", process_worker, job);
+}
 
-    /* Background data. */
-    unsigned char *bg_data = cairo_image_surface_get_data(bg);
-    coord bg_width = cairo_image_surface_get_width(bg);
-    coord bg_height = cairo_image_surface_get_height(bg);
+static void event_cancel(GtkWidget *widget, gpointer data)
+{
+    (void)widget;
+    (void)data;
 
-    /* Modify the image. */
-    bool ustatus = perspector((color *)sink_data, sink_width, sink_height, (color *)bg_data, bg_width, bg_height, &anchors);
-    if (ustatus)
-    {
-        gtk_label_set_text(GTK_LABEL(status), "Transformation applied.");
-    }
-    else
+    if (process_thread)
     {
-        gtk_label_set_text(GTK_LABEL(status), "Anchors configuration is not usable.");
-        cairo_surface_destroy(sink);
-        sink = NULL;
+        g_atomic_int_set(&process_cancel, 1);
+        gtk_label_set_text(GTK_LABEL(status), "Cancelling...");
     }
 }
 
@@ -532,19 +1094,18 @@ static void event_write(GtkWidget *widget, gpointer data)
 
 static void event_close(void)
 {
-    if (surface)
-    {
-        cairo_surface_destroy(surface);
-    }
-    if (bg)
-    {
-        cairo_surface_destroy(bg);
-    }
+    free_image();
     if (sink)
     {
         cairo_surface_destroy(sink);
     }
 
+    g_mutex_lock(&live.lock);
+    live.quit = true;
+    g_cond_signal(&live.cond);
+    g_mutex_unlock(&live.lock);
+    g_thread_join(live.thread);
+
     gtk_main_quit();
 }
 
@@ -582,29 +1143,41 @@ int main(int argc, char *argv[])
     GtkWidget *zoom_status = gtk_label_new("x1");
     status = gtk_label_new("");
 
-    /* Signals used to handle the backing surface */
     g_signal_connect(drawable_area, "draw", G_CALLBACK(event_draw), NULL);
-    g_signal_connect(drawable_area, "configure-event", G_CALLBACK(event_configure), NULL);
     /* Event signals */
     g_signal_connect(drawable_area, "motion-notify-event", G_CALLBACK(event_motion_notify), coord_status);
     g_signal_connect(drawable_area, "button-press-event", G_CALLBACK(event_button_press), NULL);
+    g_signal_connect(drawable_area, "button-release-event", G_CALLBACK(event_button_release), NULL);
     g_signal_connect(drawable_area, "scroll-event", G_CALLBACK(event_scroll), zoom_status);
     /* Ask to receive events the drawing area doesn't normally subscribe to. */
     gtk_widget_set_events(drawable_area, gtk_widget_get_events(drawable_area)
                           | GDK_BUTTON_PRESS_MASK
+                          | GDK_BUTTON_RELEASE_MASK
                           | GDK_POINTER_MOTION_MASK
                           | GDK_SCROLL_MASK);
 
     GtkWidget *open = gtk_button_new_with_label("Open");
     g_signal_connect(open, "clicked", G_CALLBACK(event_open), NULL);
-    GtkWidget *process = gtk_button_new_with_label("Process");
-    g_signal_connect(process, "clicked", G_CALLBACK(event_process), NULL);
+    process_button = gtk_button_new_with_label("Process");
+    g_signal_connect(process_button, "clicked", G_CALLBACK(event_process), NULL);
+    cancel_button = gtk_button_new_with_label("Cancel");
+    g_signal_connect(cancel_button, "clicked", G_CALLBACK(event_cancel), NULL);
+    gtk_widget_set_sensitive(cancel_button, FALSE);
     GtkWidget *ratio_width_label = gtk_label_new("Width");
     ratio_width = gtk_entry_new();
     GtkWidget *ratio_height_label = gtk_label_new("Height");
     ratio_height = gtk_entry_new();
     gtk_entry_set_text(GTK_ENTRY(ratio_width), "1");
     gtk_entry_set_text(GTK_ENTRY(ratio_height), "1");
+    g_signal_connect(ratio_width, "changed", G_CALLBACK(event_ratio_changed), NULL);
+    g_signal_connect(ratio_height, "changed", G_CALLBACK(event_ratio_changed), NULL);
+    crop_mode = gtk_combo_box_text_new();
+    gtk_combo_box_text_append_text(GTK_COMBO_BOX_TEXT(crop_mode), "Enlarge");
+    gtk_combo_box_text_append_text(GTK_COMBO_BOX_TEXT(crop_mode), "Shrink");
+    gtk_combo_box_text_append_text(GTK_COMBO_BOX_TEXT(crop_mode), "Whole picture");
+    gtk_combo_box_text_append_text(GTK_COMBO_BOX_TEXT(crop_mode), "Biggest rectangle");
+    gtk_combo_box_set_active(GTK_COMBO_BOX(crop_mode), CROP_ENLARGE);
+    g_signal_connect(crop_mode, "changed", G_CALLBACK(event_ratio_changed), NULL);
     out = gtk_entry_new();
 
     GtkWidget *write = gtk_button_new_with_label("Write");
@@ -621,7 +1194,9 @@ int main(int argc, char *argv[])
     /* gtk_widget_set_size_request (ratio_width, 50, -1); */
     box_prepend(menubox, ratio_height_label);
     box_prepend(menubox, ratio_height);
-    box_prepend(menubox, process);
+    box_prepend(menubox, crop_mode);
+    box_prepend(menubox, process_button);
+    box_prepend(menubox, cancel_button);
     gtk_box_pack_start(GTK_BOX(menubox), out, TRUE, TRUE, 0);
     box_prepend(menubox, write);
     /* box_prepend (menubox, exit); */
@@ -637,10 +1212,20 @@ int main(int argc, char *argv[])
     gtk_widget_set_size_request(scroll, -1, 512);
     gtk_container_add(GTK_CONTAINER(scroll), drawable_area);
 
+    live_area = gtk_drawing_area_new();
+    gtk_widget_set_size_request(live_area, LIVE_PANE, LIVE_PANE);
+    g_signal_connect(live_area, "draw", G_CALLBACK(event_live_draw), NULL);
+    live.thread = g_thread_new("preview", live_worker, NULL);
+
+    GtkWidget *viewbox = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 0);
+    gtk_box_set_spacing(GTK_BOX(viewbox), 2);
+    gtk_box_pack_start(GTK_BOX(viewbox), scroll, TRUE, TRUE, 0);
+    box_prepend(viewbox, live_area);
+
     GtkWidget *mainbox = gtk_box_new(GTK_ORIENTATION_VERTICAL, 0);
     gtk_container_add(GTK_CONTAINER(window), mainbox);
     box_prepend(mainbox, menubox);
-    gtk_box_pack_start(GTK_BOX(mainbox), scroll, TRUE, TRUE, 0);
+    gtk_box_pack_start(GTK_BOX(mainbox), viewbox, TRUE, TRUE, 0);
     box_prepend(mainbox, statusbox);
 
     gtk_widget_show_all(window);
@@ -0,0 +1,990 @@
+/*
+Picture files for the command-line tools.
+
+Pictures are backed by Cairo image surfaces, like in the GUI, but nothing here
+depends on GTK. Only ARGB32 surfaces are handed out; other formats are
+converted on load. PNG, JPEG and TIFF files are recognized by their signature,
+whatever their extension. JPEG files decode straight into the layout of 'color'
+with libjpeg-turbo; TIFF files go through the RGBA interface of libtiff, which
+handles every photometric interpretation and orientation.
+
+JPEG previews use the scaled IDCT of libjpeg: decoding at 1/8 of the size skips
+most of the work, which makes opening big photos nearly instant.
+
+Pictures too big for memory are streamed row by row with libpng. Interlaced
+files cannot be streamed since every row is spread over 7 passes.
+
+Raw pictures skip compression altogether, to hand frames between tools. A raw
+file is made of a 16-byte header
+
+    offset  size  content
+    0       4     "BGRA"
+    4       4     offset of the pixels, a multiple of 4 and at least 16
+    8       4     width
+    12      4     height
+
+followed by the rows of pixels, top to bottom, without padding, in the layout
+of 'color'. Like in Cairo ARGB32 surfaces, colors are premultiplied by alpha; the
+streamed PNG rows are converted to and from that convention. Numbers are unsigned little-endian. Raw files are memory-mapped:
+perspector() reads and writes the pixels in place, without any copy. Raw inputs
+are recognized by their header, raw outputs by the ".bgra" extension.
+*/
+
+#include <fcntl.h>
+#include <png.h>
+#include <setjmp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <cairo.h>
+#ifndef NO_JPEG
+#include <jpeglib.h>
+#endif
+#ifndef NO_TIFF
+#include <tiffio.h>
+#endif
+
+#include "image.h"
+
+/******************************************************************************/
+/* Raw pictures */
+
+#define RAW_MAGIC "BGRA"
+#define RAW_HEADER 16
+#define RAW_SUFFIX ".bgra"
+
+typedef enum
+{
+    RAW_OK,
+    /* The file has no raw header. */
+    RAW_NONE,
+    RAW_ERROR
+} raw_status;
+
+/* Mapping of a raw file. */
+typedef struct
+{
+    unsigned char *map;
+    size_t length;
+    color *pixels;
+    coord width, height;
+} raw_file;
+
+static inline uint32_t get_le32(const unsigned char *p)
+{
+    return p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static inline void put_le32(unsigned char *p, uint32_t v)
+{
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+}
+
+/* Pixel data size of a raw picture, or 0 if it is too big to be mapped. */
+static size_t raw_size(coord width, coord height)
+{
+    if ((size_t)width > (SIZE_MAX - RAW_HEADER) / sizeof (color) / (size_t)height)
+    {
+        return 0;
+    }
+    return (size_t)width * height * sizeof (color);
+}
+
+bool image_raw_path(const char *path)
+{
+    size_t length = strlen(path);
+    size_t suffix = strlen(RAW_SUFFIX);
+    return length > suffix && !strcmp(path + length - suffix, RAW_SUFFIX);
+}
+
+/* Map the raw picture 'path'. The mapping is private: writing to the pixels
+does not change the file. */
+static raw_status raw_open(raw_file *raw, const char *path, const char **error)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+    {
+        *error = "Cannot open the file.";
+        return RAW_ERROR;
+    }
+    struct stat st;
+    unsigned char header[RAW_HEADER];
+    if (fstat(fd, &st) < 0 || st.st_size < RAW_HEADER
+            || pread(fd, header, RAW_HEADER, 0) != RAW_HEADER
+            || memcmp(header, RAW_MAGIC, 4))
+    {
+        close(fd);
+        return RAW_NONE;
+    }
+
+    uint32_t offset = get_le32(header + 4);
+    uint32_t width = get_le32(header + 8);
+    uint32_t height = get_le32(header + 12);
+    size_t size = width && height && width <= COORD_MAX && height <= COORD_MAX ? raw_size(width, height) : 0;
+    if (offset < RAW_HEADER || offset % sizeof (color) || size == 0
+            || (uintmax_t)st.st_size < (uintmax_t)offset + size)
+    {
+        close(fd);
+        *error = "Invalid raw file.";
+        return RAW_ERROR;
+    }
+
+    raw->length = offset + size;
+    raw->map = mmap(NULL, raw->length, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (raw->map == MAP_FAILED)
+    {
+        *error = "Cannot map the file.";
+        return RAW_ERROR;
+    }
+    raw->pixels = (color *)(raw->map + offset);
+    raw->width = width;
+    raw->height = height;
+    return RAW_OK;
+}
+
+/* Create the raw picture 'path' and map it: writing to the pixels writes to the
+file. */
+static bool raw_create(raw_file *raw, const char *path, coord width, coord height, const char **error)
+{
+    size_t size = raw_size(width, height);
+    if (size == 0)
+    {
+        *error = "The picture is too big.";
+        return false;
+    }
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0)
+    {
+        *error = "Cannot create the file.";
+        return false;
+    }
+
+    raw->length = RAW_HEADER + size;
+    raw->map = MAP_FAILED;
+    if (ftruncate(fd, raw->length) == 0)
+    {
+        raw->map = mmap(NULL, raw->length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (raw->map == MAP_FAILED)
+    {
+        *error = "Cannot map the file.";
+        unlink(path);
+        return false;
+    }
+
+    memcpy(raw->map, RAW_MAGIC, 4);
+    put_le32(raw->map + 4, RAW_HEADER);
+    put_le32(raw->map + 8, width);
+    put_le32(raw->map + 12, height);
+    raw->pixels = (color *)(raw->map + RAW_HEADER);
+    raw->width = width;
+    raw->height = height;
+    return true;
+}
+
+static inline void raw_close(raw_file *raw)
+{
+    munmap(raw->map, raw->length);
+}
+
+/******************************************************************************/
+/* JPEG and TIFF */
+
+typedef enum
+{
+    FORMAT_PNG,
+    FORMAT_JPEG,
+    FORMAT_TIFF
+} file_format;
+
+/* Guess the format from the first bytes of 'f'. Anything unknown is left to
+the PNG decoder to report. */
+static file_format sniff(FILE *f)
+{
+    unsigned char magic[4];
+    size_t length = fread(magic, 1, sizeof magic, f);
+    rewind(f);
+    if (length >= 3 && !memcmp(magic, "\xff\xd8\xff", 3))
+    {
+        return FORMAT_JPEG;
+    }
+    if (length == 4 && (!memcmp(magic, "II*\0", 4) || !memcmp(magic, "MM\0*", 4)))
+    {
+        return FORMAT_TIFF;
+    }
+    return FORMAT_PNG;
+}
+
+#ifndef NO_JPEG
+typedef struct
+{
+    struct jpeg_error_mgr base;
+    jmp_buf jump;
+} jpeg_error;
+
+static void jpeg_fail(j_common_ptr cinfo)
+{
+    longjmp(((jpeg_error *)cinfo->err)->jump, 1);
+}
+
+/* Corrupt data warnings would clutter the output of the batches. */
+static void jpeg_quiet(j_common_ptr cinfo)
+{
+    (void)cinfo;
+}
+
+/* Convert a row of 3 or 4 components to 'color'. CMYK comes from Adobe
+software, which stores it inverted. */
+static void jpeg_convert(color *dest, const JSAMPLE *src, const struct jpeg_decompress_struct *cinfo)
+{
+    JDIMENSION x;
+    for (x = 0; x < cinfo->output_width; x++, dest++)
+    {
+        if (cinfo->out_color_space == JCS_CMYK)
+        {
+            unsigned int c = src[0], m = src[1], y = src[2], k = src[3];
+            if (!cinfo->saw_Adobe_marker)
+            {
+                c = 255 - c;
+                m = 255 - m;
+                y = 255 - y;
+                k = 255 - k;
+            }
+            dest->red = (c * k + 127) / 255;
+            dest->green = (m * k + 127) / 255;
+            dest->blue = (y * k + 127) / 255;
+            src += 4;
+        }
+        else
+        {
+            dest->red = src[0];
+            dest->green = src[1];
+            dest->blue = src[2];
+            src += 3;
+        }
+        dest->alpha = 0xff;
+    }
+}
+
+/* Decode the JPEG file 'f'. When 'size' is not 0, scale it down by up to 8 as
+long as the longest side keeps at least 'size' pixels. */
+static bool load_jpeg(image *img, FILE *f, coord size, int *scale, const char **error)
+{
+    struct jpeg_decompress_struct cinfo;
+    jpeg_error jerr;
+    /* Read back after a jump, so it must live in memory. */
+    JSAMPARRAY volatile buffer = NULL;
+
+    cinfo.err = jpeg_std_error(&jerr.base);
+    jerr.base.error_exit = jpeg_fail;
+    jerr.base.output_message = jpeg_quiet;
+    img->handle = NULL;
+    img->map = NULL;
+    if (setjmp(jerr.jump))
+    {
+        jpeg_destroy_decompress(&cinfo);
+        if (img->handle)
+        {
+            image_free(img);
+        }
+        *error = buffer ? "Corrupt JPEG data." : "Invalid JPEG file.";
+        return false;
+    }
+
+    jpeg_create_decompress(&cinfo);
+    jpeg_stdio_src(&cinfo, f);
+    jpeg_read_header(&cinfo, TRUE);
+
+    unsigned int denom = 1;
+    JDIMENSION side = cinfo.image_width > cinfo.image_height ? cinfo.image_width : cinfo.image_height;
+    while (size > 0 && denom < 8 && (side + 2 * denom - 1) / (2 * denom) >= (JDIMENSION)size)
+    {
+        denom *= 2;
+    }
+    cinfo.scale_num = 1;
+    cinfo.scale_denom = denom;
+
+    bool direct = false;
+    if (cinfo.jpeg_color_space == JCS_CMYK || cinfo.jpeg_color_space == JCS_YCCK)
+    {
+        cinfo.out_color_space = JCS_CMYK;
+    }
+    else
+    {
+#ifdef JCS_EXTENSIONS
+        /* libjpeg-turbo writes the pixels in place, opaque. */
+        cinfo.out_color_space = JCS_EXT_BGRA;
+        direct = true;
+#else
+        cinfo.out_color_space = JCS_RGB;
+#endif
+    }
+
+    jpeg_start_decompress(&cinfo);
+    if (cinfo.output_width > COORD_MAX || cinfo.output_height > COORD_MAX)
+    {
+        jpeg_destroy_decompress(&cinfo);
+        *error = "The picture is too big.";
+        return false;
+    }
+    if (!image_create(img, cinfo.output_width, cinfo.output_height, error))
+    {
+        jpeg_destroy_decompress(&cinfo);
+        return false;
+    }
+    /* Owned by the decoder, freed with it. */
+    buffer = (*cinfo.mem->alloc_sarray)((j_common_ptr)&cinfo, JPOOL_IMAGE,
+                                        direct ? 1 : cinfo.output_width * cinfo.output_components, 1);
+
+    while (cinfo.output_scanline < cinfo.output_height)
+    {
+        color *row = img->data + (size_t)cinfo.output_scanline * img->width;
+        if (direct)
+        {
+            JSAMPROW dest = (JSAMPROW)row;
+            jpeg_read_scanlines(&cinfo, &dest, 1);
+        }
+        else
+        {
+            jpeg_read_scanlines(&cinfo, buffer, 1);
+            jpeg_convert(row, buffer[0], &cinfo);
+        }
+    }
+
+    jpeg_finish_decompress(&cinfo);
+    jpeg_destroy_decompress(&cinfo);
+    cairo_surface_mark_dirty(img->handle);
+    *scale = denom;
+    return true;
+}
+#endif
+
+#ifndef NO_TIFF
+static bool load_tiff(image *img, const char *path, const char **error)
+{
+    TIFF *tif = TIFFOpen(path, "r");
+    if (!tif)
+    {
+        *error = "Invalid TIFF file.";
+        return false;
+    }
+
+    bool status = false;
+    uint32_t width = 0, height = 0;
+    TIFFGetField(tif, TIFFTAG_IMAGEWIDTH, &width);
+    TIFFGetField(tif, TIFFTAG_IMAGELENGTH, &height);
+    if (width == 0 || height == 0 || width > COORD_MAX || height > COORD_MAX)
+    {
+        *error = "Invalid TIFF file.";
+    }
+    else if (image_create(img, width, height, error))
+    {
+        /* libtiff packs the samples as ABGR words, with alpha premultiplied
+        like in Cairo: convert them in place. */
+        uint32_t *raster = (uint32_t *)img->data;
+        if (TIFFReadRGBAImageOriented(tif, width, height, raster, ORIENTATION_TOPLEFT, 0))
+        {
+            size_t i, count = (size_t)width * height;
+            for (i = 0; i < count; i++)
+            {
+                uint32_t p = raster[i];
+                color c = { TIFFGetB(p), TIFFGetG(p), TIFFGetR(p), TIFFGetA(p) };
+                img->data[i] = c;
+            }
+            cairo_surface_mark_dirty(img->handle);
+            status = true;
+        }
+        else
+        {
+            *error = "Corrupt TIFF data.";
+            image_free(img);
+        }
+    }
+
+    TIFFClose(tif);
+    return status;
+}
+#endif
+
+/******************************************************************************/
+/* Whole pictures */
+
+static bool wrap(image *img, cairo_surface_t *surface, const char **error)
+{
+    cairo_status_t status = cairo_surface_status(surface);
+    if (status)
+    {
+        *error = cairo_status_to_string(status);
+        cairo_surface_destroy(surface);
+        return false;
+    }
+
+    cairo_surface_flush(surface);
+    img->data = (color *)cairo_image_surface_get_data(surface);
+    img->width = cairo_image_surface_get_width(surface);
+    img->height = cairo_image_surface_get_height(surface);
+    img->handle = surface;
+    img->map = NULL;
+    return true;
+}
+
+static void wrap_raw(image *img, const raw_file *raw, bool in_file)
+{
+    img->data = raw->pixels;
+    img->width = raw->width;
+    img->height = raw->height;
+    img->handle = NULL;
+    img->map = raw->map;
+    img->map_length = raw->length;
+    img->in_file = in_file;
+}
+
+static bool load_png(image *img, const char *path, const char **error)
+{
+    cairo_surface_t *surface = cairo_image_surface_create_from_png(path);
+    cairo_status_t status = cairo_surface_status(surface);
+    if (status)
+    {
+        *error = cairo_status_to_string(status);
+        cairo_surface_destroy(surface);
+        return false;
+    }
+
+    cairo_format_t format = cairo_image_surface_get_format(surface);
+    if (format != CAIRO_FORMAT_RGB24 && format != CAIRO_FORMAT_ARGB32)
+    {
+        /* Grayscale and palette pictures. */
+        cairo_surface_t *converted = cairo_image_surface_create(CAIRO_FORMAT_ARGB32,
+                                     cairo_image_surface_get_width(surface),
+                                     cairo_image_surface_get_height(surface));
+        cairo_t *cr = cairo_create(converted);
+        cairo_set_source_surface(cr, surface, 0, 0);
+        cairo_paint(cr);
+        cairo_destroy(cr);
+        cairo_surface_destroy(surface);
+        surface = converted;
+    }
+
+    return wrap(img, surface, error);
+}
+
+/* See image_load_preview(). */
+static bool load(image *img, const char *path, coord size, int *scale, const char **error)
+{
+    *scale = 1;
+    raw_file raw;
+    raw_status rstatus = raw_open(&raw, path, error);
+    if (rstatus != RAW_NONE)
+    {
+        if (rstatus == RAW_OK)
+        {
+            wrap_raw(img, &raw, false);
+        }
+        return rstatus == RAW_OK;
+    }
+
+    FILE *f = fopen(path, "rb");
+    if (!f)
+    {
+        *error = "Cannot open the file.";
+        return false;
+    }
+    bool status;
+    switch (sniff(f))
+    {
+    case FORMAT_JPEG:
+#ifndef NO_JPEG
+        status = load_jpeg(img, f, size, scale, error);
+#else
+        (void)size;
+        *error = "JPEG support is disabled.";
+        status = false;
+#endif
+        break;
+    case FORMAT_TIFF:
+#ifndef NO_TIFF
+        status = load_tiff(img, path, error);
+#else
+        *error = "TIFF support is disabled.";
+        status = false;
+#endif
+        break;
+    default:
+        status = load_png(img, path, error);
+    }
+    fclose(f);
+    return status;
+}
+
+bool image_load(image *img, const char *path, const char **error)
+{
+    int scale;
+    return load(img, path, 0, &scale, error);
+}
+
+bool image_load_preview(image *img, const char *path, coord size, int *scale, const char **error)
+{
+    return load(img, path, size, scale, error);
+}
+
+bool image_reduce(image *dest, const image *src, const char **error)
+{
+    if (!image_create(dest, (src->width + 1) / 2, (src->height + 1) / 2, error))
+    {
+        return false;
+    }
+
+    coord x, y;
+    for (y = 0; y < dest->height; y++)
+    {
+        const color *top = src->data + (size_t)2 * y * src->width;
+        const color *bottom = 2 * y + 1 < src->height ? top + src->width : top;
+        color *row = dest->data + (size_t)y * dest->width;
+        for (x = 0; x < dest->width; x++)
+        {
+            coord left = 2 * x, right = 2 * x + 1 < src->width ? 2 * x + 1 : 2 * x;
+            row[x].blue = (top[left].blue + top[right].blue + bottom[left].blue + bottom[right].blue + 2) / 4;
+            row[x].green = (top[left].green + top[right].green + bottom[left].green + bottom[right].green + 2) / 4;
+            row[x].red = (top[left].red + top[right].red + bottom[left].red + bottom[right].red + 2) / 4;
+            row[x].alpha = (top[left].alpha + top[right].alpha + bottom[left].alpha + bottom[right].alpha + 2) / 4;
+        }
+    }
+    cairo_surface_mark_dirty(dest->handle);
+    return true;
+}
+
+bool image_create(image *img, coord width, coord height, const char **error)
+{
+    return wrap(img, cairo_image_surface_create(CAIRO_FORMAT_ARGB32, width, height), error);
+}
+
+bool image_create_output(image *img, const char *path, coord width, coord height, const char **error)
+{
+    if (!image_raw_path(path))
+    {
+        return image_create(img, width, height, error);
+    }
+
+    raw_file raw;
+    if (!raw_create(&raw, path, width, height, error))
+    {
+        return false;
+    }
+    wrap_raw(img, &raw, true);
+    return true;
+}
+
+bool image_save(image *img, const char *path, const char **error)
+{
+    if (img->map && img->in_file)
+    {
+        /* Already there, the kernel writes the pages back. */
+        return true;
+    }
+
+    if (image_raw_path(path))
+    {
+        raw_file raw;
+        if (!raw_create(&raw, path, img->width, img->height, error))
+        {
+            return false;
+        }
+        memcpy(raw.pixels, img->data, raw_size(img->width, img->height));
+        raw_close(&raw);
+        return true;
+    }
+
+    cairo_surface_t *surface = img->handle;
+    if (img->map)
+    {
+        surface = cairo_image_surface_create_for_data((unsigned char *)img->data, CAIRO_FORMAT_ARGB32,
+                  img->width, img->height, img->width * sizeof (color));
+    }
+    cairo_surface_mark_dirty(surface);
+    cairo_status_t status = cairo_surface_write_to_png(surface, path);
+    if (img->map)
+    {
+        cairo_surface_destroy(surface);
+    }
+    if (status)
+    {
+        *error = cairo_status_to_string(status);
+        return false;
+    }
+    return true;
+}
+
+void image_free(image *img)
+{
+    if (img->map)
+    {
+        munmap(img->map, img->map_length);
+    }
+    else
+    {
+        cairo_surface_destroy(img->handle);
+    }
+    img->handle = NULL;
+    img->map = NULL;
+    img->data = NULL;
+}
+
+/******************************************************************************/
+/* Streaming */
+
+struct image_reader
+{
+    /* Raw files are mapped instead. */
+    bool is_raw;
+    raw_file raw;
+    FILE *file;
+    png_structp png;
+    png_infop info;
+    coord width, height;
+    /* Next row to be decoded. */
+    coord next;
+    const char *error;
+};
+
+struct image_writer
+{
+    bool is_raw;
+    raw_file raw;
+    FILE *file;
+    png_structp png;
+    png_infop info;
+    coord width, height;
+    /* Next row to be encoded. */
+    coord next;
+    bool failed;
+    /* A row with its colors divided by alpha, PNG only. */
+    color *row;
+};
+
+/* The conversions of Cairo between premultiplied and straight alpha, to get the
+same pixels as with image_load() and image_save(). */
+static void premultiply_row(color *row, coord width)
+{
+    for (coord x = 0; x < width; x++)
+    {
+        unsigned int alpha = row[x].alpha;
+        if (alpha == 0xff)
+        {
+            continue;
+        }
+        unsigned int t;
+        t = alpha * row[x].blue + 0x80;
+        row[x].blue = (t + (t >> 8)) >> 8;
+        t = alpha * row[x].green + 0x80;
+        row[x].green = (t + (t >> 8)) >> 8;
+        t = alpha * row[x].red + 0x80;
+        row[x].red = (t + (t >> 8)) >> 8;
+    }
+}
+
+/* Sharp interpolations can ring a component above alpha: it saturates. */
+static inline unsigned char unpremultiply(unsigned int c, unsigned int alpha)
+{
+    unsigned int v = (c * 255 + alpha / 2) / alpha;
+    return v > 0xff ? 0xff : v;
+}
+
+static void unpremultiply_row(color *dest, const color *src, coord width)
+{
+    for (coord x = 0; x < width; x++)
+    {
+        unsigned int alpha = src[x].alpha;
+        if (alpha == 0)
+        {
+            dest[x] = (color){ 0, 0, 0, 0 };
+            continue;
+        }
+        dest[x].blue = unpremultiply(src[x].blue, alpha);
+        dest[x].green = unpremultiply(src[x].green, alpha);
+        dest[x].red = unpremultiply(src[x].red, alpha);
+        dest[x].alpha = alpha;
+    }
+}
+
+/* Decode the header of the file again and prepare for the first row. Rows are
+converted to the layout of 'color', and premultiplied by image_read_rows(). */
+static bool reader_start(image_reader *r)
+{
+    r->png = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+    r->info = r->png ? png_create_info_struct(r->png) : NULL;
+    if (!r->info)
+    {
+        r->error = "Out of memory.";
+        return false;
+    }
+    if (setjmp(png_jmpbuf(r->png)))
+    {
+        r->error = "Cannot decode the PNG file.";
+        return false;
+    }
+
+    rewind(r->file);
+    png_init_io(r->png, r->file);
+    png_read_info(r->png, r->info);
+    if (png_get_interlace_type(r->png, r->info) != PNG_INTERLACE_NONE)
+    {
+        r->error = "Interlaced PNG files cannot be streamed.";
+        return false;
+    }
+
+    /* Palettes, grayscale and transparency to 8-bit BGRA. */
+    png_set_expand(r->png);
+    png_set_strip_16(r->png);
+    png_set_gray_to_rgb(r->png);
+    png_set_bgr(r->png);
+    png_set_filler(r->png, 0xff, PNG_FILLER_AFTER);
+    png_read_update_info(r->png, r->info);
+
+    png_uint_32 width = png_get_image_width(r->png, r->info);
+    png_uint_32 height = png_get_image_height(r->png, r->info);
+    if (width > COORD_MAX || height > COORD_MAX)
+    {
+        r->error = "The picture is too big.";
+        return false;
+    }
+    r->width = width;
+    r->height = height;
+    r->next = 0;
+    return true;
+}
+
+image_reader *image_reader_open(const char *path, const char **error)
+{
+    image_reader *r = calloc(1, sizeof *r);
+    if (!r)
+    {
+        *error = "Out of memory.";
+        return NULL;
+    }
+
+    raw_status rstatus = raw_open(&r->raw, path, error);
+    if (rstatus != RAW_NONE)
+    {
+        if (rstatus == RAW_ERROR)
+        {
+            free(r);
+            return NULL;
+        }
+        r->is_raw = true;
+        r->width = r->raw.width;
+        r->height = r->raw.height;
+        return r;
+    }
+
+    r->file = fopen(path, "rb");
+    if (!r->file)
+    {
+        *error = "Cannot open the file.";
+        free(r);
+        return NULL;
+    }
+    if (!reader_start(r))
+    {
+        *error = r->error;
+        image_reader_close(r);
+        return NULL;
+    }
+    return r;
+}
+
+coord image_reader_width(const image_reader *r)
+{
+    return r->width;
+}
+
+coord image_reader_height(const image_reader *r)
+{
+    return r->height;
+}
+
+bool image_read_rows(void *reader, coord begin, coord end, color *rows)
+{
+    image_reader *r = reader;
+    if (r->is_raw)
+    {
+        memcpy(rows, &r->raw.pixels[(ptrdiff_t)begin * r->width], (size_t)(end - begin) * r->width * sizeof (color));
+        return true;
+    }
+    if (begin < r->next)
+    {
+        png_destroy_read_struct(&r->png, &r->info, NULL);
+        if (!reader_start(r))
+        {
+            return false;
+        }
+    }
+    if (setjmp(png_jmpbuf(r->png)))
+    {
+        r->error = "Cannot decode the PNG file.";
+        return false;
+    }
+
+    /* Skipped rows go to the first row of the buffer. */
+    for (; r->next < begin; r->next++)
+    {
+        png_read_row(r->png, (png_bytep)rows, NULL);
+    }
+    for (; r->next < end; r->next++)
+    {
+        color *row = &rows[(ptrdiff_t)(r->next - begin) * r->width];
+        png_read_row(r->png, (png_bytep)row, NULL);
+        premultiply_row(row, r->width);
+    }
+    return true;
+}
+
+const char *image_reader_error(const image_reader *r)
+{
+    return r->error;
+}
+
+void image_reader_close(image_reader *r)
+{
+    if (r->is_raw)
+    {
+        raw_close(&r->raw);
+        free(r);
+        return;
+    }
+    png_destroy_read_struct(&r->png, &r->info, NULL);
+    fclose(r->file);
+    free(r);
+}
+
+image_writer *image_writer_open(const char *path, coord width, coord height, const char **error)
+{
+    image_writer *w = calloc(1, sizeof *w);
+    if (!w)
+    {
+        *error = "Out of memory.";
+        return NULL;
+    }
+    w->width = width;
+    w->height = height;
+
+    if (image_raw_path(path))
+    {
+        if (!raw_create(&w->raw, path, width, height, error))
+        {
+            free(w);
+            return NULL;
+        }
+        w->is_raw = true;
+        return w;
+    }
+
+    w->file = fopen(path, "wb");
+    if (!w->file)
+    {
+        *error = "Cannot create the file.";
+        free(w);
+        return NULL;
+    }
+
+    w->row = malloc((size_t)width * sizeof (color));
+    w->png = w->row ? png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL) : NULL;
+    w->info = w->png ? png_create_info_struct(w->png) : NULL;
+    if (!w->info)
+    {
+        image_writer_close(w, error);
+        *error = "Out of memory.";
+        return NULL;
+    }
+    if (setjmp(png_jmpbuf(w->png)))
+    {
+        w->failed = true;
+        image_writer_close(w, error);
+        return NULL;
+    }
+
+    png_init_io(w->png, w->file);
+    png_set_IHDR(w->png, w->info, width, height, 8, PNG_COLOR_TYPE_RGB_ALPHA,
+                 PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+    png_write_info(w->png, w->info);
+    png_set_bgr(w->png);
+    return w;
+}
+
+bool image_write_rows(void *writer, coord begin, coord end, const color *rows)
+{
+    image_writer *w = writer;
+    if (w->failed || begin != w->next)
+    {
+        return false;
+    }
+    if (w->is_raw)
+    {
+        memcpy(&w->raw.pixels[(ptrdiff_t)begin * w->width], rows, (size_t)(end - begin) * w->width * sizeof (color));
+        w->next = end;
+        return true;
+    }
+    if (setjmp(png_jmpbuf(w->png)))
+    {
+        w->failed = true;
+        return false;
+    }
+
+    for (; w->next < end; w->next++)
+    {
+        unpremultiply_row(w->row, &rows[(ptrdiff_t)(w->next - begin) * w->width], w->width);
+        png_write_row(w->png, (png_const_bytep)w->row);
+    }
+    return true;
+}
+
+const char *image_writer_error(const image_writer *w)
+{
+    return w->failed ? "Cannot encode the PNG file." : NULL;
+}
+
+bool image_writer_close(image_writer *w, const char **error)
+{
+    bool status = !w->failed && w->next == w->height;
+    if (w->is_raw)
+    {
+        raw_close(&w->raw);
+        if (!status)
+        {
+            *error = "Incomplete raw file.";
+        }
+        free(w);
+        return status;
+    }
+    if (status)
+    {
+        if (setjmp(png_jmpbuf(w->png)))
+        {
+            status = false;
+        }
+        else
+        {
+            png_write_end(w->png, NULL);
+        }
+    }
+    png_destroy_write_struct(&w->png, &w->info);
+    free(w->row);
+
+    if (fclose(w->file) != 0)
+    {
+        status = false;
+    }
+    if (!status)
+    {
+        *error = "Cannot encode the PNG file.";
+    }
+    free(w);
+    return status;
+}
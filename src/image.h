@@ -0,0 +1,70 @@
+#ifndef IMAGE_H
+#define IMAGE_H
+
+#include "perspector.h"
+
+/* A picture in the layout expected by perspector(). The pixels are owned by
+'handle', or by the mapping of a raw file, see image.c. */
+typedef struct
+{
+    color *data;
+    coord width, height;
+    void *handle;
+    void *map;
+    size_t map_length;
+    /* The pixels are mapped to their output file. */
+    bool in_file;
+} image;
+
+/* Whether 'path' designates a raw picture. */
+bool image_raw_path(const char *path);
+
+/* Load a PNG, JPEG, TIFF or raw file. On failure, 'error' is set to a static
+message. */
+bool image_load(image *img, const char *path, const char **error);
+
+/* Same as image_load() for display. JPEG files are decoded at 1/2, 1/4 or 1/8
+of their size, the smallest one whose longest side is at least 'size' pixels.
+Pixel (x, y) of the preview then covers pixels (x * scale, y * scale) to
+((x + 1) * scale - 1, (y + 1) * scale - 1) of the picture. 'scale' is 1 for other
+formats. */
+bool image_load_preview(image *img, const char *path, coord size, int *scale, const char **error);
+
+/* Halve 'src' into 'dest' with a 2x2 box filter, for previews. Odd sides are
+rounded up. */
+bool image_reduce(image *dest, const image *src, const char **error);
+
+/* Allocate an uninitialized picture. */
+bool image_create(image *img, coord width, coord height, const char **error);
+
+/* Same as image_create() for a picture to be saved to 'path'. Raw outputs are
+mapped to their file right away, saving them is then free. */
+bool image_create_output(image *img, const char *path, coord width, coord height, const char **error);
+
+/* Write 'img' as a PNG or raw file depending on the extension of 'path'. */
+bool image_save(image *img, const char *path, const char **error);
+
+void image_free(image *img);
+
+/* Row access to PNG and raw files, for pictures too big to be held in memory. Rows are
+decoded in order; going back restarts the decoding. The reader and writer
+functions match the row_reader and row_writer callbacks of perspector.h. */
+typedef struct image_reader image_reader;
+typedef struct image_writer image_writer;
+
+image_reader *image_reader_open(const char *path, const char **error);
+coord image_reader_width(const image_reader *r);
+coord image_reader_height(const image_reader *r);
+bool image_read_rows(void *reader, coord begin, coord end, color *rows);
+/* Message of the last error of 'r', if any. */
+const char *image_reader_error(const image_reader *r);
+void image_reader_close(image_reader *r);
+
+image_writer *image_writer_open(const char *path, coord width, coord height, const char **error);
+bool image_write_rows(void *writer, coord begin, coord end, const color *rows);
+/* Message of the failure of a write to 'w', if any. */
+const char *image_writer_error(const image_writer *w);
+/* Finish the file. Return false if any write failed. */
+bool image_writer_close(image_writer *w, const char **error);
+
+#endif
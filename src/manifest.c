@@ -0,0 +1,642 @@
+/*
+Batch manifests.
+
+A manifest is a text file with one job per line. Blank lines and lines starting
+with '#' are ignored. A job is either a CSV record
+
+    input,x1,y1,x2,y2,x3,y3,x4,y4,ratio,output
+
+or a JSON object
+
+    {"input": "in.png", "anchors": [[x1, y1], ..., [x4, y4]], "ratio": 1.5, "output": "out.png"}
+
+The ratio is the width / height of the output, either as a positive number or as
+a "width:height" pair. Anchor coordinates are rounded to the closest pixel.
+
+JSON jobs may also choose where they are warped with a "backend" member, either
+"cpu" or "gpu".
+
+The anchors may be omitted, as 8 empty CSV fields or without the JSON member,
+for the frames of a sequence that take the anchors of the previous frame. The
+job then has no anchors.
+
+CSV fields may be quoted with '"', a doubled quote standing for a literal one.
+JSON strings support the standard escapes except surrogate pairs; other members
+of the object are ignored.
+*/
+
+#include <errno.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "manifest.h"
+
+#define CSV_FIELDS 11
+/* Nesting allowed in ignored JSON values. */
+#define JSON_DEPTH 32
+
+static inline bool end_of_line(char c)
+{
+    return c == '\0' || c == '\n' || c == '\r';
+}
+
+static inline const char *skip_space(const char *s)
+{
+    while (*s == ' ' || *s == '\t')
+    {
+        s++;
+    }
+    return s;
+}
+
+static bool parse_coord(double value, coord *c)
+{
+    value = round(value);
+    if (!isfinite(value) || value < -COORD_MAX || value > COORD_MAX)
+    {
+        return false;
+    }
+    *c = (coord)value;
+    return true;
+}
+
+/* Parse a number at 's'. On success, return the first character after it. */
+static const char *parse_number(const char *s, double *value)
+{
+    char *end;
+    errno = 0;
+    *value = strtod(s, &end);
+    if (end == s || errno)
+    {
+        return NULL;
+    }
+    return end;
+}
+
+/* The whole of 's' must be a ratio. */
+static bool parse_ratio(const char *s, double *ratio)
+{
+    double w, h = 1;
+    s = parse_number(skip_space(s), &w);
+    if (!s)
+    {
+        return false;
+    }
+    s = skip_space(s);
+    if (*s == ':')
+    {
+        s = parse_number(skip_space(s + 1), &h);
+        if (!s)
+        {
+            return false;
+        }
+        s = skip_space(s);
+    }
+    if (!end_of_line(*s) || !(w > 0) || !(h > 0) || !isfinite(w / h) || !(w / h > 0))
+    {
+        return false;
+    }
+    *ratio = w / h;
+    return true;
+}
+
+/******************************************************************************/
+/* CSV */
+
+/* Copy the field at 's' to a new string. Return the position of the separator
+that follows, or NULL on error. */
+static const char *csv_field(const char *s, char **field)
+{
+    char *out = malloc(strlen(s) + 1);
+    if (!out)
+    {
+        return NULL;
+    }
+    char *o = out;
+
+    s = skip_space(s);
+    if (*s == '"')
+    {
+        for (s++; !(*s == '"' && s[1] != '"'); s++)
+        {
+            if (*s == '\0')
+            {
+                free(out);
+                return NULL;
+            }
+            if (*s == '"')
+            {
+                s++;
+            }
+            *o++ = *s;
+        }
+        s = skip_space(s + 1);
+        if (*s != ',' && !end_of_line(*s))
+        {
+            free(out);
+            return NULL;
+        }
+    }
+    else
+    {
+        while (*s != ',' && !end_of_line(*s))
+        {
+            *o++ = *s++;
+        }
+        while (o > out && (o[-1] == ' ' || o[-1] == '\t'))
+        {
+            o--;
+        }
+    }
+
+    *o = '\0';
+    *field = out;
+    return s;
+}
+
+static parse_status csv_job(job *j, const char *line, const char **error)
+{
+    char *fields[CSV_FIELDS + 1] = { NULL };
+    size_t count = 0;
+    parse_status status = PARSE_ERROR;
+
+    const char *s = line;
+    do
+    {
+        if (count > CSV_FIELDS)
+        {
+            *error = "Expected 11 fields.";
+            goto out;
+        }
+        s = csv_field(s, &fields[count]);
+        if (!s)
+        {
+            *error = "Invalid field.";
+            goto out;
+        }
+        count++;
+    }
+    while (*s++ == ',');
+
+    if (count != CSV_FIELDS)
+    {
+        *error = "Expected 11 fields.";
+        goto out;
+    }
+
+    size_t i, empty = 0;
+    for (i = 0; i < 8; i++)
+    {
+        empty += *fields[1 + i] == '\0';
+    }
+    for (i = 0; i < 8 && empty < 8; i++)
+    {
+        double value;
+        const char *end = parse_number(fields[1 + i], &value);
+        coord *c = i % 2 ? &j->anchors.pixels[i / 2].y : &j->anchors.pixels[i / 2].x;
+        if (!end || *end != '\0' || !parse_coord(value, c))
+        {
+            *error = "Invalid coordinate.";
+            goto out;
+        }
+    }
+    j->anchors.count = empty < 8 ? 4 : 0;
+
+    if (!parse_ratio(fields[9], &j->ratio))
+    {
+        *error = "Invalid ratio.";
+        goto out;
+    }
+    if (*fields[0] == '\0' || *fields[10] == '\0')
+    {
+        *error = "Empty path.";
+        goto out;
+    }
+
+    j->input = fields[0];
+    j->output = fields[10];
+    fields[0] = fields[10] = NULL;
+    status = PARSE_OK;
+
+out:
+    for (i = 0; i < count; i++)
+    {
+        free(fields[i]);
+    }
+    return status;
+}
+
+/******************************************************************************/
+/* JSON */
+
+static inline int hex_digit(char c)
+{
+    if (c >= '0' && c <= '9')
+    {
+        return c - '0';
+    }
+    if (c >= 'a' && c <= 'f')
+    {
+        return c - 'a' + 10;
+    }
+    if (c >= 'A' && c <= 'F')
+    {
+        return c - 'A' + 10;
+    }
+    return -1;
+}
+
+/* Parse the string at 's' into a new UTF-8 string, or skip it if 'out' is NULL.
+Return the first character after it. */
+static const char *json_string(const char *s, char **out)
+{
+    if (*s != '"')
+    {
+        return NULL;
+    }
+    s++;
+
+    /* Escapes never expand. */
+    char *result = malloc(strlen(s) + 1);
+    if (!result)
+    {
+        return NULL;
+    }
+    char *o = result;
+
+    while (*s != '"')
+    {
+        if ((unsigned char)*s < 0x20)
+        {
+            goto fail;
+        }
+        if (*s != '\\')
+        {
+            *o++ = *s++;
+            continue;
+        }
+
+        s++;
+        switch (*s)
+        {
+        case '"':
+        case '\\':
+        case '/':
+            *o++ = *s;
+            break;
+        case 'b':
+            *o++ = '\b';
+            break;
+        case 'f':
+            *o++ = '\f';
+            break;
+        case 'n':
+            *o++ = '\n';
+            break;
+        case 'r':
+            *o++ = '\r';
+            break;
+        case 't':
+            *o++ = '\t';
+            break;
+        case 'u':
+        {
+            unsigned long u = 0;
+            int i;
+            for (i = 1; i <= 4; i++)
+            {
+                int d = hex_digit(s[i]);
+                if (d < 0)
+                {
+                    goto fail;
+                }
+                u = u * 16 + d;
+            }
+            s += 4;
+            if (u == 0 || (u >= 0xd800 && u <= 0xdfff))
+            {
+                goto fail;
+            }
+            if (u < 0x80)
+            {
+                *o++ = u;
+            }
+            else if (u < 0x800)
+            {
+                *o++ = 0xc0 | (u >> 6);
+                *o++ = 0x80 | (u & 0x3f);
+            }
+            else
+            {
+                *o++ = 0xe0 | (u >> 12);
+                *o++ = 0x80 | ((u >> 6) & 0x3f);
+                *o++ = 0x80 | (u & 0x3f);
+            }
+            break;
+        }
+        default:
+            goto fail;
+        }
+        s++;
+    }
+
+    *o = '\0';
+    if (out)
+    {
+        free(*out);
+        *out = result;
+    }
+    else
+    {
+        free(result);
+    }
+    return s + 1;
+
+fail:
+    free(result);
+    return NULL;
+}
+
+static const char *json_value(const char *s, int depth);
+
+/* Skip an array or an object. */
+static const char *json_container(const char *s, int depth)
+{
+    char close = *s == '[' ? ']' : '}';
+    s = skip_space(s + 1);
+    if (*s == close)
+    {
+        return s + 1;
+    }
+    for (;;)
+    {
+        if (close == '}')
+        {
+            s = json_string(s, NULL);
+            if (!s)
+            {
+                return NULL;
+            }
+            s = skip_space(s);
+            if (*s != ':')
+            {
+                return NULL;
+            }
+            s = skip_space(s + 1);
+        }
+        s = json_value(s, depth + 1);
+        if (!s)
+        {
+            return NULL;
+        }
+        s = skip_space(s);
+        if (*s == close)
+        {
+            return s + 1;
+        }
+        if (*s != ',')
+        {
+            return NULL;
+        }
+        s = skip_space(s + 1);
+    }
+}
+
+/* Skip any value. */
+static const char *json_value(const char *s, int depth)
+{
+    double number;
+    if (depth > JSON_DEPTH)
+    {
+        return NULL;
+    }
+    switch (*s)
+    {
+    case '"':
+        return json_string(s, NULL);
+    case '[':
+    case '{':
+        return json_container(s, depth);
+    case 't':
+        return strncmp(s, "true", 4) ? NULL : s + 4;
+    case 'f':
+        return strncmp(s, "false", 5) ? NULL : s + 5;
+    case 'n':
+        return strncmp(s, "null", 4) ? NULL : s + 4;
+    default:
+        return parse_number(s, &number);
+    }
+}
+
+static const char *json_anchors(const char *s, pixelset *anchors)
+{
+    if (*s != '[')
+    {
+        return NULL;
+    }
+    size_t i;
+    for (i = 0; i < 4; i++)
+    {
+        double x, y;
+        s = skip_space(s + 1);
+        if (*s != '[')
+        {
+            return NULL;
+        }
+        s = parse_number(skip_space(s + 1), &x);
+        if (!s || *(s = skip_space(s)) != ',')
+        {
+            return NULL;
+        }
+        s = parse_number(skip_space(s + 1), &y);
+        if (!s || *(s = skip_space(s)) != ']')
+        {
+            return NULL;
+        }
+        if (!parse_coord(x, &anchors->pixels[i].x) || !parse_coord(y, &anchors->pixels[i].y))
+        {
+            return NULL;
+        }
+        s = skip_space(s + 1);
+        if (*s != (i < 3 ? ',' : ']'))
+        {
+            return NULL;
+        }
+    }
+    anchors->count = 4;
+    return s + 1;
+}
+
+static const char *json_ratio(const char *s, double *ratio)
+{
+    if (*s == '"')
+    {
+        char *text = NULL;
+        s = json_string(s, &text);
+        if (s && !parse_ratio(text, ratio))
+        {
+            s = NULL;
+        }
+        free(text);
+        return s;
+    }
+
+    s = parse_number(s, ratio);
+    if (s && !(*ratio > 0 && isfinite(*ratio)))
+    {
+        return NULL;
+    }
+    return s;
+}
+
+static const char *json_backend(const char *s, backend *b)
+{
+    char *text = NULL;
+    s = json_string(s, &text);
+    if (s && !strcmp(text, "cpu"))
+    {
+        *b = BACKEND_CPU;
+    }
+    else if (s && !strcmp(text, "gpu"))
+    {
+        *b = BACKEND_GPU;
+    }
+    else
+    {
+        s = NULL;
+    }
+    free(text);
+    return s;
+}
+
+static parse_status json_job(job *j, const char *line, const char **error)
+{
+    bool has_ratio = false;
+    const char *s = skip_space(line + 1);
+    *error = "Invalid JSON.";
+
+    while (*s != '}')
+    {
+        char *key = NULL;
+        s = json_string(s, &key);
+        if (!s)
+        {
+            goto fail;
+        }
+        s = skip_space(s);
+        if (*s != ':')
+        {
+            free(key);
+            goto fail;
+        }
+        s = skip_space(s + 1);
+
+        if (!strcmp(key, "input"))
+        {
+            s = json_string(s, &j->input);
+        }
+        else if (!strcmp(key, "output"))
+        {
+            s = json_string(s, &j->output);
+        }
+        else if (!strcmp(key, "anchors"))
+        {
+            s = json_anchors(s, &j->anchors);
+            if (!s)
+            {
+                *error = "Invalid anchors.";
+            }
+        }
+        else if (!strcmp(key, "ratio"))
+        {
+            s = json_ratio(s, &j->ratio);
+            has_ratio = true;
+            if (!s)
+            {
+                *error = "Invalid ratio.";
+            }
+        }
+        else if (!strcmp(key, "backend"))
+        {
+            s = json_backend(s, &j->backend);
+            j->has_backend = true;
+            if (!s)
+            {
+                *error = "Invalid backend, expected cpu or gpu.";
+            }
+        }
+        else
+        {
+            s = json_value(s, 0);
+        }
+        free(key);
+        if (!s)
+        {
+            goto fail;
+        }
+
+        s = skip_space(s);
+        if (*s == ',')
+        {
+            s = skip_space(s + 1);
+            if (*s == '}')
+            {
+                goto fail;
+            }
+        }
+        else if (*s != '}')
+        {
+            goto fail;
+        }
+    }
+
+    if (!end_of_line(*skip_space(s + 1)))
+    {
+        goto fail;
+    }
+    if (!j->input || !j->output || !has_ratio)
+    {
+        *error = "Missing member, expected input, ratio and output.";
+        goto fail;
+    }
+    if (*j->input == '\0' || *j->output == '\0')
+    {
+        *error = "Empty path.";
+        goto fail;
+    }
+    return PARSE_OK;
+
+fail:
+    job_free(j);
+    return PARSE_ERROR;
+}
+
+/******************************************************************************/
+
+parse_status job_parse(job *j, const char *line, const char **error)
+{
+    j->input = NULL;
+    j->output = NULL;
+    j->anchors.count = 0;
+    j->has_backend = false;
+
+    const char *s = skip_space(line);
+    if (end_of_line(*s) || *s == '#')
+    {
+        return PARSE_SKIP;
+    }
+    if (*s == '{')
+    {
+        return json_job(j, s, error);
+    }
+    return csv_job(j, line, error);
+}
+
+void job_free(job *j)
+{
+    free(j->input);
+    free(j->output);
+    j->input = NULL;
+    j->output = NULL;
+}
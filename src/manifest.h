@@ -0,0 +1,37 @@
+#ifndef MANIFEST_H
+#define MANIFEST_H
+
+#include "perspector.h"
+
+/* One entry of a batch manifest. */
+typedef struct
+{
+    char *input;
+    char *output;
+    /* No anchors, i.e. a count of 0, for those of the previous frame. */
+    pixelset anchors;
+    /* Width / height of the output. */
+    double ratio;
+    /* Whether the job chooses its backend instead of the default of the
+    batch. */
+    bool has_backend;
+    backend backend;
+} job;
+
+/* Result of job_parse(). */
+typedef enum
+{
+    PARSE_OK,
+    /* Blank line or comment. */
+    PARSE_SKIP,
+    PARSE_ERROR
+} parse_status;
+
+/* Parse one manifest line, either CSV or a JSON object, see manifest.c. On
+PARSE_OK the strings of 'j' must be released with job_free(). On PARSE_ERROR
+'error' is set to a static message. */
+parse_status job_parse(job *j, const char *line, const char **error);
+
+void job_free(job *j);
+
+#endif
@@ -24,27 +24,37 @@ perspective matrix is 3x3, however since we ultimately apply a projection, we
 only need to determine 8 coefficients.
 
     The resolution of the matrix is a system of 8 equations. Thus we need 4
-points, since each point provides 2 equations, one per dimension. A singular
-value decomposition (SVD) is used to solve the system.
+points, since each point provides 2 equations, one per dimension. Mapping 4
+points to a rectangle has a closed-form solution, see square_to_quad(). When the
+anchors are close to degenerate, a singular value decomposition (SVD) of the
+system is used instead.
 
-* We apply the transformation on every pixel found inside the polygon formed by
-the anchors.
+* By default we walk every pixel of the sink and fetch its color from `bg`
+through the inverse transformation. Each sink pixel is visited exactly once, so
+the cost depends on the output size only.
 
-* The previous transformation might yield 'holes' in the output picture. To fill
-these, we interpolate between the nearest neighbours.
+* The forward mapping is still available: we apply the transformation on every
+pixel found inside the polygon formed by the anchors. This might yield 'holes'
+in the output picture. To fill these, we interpolate between the nearest
+neighbours.
 
 */
 
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <math.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
 #include "perspector.h"
+#include "gpu.h"
+#include "sample.h"
 
-/* Globals */
-/* The following globals are needed as argument of qsort(). */
-/* Reference pixel in angle comparison. */
-static pixel ref;
-/* Barycentre, used as origin in angle comparison. */
-static point bar;
+#ifndef NO_GSL
+#include <gsl/gsl_matrix.h>
+#include <gsl/gsl_linalg.h>
+#endif
 
 /* Position of one point with respect to another. */
 typedef enum
@@ -64,25 +74,27 @@ typedef enum
 
 /******************************************************************************/
 
-int comparex(const void *a, const void *b)
+/* Exchange 'a' and 'b' if 'a' comes after 'b' along 'dir'. */
+static inline void pixel_exchange(pixel *a, pixel *b, direction dir)
 {
-    return ((pixel *)a)->x - ((pixel *)b)->x;
-}
-int comparey(const void *a, const void *b)
-{
-    return ((pixel *)a)->y - ((pixel *)b)->y;
+    if (dir == DIR_X ? a->x > b->x : a->y > b->y)
+    {
+        pixel t = *a;
+        *a = *b;
+        *b = t;
+    }
 }
 
+/* Sort the 4 pixels of 'set' along 'dir' with an optimal sorting network: 5
+comparisons, whatever the input, and no state. */
 static void psort(pixelset *set, direction dir)
 {
-    if (dir == DIR_X)
-    {
-        qsort(set->pixels, set->count, sizeof (pixel), comparex);
-    }
-    else
-    {
-        qsort(set->pixels, set->count, sizeof (pixel), comparey);
-    }
+    pixel *p = set->pixels;
+    pixel_exchange(&p[0], &p[1], dir);
+    pixel_exchange(&p[2], &p[3], dir);
+    pixel_exchange(&p[0], &p[2], dir);
+    pixel_exchange(&p[1], &p[3], dir);
+    pixel_exchange(&p[1], &p[2], dir);
 }
 
 /* Return position of point 'p' compared to the vector (refn-origin). */
@@ -136,11 +148,11 @@ inline static position pos(point p, point refn)
 
 /* 'a' is less than 'b' if its angle to 'ref' with 'bar' as origin is inferior,
 * meaning that 'a' is closer to ref than 'b'. */
-static int compare_angle(const void *a, const void *b)
+static int compare_angle(const pixel *a, const pixel *b, pixel ref, point bar)
 {
     point refn = { ref.x - bar.x, ref.y - bar.y };
-    point an = { ((pixel *)a)->x - bar.x, ((pixel *)a)->y - bar.y };
-    point bn = { ((pixel *)b)->x - bar.x, ((pixel *)b)->y - bar.y };
+    point an = { a->x - bar.x, a->y - bar.y };
+    point bn = { b->x - bar.x, b->y - bar.y };
 
     position an_refn = pos(an, refn);
     position an_bn = pos(an, bn);
@@ -168,6 +180,35 @@ static int compare_angle(const void *a, const void *b)
     }
 }
 
+/* Whether 'p' and 'q' have the same angle around the origin, or either one is
+the origin. */
+static inline bool same_ray(point p, point q)
+{
+    return p.x * q.y - p.y * q.x == 0 && p.x * q.x + p.y * q.y >= 0;
+}
+
+static inline void angle_exchange(pixel *a, pixel *b, pixel ref, point bar)
+{
+    if (compare_angle(a, b, ref, bar) > 0)
+    {
+        pixel t = *a;
+        *a = *b;
+        *b = t;
+    }
+}
+
+/* Sort the 4 pixels of 'set' by angle to 'ref' around 'bar', with the network
+of psort(). */
+static void angle_sort(pixelset *set, pixel ref, point bar)
+{
+    pixel *p = set->pixels;
+    angle_exchange(&p[0], &p[1], ref, bar);
+    angle_exchange(&p[2], &p[3], ref, bar);
+    angle_exchange(&p[0], &p[2], ref, bar);
+    angle_exchange(&p[1], &p[3], ref, bar);
+    angle_exchange(&p[1], &p[2], ref, bar);
+}
+
 /* Check if the order in which the points are passed as arguments match
 * 'order'. */
 static bool check_order(pixelset order, pixel bl, pixel br, pixel tr, pixel tl)
@@ -217,8 +258,8 @@ Y-aligned, and vice-versa;
 yield the same result as the other way around in these last 2 cases. We raise
 the ambiguity if only one way preserves the relative order.
 */
-/* Not static for test purposes. */
-bool projectable(rect *result, pixelset *anchors)
+/* Reentrant: the sorts only use the stack. Not static for test purposes. */
+bool projectable(rect *result, const pixelset *anchors)
 {
     pixelset xsorted = *anchors;
     pixelset ysorted = *anchors;
@@ -274,38 +315,30 @@ bool projectable(rect *result, pixelset *anchors)
     {
         /* 2 pairs in 2 partitions. */
 
-        /* Compute barycentre. We need to set global variables here for `qsort`.
-        Variable 'a b c d' are shortcuts. */
+        /* Compute barycentre. Variable 'a b c d' are shortcuts. */
         pixel a = anchors->pixels[0];
         pixel b = anchors->pixels[1];
         pixel c = anchors->pixels[2];
         pixel d = anchors->pixels[3];
-        bar.x = (double)(a.x + b.x + c.x + d.x) / 4;
-        bar.y = (double)(a.y + b.y + c.y + d.y) / 4;
+        point bar = { (double)(a.x + b.x + c.x + d.x) / 4, (double)(a.y + b.y + c.y + d.y) / 4 };
 
         /* If at least one point is equal to the barycentre, this is not computable
         since this point is not comparable. If at least two points are aligned with
-        the barycentre, comparison cannot is not strict and thus
-        underterministic. */
+        the barycentre on the same side, comparison is not strict and the order
+        would depend on the sort. */
         point an = { a.x - bar.x, a.y - bar.y };
         point bn = { b.x - bar.x, b.y - bar.y };
         point cn = { c.x - bar.x, c.y - bar.y };
         point dn = { d.x - bar.x, d.y - bar.y };
-        unsigned int UNDESIRED = EQUAL | OPPOSED | UNDEF;
-        if ((pos(an, bn) == UNDESIRED)
-                || (pos(an, cn) == UNDESIRED)
-                || (pos(an, dn) == UNDESIRED)
-                || (pos(bn, cn) == UNDESIRED)
-                || (pos(bn, dn) == UNDESIRED)
-                || (pos(cn, dn) == UNDESIRED))
+        if (same_ray(an, bn) || same_ray(an, cn) || same_ray(an, dn)
+                || same_ray(bn, cn) || same_ray(bn, dn) || same_ray(cn, dn))
         {
             return false;
         }
 
         /* Order is trigonometric. */
-        ref = a;
         pixelset order = { .pixels = { a, b, c, d }, .count = 4 };
-        qsort(order.pixels, order.count, sizeof (pixel), compare_angle);
+        angle_sort(&order, a, bar);
 
         bool x_ok = false;
         bool y_ok = false;
@@ -398,6 +431,108 @@ bool projectable(rect *result, pixelset *anchors)
     return false;
 }
 
+/* Invert a 3x3 matrix. Since we work in homogeneous coordinates the result is
+up to a scale factor, so the adjugate is enough: we do not need to divide by the
+determinant. Return false if the matrix is singular. */
+static bool invert_matrix(double inverse[9], const double m[9])
+{
+    inverse[0] = m[4] * m[8] - m[5] * m[7];
+    inverse[1] = m[2] * m[7] - m[1] * m[8];
+    inverse[2] = m[1] * m[5] - m[2] * m[4];
+    inverse[3] = m[5] * m[6] - m[3] * m[8];
+    inverse[4] = m[0] * m[8] - m[2] * m[6];
+    inverse[5] = m[2] * m[3] - m[0] * m[5];
+    inverse[6] = m[3] * m[7] - m[4] * m[6];
+    inverse[7] = m[1] * m[6] - m[0] * m[7];
+    inverse[8] = m[0] * m[4] - m[1] * m[3];
+
+    double det = m[0] * inverse[0] + m[1] * inverse[3] + m[2] * inverse[6];
+    return det != 0;
+}
+
+/* Below this ratio between the area of the smallest triangle made of 3 anchors
+and the squared size of the quadrilateral, the closed form loses too much
+precision. */
+#define CONDITION_MIN 1e-6
+
+/* Matrix of the homography mapping the unit square (0, 0), (1, 0), (1, 1),
+(0, 1) to the quadrilateral 'q', see Heckbert, "Fundamentals of Texture Mapping
+and Image Warping", 1989. Return false if 'q' is ill-conditioned. */
+static bool square_to_quad(double m[9], const point q[4])
+{
+    double size = 0;
+    double area = INFINITY;
+    size_t i;
+    for (i = 0; i < 4; i++)
+    {
+        point a = q[(i + 3) % 4], b = q[i], c = q[(i + 1) % 4];
+        double ab = (b.x - a.x) * (b.x - a.x) + (b.y - a.y) * (b.y - a.y);
+        double ac = (c.x - a.x) * (c.x - a.x) + (c.y - a.y) * (c.y - a.y);
+        double cross = fabs((b.x - a.x) * (c.y - a.y) - (b.y - a.y) * (c.x - a.x));
+        size = ab > size ? ab : size;
+        size = ac > size ? ac : size;
+        area = cross < area ? cross : area;
+    }
+    if (!(area > CONDITION_MIN * size))
+    {
+        return false;
+    }
+
+    double sx = q[0].x - q[1].x + q[2].x - q[3].x;
+    double sy = q[0].y - q[1].y + q[2].y - q[3].y;
+    double dx1 = q[1].x - q[2].x, dx2 = q[3].x - q[2].x;
+    double dy1 = q[1].y - q[2].y, dy2 = q[3].y - q[2].y;
+    double den = dx1 * dy2 - dx2 * dy1;
+    /* 'den' is twice the area of the triangle (q[1], q[2], q[3]). */
+    double g = (sx * dy2 - dx2 * sy) / den;
+    double h = (dx1 * sy - sx * dy1) / den;
+
+    m[0] = q[1].x - q[0].x + g * q[1].x;
+    m[1] = q[3].x - q[0].x + h * q[3].x;
+    m[2] = q[0].x;
+    m[3] = q[1].y - q[0].y + g * q[1].y;
+    m[4] = q[3].y - q[0].y + h * q[3].y;
+    m[5] = q[0].y;
+    m[6] = g;
+    m[7] = h;
+    m[8] = 1;
+    return true;
+}
+
+/* Solve the transformation in closed form: the inverse of square_to_quad(),
+scaled to the sink. Not static for test purposes. */
+bool closed_form_matrix(double transform_matrix[9], const rect *vertices, coord width, coord height)
+{
+    point q[4] =
+    {
+        { vertices->bl.x, vertices->bl.y },
+        { vertices->br.x, vertices->br.y },
+        { vertices->tr.x, vertices->tr.y },
+        { vertices->tl.x, vertices->tl.y }
+    };
+    double square[9], m[9];
+    if (!square_to_quad(square, q) || !invert_matrix(m, square))
+    {
+        return false;
+    }
+
+    /* Like the SVD, return a matrix of unit norm. */
+    double norm = 0;
+    int i;
+    for (i = 0; i < 9; i++)
+    {
+        m[i] *= i < 3 ? width : i < 6 ? height : 1;
+        norm += m[i] * m[i];
+    }
+    norm = sqrt(norm);
+    for (i = 0; i < 9; i++)
+    {
+        transform_matrix[i] = m[i] / norm;
+    }
+    return true;
+}
+
+#ifndef NO_GSL
 /* Generate matrix corresponding to the system of equations induced by the
 homogeneous transformation of 4 pixels. Note that since we have only 4 points,
 we have only 8 equations (4 per dimension). Since we are in homogeneous
@@ -453,23 +588,16 @@ static double *init_system_equation(double system_equation[81], pixel bl, pixel
     return system_equation;
 }
 
-/* Not static so that it can be tested externally. */
-bool make_transform_matrix(double transform_matrix[9], pixelset *anchors, coord width, coord height)
+/* Solve the system of equations by SVD. This is slow but robust to nearly
+degenerate anchors. Not static for test purposes. */
+bool svd_matrix(double transform_matrix[9], const rect *vertices, coord width, coord height)
 {
-    rect vertices;
-
-    bool status = projectable(&vertices, anchors);
-    if (!status)
-    {
-        return false;
-    }
-
     /* System of equations dimensions: there are 9 equations of 9 unknowns (the
     number of elements in the transform matrix). */
 #define ROWS 9
 #define COLS 9
     double system_equation[81];
-    init_system_equation(system_equation, vertices.bl, vertices.br, vertices.tr, vertices.tl, width, height);
+    init_system_equation(system_equation, vertices->bl, vertices->br, vertices->tr, vertices->tl, width, height);
 
     gsl_matrix_view m = gsl_matrix_view_array(system_equation, ROWS, COLS);
 
@@ -499,164 +627,2092 @@ bool make_transform_matrix(double transform_matrix[9], pixelset *anchors, coord
 
     return true;
 }
+#endif
 
-bool perspector(
-    color *sink_data, coord sink_width, coord sink_height,
-    color *bg_data, coord bg_width, coord bg_height,
-    pixelset *anchors)
+/* Whether a * b == c * d, exactly. Factors below 2^32 in magnitude, such as the
+differences of two coords, have products fitting a uint64_t. */
+static bool same_product(int64_t a, int64_t b, int64_t c, int64_t d)
 {
-
-    double transform_matrix[9];
-    coord x, y, i, j;
-    coord x2, y2, x_min, x_max, y_min, y_max;
-    coord radius, index;
-    double red_buf, green_buf, blue_buf, alpha_buf;
-    int count;
-    bool status = make_transform_matrix(transform_matrix, anchors, sink_width, sink_height);
-    /* TODO: report status message. */
-    if (!status)
+    int left = (a > 0) - (a < 0), right = (c > 0) - (c < 0);
+    left *= (b > 0) - (b < 0);
+    right *= (d > 0) - (d < 0);
+    if (left != right)
     {
         return false;
     }
+    uint64_t ua = a < 0 ? -(uint64_t)a : (uint64_t)a, ub = b < 0 ? -(uint64_t)b : (uint64_t)b;
+    uint64_t uc = c < 0 ? -(uint64_t)c : (uint64_t)c, ud = d < 0 ? -(uint64_t)d : (uint64_t)d;
+    return ua * ub == uc * ud;
+}
 
-    gsl_matrix_view transform_mv = gsl_matrix_view_array(transform_matrix, 3, 3);
-
-    /* We proceed in two steps: first we transform every pixel in 'bg' between the
-    * anchors to the 'sink'. Every pixel processed in sink is marked in
-    * 'interpol_mask'. Second, we interpolate every pixel from sink that is not
-    * marked in 'interpol_mask'. */
-
-    /* TODO: for now, we loop over all pixels and discard those leading values
-    outside the sink. It would be much faster to loop over the polygon
-    defined by the anchors, but this is quite long to implement: first we
-    need to split the polygon in triangles, taking care of not splitting on
-    concavities. Second, we loop over every triangle, marking the vertices as
-    'processed' when done. This way we can discard a segment if its 2
-    vertices are already processed.
-
-    To process a triangle, one need to start from the upper vertex and to
-    proceed line by line, starting from the segment where the other vertex is
-    highest, ending on the segment of the other vertex. Once reached, and if
-    the remaining segment was not reached as well, we start from the last
-    segment.
-
-    TODO: Use external library for that?
-    */
+/* Whether 3 of the vertices lie on a line, or 2 of them on the same pixel: no
+homography maps them to the corners of a rectangle, whatever the solver
+returns. The test is exact over the whole range of coords. */
+static bool flat(const rect *vertices)
+{
+    const pixel *p = &vertices->bl;
+    size_t i;
+    for (i = 0; i < 4; i++)
+    {
+        pixel a = p[(i + 3) % 4], b = p[i], c = p[(i + 1) % 4];
+        if (same_product((int64_t)b.x - a.x, (int64_t)c.y - a.y, (int64_t)b.y - a.y, (int64_t)c.x - a.x))
+        {
+            return true;
+        }
+    }
+    return false;
+}
 
-    /* Loop over pixels in bg: */
-    if (COORD_MAX / sink_width < sink_height)
+/* Matrix of anchors dispatched over the corners of the sink: the closed form,
+or the SVD if it is ill-conditioned. Return false if there is no solution. */
+static bool solve_vertices(double transform_matrix[9], const rect *vertices, coord width, coord height)
+{
+    if (flat(vertices))
     {
-        fprintf(stderr, "The picture is too big, memory cannot be allocated.\n");
         return false;
     }
+    if (closed_form_matrix(transform_matrix, vertices, width, height))
+    {
+        return true;
+    }
+#ifdef NO_GSL
+    return false;
+#else
+    return svd_matrix(transform_matrix, vertices, width, height);
+#endif
+}
+
+/* Not static so that it can be tested externally. */
+bool make_transform_matrix(double transform_matrix[9], const pixelset *anchors, coord width, coord height)
+{
+    rect vertices;
+    return projectable(&vertices, anchors) && solve_vertices(transform_matrix, &vertices, width, height);
+}
 
-    /* We use the following mask to know which pixel in the sink has been set. */
-    bool *transformed_mask = calloc(sink_width * sink_height, sizeof (bool));
-    if (!transformed_mask)
+size_t solve_anchors(const pixelset *anchors, size_t count, coord width, coord height, solution *solutions)
+{
+    size_t i, valid = 0;
+    for (i = 0; i < count; i++)
     {
-        fprintf(stderr, "Transformed mask allocation error.\n");
-        return false;
+        solution *s = &solutions[i];
+        s->valid = anchors[i].count == 4 && projectable(&s->corners, &anchors[i])
+                   && solve_vertices(s->matrix, &s->corners, width, height);
+        valid += s->valid;
     }
-    for (x = 0; x < bg_width; x++)
+    return valid;
+}
+
+/* Homogeneous coordinates of the transformation of a pixel walking along a row
+(or a column) of pixels. The transformation is linear before the projection, so
+a step of one pixel only adds a constant to every component: this is much
+cheaper than a full matrix-vector product per pixel. A walker can be restarted
+at any pixel, which bounds the accumulation of rounding errors to the length of
+a row. */
+typedef struct
+{
+    double x, y, w;
+    double dx, dy, dw;
+} walker;
+
+/* Start walking at pixel (x, y) of the source space of 'm', moving by
+(step_x, step_y) at each walker_next(). */
+static inline void walker_start(walker *k, const double m[9], coord x, coord y, coord step_x, coord step_y)
+{
+    k->x = m[0] * x + m[1] * y + m[2];
+    k->y = m[3] * x + m[4] * y + m[5];
+    k->w = m[6] * x + m[7] * y + m[8];
+    k->dx = m[0] * step_x + m[1] * step_y;
+    k->dy = m[3] * step_x + m[4] * step_y;
+    k->dw = m[6] * step_x + m[7] * step_y;
+}
+
+static inline void walker_next(walker *k)
+{
+    k->x += k->dx;
+    k->y += k->dy;
+    k->w += k->dw;
+}
+
+/* Project the current position back to the 2D plane. */
+static inline point walker_point(const walker *k)
+{
+    double r = 1 / k->w;
+    point p = { k->x * r, k->y * r };
+    return p;
+}
+
+/* Monotonic clock in seconds, for the stats. */
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Counters of a worker for the stats of the forward mapping, see stats. */
+typedef struct
+{
+    uint64_t transformed, holes;
+    double radius_sum, radius_max;
+} tally;
+
+/* Progress of a warp, shared by the workers. Passes are reported one after
+the other, each one as 'height' rows whatever its number of lines. */
+typedef struct
+{
+    progress_callback func;
+    void *data;
+    pthread_mutex_t lock;
+    size_t height, total;
+    /* Rows of the passes already done. */
+    size_t base;
+    /* Lines of the current pass. */
+    coord lines, lines_done;
+    bool cancelled;
+} progress;
+
+/* Number of reports per band and pass. */
+#define PROGRESS_STEPS 32
+
+static void progress_init(progress *p, progress_callback func, void *data, coord height, unsigned int passes)
+{
+    p->func = func;
+    p->data = data;
+    pthread_mutex_init(&p->lock, NULL);
+    p->height = height;
+    p->total = (size_t)height * passes;
+    p->base = 0;
+    p->lines = 0;
+    p->lines_done = 0;
+    p->cancelled = false;
+}
+
+static void progress_add(progress *p, coord lines)
+{
+    pthread_mutex_lock(&p->lock);
+    p->lines_done += lines;
+    size_t done = p->base + (size_t)((double)p->lines_done / p->lines * p->height);
+    if (!p->cancelled && !p->func(p->data, done, p->total))
     {
-        for (y = 0; y < bg_height; y++)
-        {
-            double pin[3] = { x, y, 1 };
-            gsl_vector_view pin_vv = gsl_vector_view_array(pin, 3);
-            double pout[3];
-            gsl_vector_view pout_vv = gsl_vector_view_array(pout, 3);
-            gsl_blas_dgemv(CblasNoTrans,
-                           1.0, &transform_mv.matrix, &pin_vv.vector,
-                           0.0, &pout_vv.vector);
+        p->cancelled = true;
+    }
+    pthread_mutex_unlock(&p->lock);
+}
 
-            /* 'round' is required since a cast floors the value. */
-            x2 = round(pout[0] / pout[2]);
-            y2 = round(pout[1] / pout[2]);
+static bool progress_cancelled(progress *p)
+{
+    pthread_mutex_lock(&p->lock);
+    bool cancelled = p->cancelled;
+    pthread_mutex_unlock(&p->lock);
+    return cancelled;
+}
 
-            if (x2 >= 0 && y2 >= 0 && x2 < sink_width && y2 < sink_height)
-            {
-                sink_data[y2 * sink_width + x2] = bg_data[y * bg_width + x];
-                transformed_mask[y2 * sink_width + x2] = true;
-            }
-        }
+/* Box-filtered halvings of 'bg' for the inverse mapping, level 0 being 'bg'
+itself. A level pixel covers 2x2 pixels of the previous level, the last row and
+column being repeated for odd sizes, the way image_reduce() does. */
+#define MIP_LEVELS 16
+
+typedef struct
+{
+    const color *data;
+    coord width, height;
+    /* Inverse matrix to the pixels of the level. */
+    double inverse[9];
+} mip_level;
+
+/* Everything a worker needs to process a band of the sink. */
+typedef struct
+{
+    color *sink_data;
+    coord sink_width, sink_height;
+    /* Row of the transform that row 0 of 'sink_data' is, for the positions of
+    the inverse mapping: not 0 on the strips of transform_stream(). */
+    coord sink_row;
+    const color *bg_data;
+    coord bg_width, bg_height;
+    /* Inverse mapping: the rows of 'bg' from 'bg_top' on are held in 'bg_data',
+    see row_kernel. Not 0 on the strips of transform_stream(). */
+    coord bg_top;
+    double matrix[9];
+    double inverse[9];
+    /* Sink pixels whose source is outside 'bg'. */
+    outside outside;
+    color background;
+    /* With OUTSIDE_BACKGROUND: see bg_span(). */
+    const coord *spans;
+    /* Inverse mapping only: interpolation kernel. */
+    row_kernel kernel;
+    /* Inverse mapping with mipmaps: levels, and the level of each row of the
+    sink, or NULL to sample 'bg' only. */
+    mip_level levels[MIP_LEVELS];
+    const unsigned char *row_levels;
+    /* While building level 'reduced', see reduce_band(). */
+    unsigned int reduced;
+    color *reduce_out;
+    /* Forward mapping only: which pixel in the sink has been set, see
+    mask_row(). */
+    uint64_t *transformed_mask;
+    size_t mask_stride;
+    /* With FILL_DISTANCE: for every pixel, the row of the closest set pixel of
+    its column, or -1 if the column is empty. */
+    int32_t *nearest_row;
+    /* With FILL_DISTANCE: lower envelope of each worker, see
+    distance_fill_band(). */
+    coord *columns;
+    double *bounds;
+    /* NULL if not reported. */
+    progress *progress;
+    /* Forward mapping: one per worker, NULL without stats. */
+    tally *tallies;
+    /* Buffers of the warp. */
+    workspace *ws;
+} warp;
+
+/* The mask holds one bit per pixel. Rows start on a word so that bands of rows
+never share one: row 'y' is made of the 'mask_stride' words from
+'transformed_mask[y * mask_stride]'. */
+#define MASK_BITS 64
+
+static inline size_t mask_stride(coord width)
+{
+    return ((size_t)width + MASK_BITS - 1) / MASK_BITS;
+}
+
+static inline uint64_t *mask_row(const warp *w, coord y)
+{
+    return &w->transformed_mask[(size_t)y * w->mask_stride];
+}
+
+static inline bool mask_test(const uint64_t *row, coord x)
+{
+    return row[x / MASK_BITS] >> (x % MASK_BITS) & 1;
+}
+
+static inline void mask_set(uint64_t *row, coord x)
+{
+    row[x / MASK_BITS] |= (uint64_t)1 << (x % MASK_BITS);
+}
+
+/* Process lines [begin, end[ of the sink. Lines are rows unless stated
+otherwise. 'worker' is the index of the band, for per-worker buffers. */
+typedef void (*band_func)(const warp *w, coord begin, coord end, unsigned int worker);
+
+typedef struct
+{
+    band_func func;
+    const warp *w;
+    coord begin, end;
+    unsigned int worker;
+} band;
+
+/* Threads of a workspace, parked between passes. Helper 'i' processes band
+'i + 1' of every pass, the calling thread band 0. */
+typedef struct pool pool;
+
+typedef struct
+{
+    pool *pool;
+    unsigned int index;
+    /* Last pass seen by the helper. */
+    unsigned long pass;
+    pthread_t thread;
+} helper;
+
+struct pool
+{
+    pthread_mutex_t lock;
+    pthread_cond_t start, finish;
+    /* Helpers are allocated one by one since they must not move. */
+    helper **helpers;
+    unsigned int count, capacity;
+    /* The current pass, its bands and the number of helpers still on them. */
+    unsigned long pass;
+    band *bands;
+    unsigned int band_count, running;
+    bool quit;
+};
+
+/* See perspector.h. Buffers only grow, so that warps of the same size reuse
+them without allocating. */
+struct workspace
+{
+    /* Forward mapping, see warp. */
+    uint64_t *mask;
+    size_t mask_size;
+    int32_t *nearest_row;
+    size_t nearest_size;
+    coord *columns;
+    size_t columns_size;
+    double *bounds;
+    size_t bounds_size;
+    tally *tallies;
+    size_t tallies_size;
+    /* Levels 1 and more of the mipmaps, one after the other. */
+    color *pyramid;
+    size_t pyramid_size;
+    /* Bands of run_bands() and the threads processing them. */
+    band *bands;
+    size_t bands_size;
+    pool pool;
+};
+
+static void workspace_init(workspace *ws)
+{
+    memset(ws, 0, sizeof *ws);
+    pthread_mutex_init(&ws->pool.lock, NULL);
+    pthread_cond_init(&ws->pool.start, NULL);
+    pthread_cond_init(&ws->pool.finish, NULL);
+}
+
+static void pool_release(pool *p)
+{
+    unsigned int i;
+    pthread_mutex_lock(&p->lock);
+    p->quit = true;
+    pthread_cond_broadcast(&p->start);
+    pthread_mutex_unlock(&p->lock);
+    for (i = 0; i < p->count; i++)
+    {
+        pthread_join(p->helpers[i]->thread, NULL);
+        free(p->helpers[i]);
     }
+    free(p->helpers);
+    pthread_cond_destroy(&p->finish);
+    pthread_cond_destroy(&p->start);
+    pthread_mutex_destroy(&p->lock);
+}
 
-    /* Interpolate the holes.
-    TODO: Improve interpolation.
-    -Allow choosing between linear and Lanczlos.
-    -Allow choosing between manhattan distance and euclidian distance.
-    http://en.wikipedia.org/wiki/Multivariate_interpolation#Irregular_grid_.28scattered_data.29
-    */
+static void workspace_release(workspace *ws)
+{
+    free(ws->mask);
+    free(ws->nearest_row);
+    free(ws->columns);
+    free(ws->bounds);
+    free(ws->tallies);
+    free(ws->pyramid);
+    free(ws->bands);
+    pool_release(&ws->pool);
+}
 
-    for (x = 0; x < sink_width; x++)
+workspace *workspace_new(void)
+{
+    workspace *ws = malloc(sizeof *ws);
+    if (ws)
     {
-        for (y = 0; y < sink_height; y++)
+        workspace_init(ws);
+    }
+    return ws;
+}
+
+void workspace_free(workspace *ws)
+{
+    if (ws)
+    {
+        workspace_release(ws);
+        free(ws);
+    }
+}
+
+/* Room for 'count' elements of 'size' bytes, reusing 'buffer' if its
+'*capacity' is enough. The content is lost, or zeroed if 'zero'. Return NULL if
+the allocation fails. */
+static void *reserve(void *buffer, size_t *capacity, size_t count, size_t size, bool zero)
+{
+    if (count <= *capacity)
+    {
+        if (zero)
         {
-            if (!transformed_mask[y * sink_width + x])
-            {
-                /* We will sum the colors of all the pixels in the radius to compute the
-                * mean. We need intermediate variables for colors to prevent
-                * overflow. */
-                red_buf = green_buf = blue_buf = alpha_buf = 0;
-                count = 0;
-                for (radius = 1; !count; radius++)
-                {
-                    /* We use a square instead of a circle for performance reasons. */
-                    x_min = x - radius;
-                    x_max = x + radius;
-                    y_min = y - radius;
-                    y_max = y + radius;
-                    x_min = (x_min < 0) ? 0 : x_min;
-                    y_min = (y_min < 0) ? 0 : y_min;
-                    x_max = (x_max >= sink_width) ? (sink_width - 1) : x_max;
-                    y_max = (y_max >= sink_height) ? (sink_height - 1) : y_max;
+            memset(buffer, 0, count * size);
+        }
+        return buffer;
+    }
+    free(buffer);
+    /* Fresh pages from calloc() are zeroed for free. */
+    buffer = zero ? calloc(count, size) : malloc(count * size);
+    *capacity = buffer ? count : 0;
+    return buffer;
+}
 
-                    for (i = x_min; i <= x_max; i += x_max - x_min)
-                    {
-                        for (j = y_min; j <= y_max; j++)
-                        {
-                            index = j * sink_width + i;
-                            if (transformed_mask[index])
-                            {
-                                count++;
-                                red_buf += (double)sink_data[index].red;
-                                green_buf += (double)sink_data[index].green;
-                                blue_buf += (double)sink_data[index].blue;
-                                alpha_buf += (double)sink_data[index].alpha;
-                            }
-                        }
-                    }
+/* With progress reports, the band is processed in steps; every band function
+gives the same result on a band and on its parts. */
+static void *band_thread(void *data)
+{
+    band *b = data;
+    progress *p = b->w->progress;
+    if (!p)
+    {
+        b->func(b->w, b->begin, b->end, b->worker);
+        return NULL;
+    }
 
-                    for (j = y_min; j <= y_max; j += y_max - y_min)
-                    {
-                        for (i = x_min; i <= x_max; i++)
-                        {
-                            index = j * sink_width + i;
-                            if (transformed_mask[index])
-                            {
-                                count++;
-                                red_buf += (double)sink_data[index].red;
-                                green_buf += (double)sink_data[index].green;
-                                blue_buf += (double)sink_data[index].blue;
-                                alpha_buf += (double)sink_data[index].alpha;
-                            }
-                        }
-                    }
-                }
+    coord step = (b->end - b->begin + PROGRESS_STEPS - 1) / PROGRESS_STEPS;
+    coord line;
+    for (line = b->begin; line < b->end && !progress_cancelled(p); line += step)
+    {
+        coord end = b->end - line > step ? line + step : b->end;
+        b->func(b->w, line, end, b->worker);
+        progress_add(p, end - line);
+    }
+    return NULL;
+}
 
-                red_buf /= count;
-                green_buf /= count;
-                blue_buf /= count;
-                alpha_buf /= count;
-                index = y * sink_width + x;
-                sink_data[index].red = (char)red_buf;
-                sink_data[index].green = (char)green_buf;
-                sink_data[index].blue = (char)blue_buf;
-                sink_data[index].alpha = (char)alpha_buf;
+/* Wait for the passes, processing the band of each. */
+static void *helper_thread(void *data)
+{
+    helper *h = data;
+    pool *p = h->pool;
+    pthread_mutex_lock(&p->lock);
+    for (;;)
+    {
+        while (!p->quit && p->pass == h->pass)
+        {
+            pthread_cond_wait(&p->start, &p->lock);
+        }
+        if (p->quit)
+        {
+            break;
+        }
+        h->pass = p->pass;
+        if (h->index + 1 < p->band_count)
+        {
+            band *b = &p->bands[h->index + 1];
+            pthread_mutex_unlock(&p->lock);
+            band_thread(b);
+            pthread_mutex_lock(&p->lock);
+            if (--p->running == 0)
+            {
+                pthread_cond_signal(&p->finish);
             }
         }
     }
+    pthread_mutex_unlock(&p->lock);
+    return NULL;
+}
 
-    free(transformed_mask);
-    return true;
+/* Start helpers until there are 'count' of them. Return how many there are,
+fewer if a thread cannot be started. */
+static unsigned int pool_reserve(pool *p, unsigned int count)
+{
+    if (count > p->capacity)
+    {
+        helper **helpers = realloc(p->helpers, count * sizeof *helpers);
+        if (!helpers)
+        {
+            return p->count;
+        }
+        p->helpers = helpers;
+        p->capacity = count;
+    }
+    while (p->count < count)
+    {
+        helper *h = malloc(sizeof *h);
+        if (!h)
+        {
+            break;
+        }
+        h->pool = p;
+        h->index = p->count;
+        /* Helpers are started between passes, the lock is free. */
+        h->pass = p->pass;
+        if (pthread_create(&h->thread, NULL, helper_thread, h) != 0)
+        {
+            free(h);
+            break;
+        }
+        p->helpers[p->count++] = h;
+    }
+    return p->count;
+}
+
+/* Resolve the number of workers: 0 means one per online processor. There is no
+point in having more workers than rows. */
+static unsigned int thread_count(unsigned int threads, coord rows)
+{
+    if (threads == 0)
+    {
+        long online = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = online > 0 ? (unsigned int)online : 1;
+    }
+    if ((coord)threads > rows)
+    {
+        threads = rows > 0 ? rows : 1;
+    }
+    return threads;
+}
+
+/* Close the current pass of 'w'. Return false if the warp was cancelled. */
+static bool pass_done(const warp *w)
+{
+    if (!w->progress)
+    {
+        return true;
+    }
+    w->progress->base += w->progress->height;
+    return !progress_cancelled(w->progress);
+}
+
+/* Split 'lines' lines of the sink in 'threads' contiguous bands and process them
+in parallel on the threads of the workspace, started on the first pass that
+needs them. Bands never overlap, so as long as 'func' only writes to the lines
+it was given, the result does not depend on the number of threads. The bands
+without a thread, if some cannot be started, are processed by the calling
+thread. Return false if the warp was cancelled. */
+static bool run_bands(band_func func, const warp *w, coord lines, unsigned int threads)
+{
+    unsigned int i;
+    band whole = { .func = func, .w = w, .begin = 0, .end = lines, .worker = 0 };
+
+    if (w->progress)
+    {
+        if (progress_cancelled(w->progress))
+        {
+            return false;
+        }
+        w->progress->lines = lines;
+        w->progress->lines_done = 0;
+    }
+
+    if ((coord)threads > lines)
+    {
+        threads = lines;
+    }
+    if (threads <= 1)
+    {
+        band_thread(&whole);
+        return pass_done(w);
+    }
+
+    workspace *ws = w->ws;
+    ws->bands = reserve(ws->bands, &ws->bands_size, threads, sizeof (band), false);
+    if (!ws->bands)
+    {
+        band_thread(&whole);
+        return pass_done(w);
+    }
+
+    band *bands = ws->bands;
+    for (i = 0; i < threads; i++)
+    {
+        bands[i].func = func;
+        bands[i].w = w;
+        bands[i].begin = (int64_t)lines * i / threads;
+        bands[i].end = (int64_t)lines * (i + 1) / threads;
+        bands[i].worker = i;
+    }
+
+    pool *p = &ws->pool;
+    unsigned int helpers = pool_reserve(p, threads - 1);
+    unsigned int started = helpers + 1 < threads ? helpers + 1 : threads;
+    pthread_mutex_lock(&p->lock);
+    p->bands = bands;
+    p->band_count = started;
+    p->running = started - 1;
+    p->pass++;
+    pthread_cond_broadcast(&p->start);
+    pthread_mutex_unlock(&p->lock);
+
+    band_thread(&bands[0]);
+    for (i = started; i < threads; i++)
+    {
+        band_thread(&bands[i]);
+    }
+    pthread_mutex_lock(&p->lock);
+    while (p->running > 0)
+    {
+        pthread_cond_wait(&p->finish, &p->lock);
+    }
+    pthread_mutex_unlock(&p->lock);
+    return pass_done(w);
+}
+
+/* Map the corners of the rectangle [x0, x1] x [y0, y1] through 'm', in cyclic
+order. Return false if the image is unbounded, i.e. the rectangle contains
+points of the horizon of 'm'. Otherwise the image is a convex quadrilateral. */
+static bool map_rect(const double m[9], double x0, double y0, double x1, double y1, point quad[4])
+{
+    point corners[4] = { { x0, y0 }, { x1, y0 }, { x1, y1 }, { x0, y1 } };
+    int positive = 0;
+    size_t i;
+
+    for (i = 0; i < 4; i++)
+    {
+        double u = m[0] * corners[i].x + m[1] * corners[i].y + m[2];
+        double v = m[3] * corners[i].x + m[4] * corners[i].y + m[5];
+        double h = m[6] * corners[i].x + m[7] * corners[i].y + m[8];
+        if (h == 0)
+        {
+            return false;
+        }
+        positive += h > 0;
+        quad[i].x = u / h;
+        quad[i].y = v / h;
+    }
+
+    /* The homogeneous coordinate is affine over the rectangle: if it has the
+    same sign on all corners, it does not vanish inside. */
+    return positive == 0 || positive == 4;
+}
+
+/* Intersect the convex quadrilateral 'quad' with the line x = c (DIR_X) or
+y = c (DIR_Y). The intersection is the segment [lo, hi] of the other
+coordinate. Return false if it is empty. */
+static bool quad_span(const point quad[4], direction dir, double c, double *lo, double *hi)
+{
+    bool found = false;
+    size_t i;
+
+    *lo = INFINITY;
+    *hi = -INFINITY;
+    for (i = 0; i < 4; i++)
+    {
+        point a = quad[i];
+        point b = quad[(i + 1) % 4];
+        double ac = dir == DIR_X ? a.x : a.y;
+        double bc = dir == DIR_X ? b.x : b.y;
+        double av = dir == DIR_X ? a.y : a.x;
+        double bv = dir == DIR_X ? b.y : b.x;
+
+        if ((ac <= c && c <= bc) || (bc <= c && c <= ac))
+        {
+            /* A vertex on the line, or an edge along it, contributes its
+            endpoints. */
+            double v0 = ac == bc ? av : av + (bv - av) * (c - ac) / (bc - ac);
+            double v1 = ac == bc ? bv : v0;
+            *lo = v0 < *lo ? v0 : *lo;
+            *lo = v1 < *lo ? v1 : *lo;
+            *hi = v0 > *hi ? v0 : *hi;
+            *hi = v1 > *hi ? v1 : *hi;
+            found = true;
+        }
+    }
+    return found;
+}
+
+/* Pixels [*begin, *end[ of row 'y' of the sink whose source lies inside 'bg',
+i.e. the scanline of 'quad', the polygon that 'bg' is transformed to. The whole
+row is returned if that polygon is unbounded. */
+static void polygon_span(const point quad[4], bool bounded, coord width, coord y, coord *begin, coord *end)
+{
+    double lo, hi;
+
+    *begin = 0;
+    *end = width;
+    if (!bounded)
+    {
+        return;
+    }
+    if (!quad_span(quad, DIR_Y, y, &lo, &hi))
+    {
+        *end = 0;
+        return;
+    }
+    lo = ceil(lo);
+    hi = floor(hi) + 1;
+    *begin = lo <= 0 ? 0 : lo >= width ? width : lo;
+    *end = hi <= *begin ? *begin : hi >= width ? width : hi;
+}
+
+/* The spans are computed once per transform. */
+static inline void bg_span(const warp *w, coord y, coord *begin, coord *end)
+{
+    *begin = w->spans[2 * y];
+    *end = w->spans[2 * y + 1];
+}
+
+/* Set the pixels of rows [y_begin, y_end[ lying outside the polygon of 'bg' to
+the background color. */
+static void background_band(const warp *w, coord y_begin, coord y_end, unsigned int worker)
+{
+    (void)worker;
+    coord x, y, begin, end;
+
+    for (y = y_begin; y < y_end; y++)
+    {
+        color *row = &w->sink_data[(ptrdiff_t)y * w->sink_width];
+        bg_span(w, y, &begin, &end);
+        for (x = 0; x < begin; x++)
+        {
+            row[x] = w->background;
+        }
+        for (x = end; x < w->sink_width; x++)
+        {
+            row[x] = w->background;
+        }
+    }
+}
+
+/* Fill every pixel of the sink with the color of 'bg' found through the inverse
+transformation. Pixels falling outside 'bg' take the color of the closest edge,
+or the background color. */
+static void inverse_band(const warp *w, coord y_begin, coord y_end, unsigned int worker)
+{
+    (void)worker;
+    const double *m = w->inverse;
+    double step[3] = { m[0], m[3], m[6] };
+    const color *bg_data = w->bg_data;
+    coord bg_width = w->bg_width, bg_height = w->bg_height, bg_top = w->bg_top;
+    coord y;
+
+    coord x, begin, end;
+
+    for (y = y_begin; y < y_end; y++)
+    {
+        color *row = &w->sink_data[(ptrdiff_t)y * w->sink_width];
+        if (w->row_levels)
+        {
+            const mip_level *level = &w->levels[w->row_levels[y]];
+            m = level->inverse;
+            step[0] = m[0];
+            step[1] = m[3];
+            step[2] = m[6];
+            bg_data = level->data;
+            bg_width = level->width;
+            bg_height = level->height;
+            bg_top = 0;
+        }
+        coord sy = y + w->sink_row;
+        if (w->outside == OUTSIDE_EXTEND)
+        {
+            double origin[3] = { m[1] * sy + m[2], m[4] * sy + m[5], m[7] * sy + m[8] };
+            w->kernel(row, w->sink_width, origin, step, bg_data, bg_width, bg_height, bg_top);
+            continue;
+        }
+
+        /* Only sample the scanline of the polygon of 'bg'. */
+        bg_span(w, y, &begin, &end);
+        for (x = 0; x < begin; x++)
+        {
+            row[x] = w->background;
+        }
+        if (begin < end)
+        {
+            double origin[3] =
+            {
+                m[0] * begin + m[1] * sy + m[2],
+                m[3] * begin + m[4] * sy + m[5],
+                m[6] * begin + m[7] * sy + m[8]
+            };
+            w->kernel(row + begin, end - begin, origin, step, bg_data, bg_width, bg_height, bg_top);
+        }
+        for (x = end; x < w->sink_width; x++)
+        {
+            row[x] = w->background;
+        }
+    }
+}
+
+/* Side of the tiles of 'bg' scanned by forward_band(), in pixels. A tile and
+the region of the sink it lands in fit in the L1 and L2 caches. */
+#define FORWARD_TILE 64
+
+/* Transform the pixels of 'bg' that land in rows [y_begin, y_end[ of the sink.
+A pixel lands in these rows if it gets rounded into them, so we only scan the
+preimage of the rows widened by half a pixel: for the whole sink, this is the
+polygon of the anchors found by projectable(), slightly grown. Each row of 'bg'
+is scanned along its intersection with that polygon, give or take a pixel for
+rounding errors.
+
+Rows are scanned tile by tile: scanning whole rows, or columns, of a wide
+picture would write all over the rows of the band, and the sink would not stay
+in the cache. Tiles are aligned on a grid of 'bg' and scanned in the same
+order, row-major, whatever the band, and the walkers start on the left edge of
+the tiles: each pixel gets the same position in every band, and when several
+pixels land on the same sink pixel, the same one wins. */
+static void forward_band(const warp *w, coord y_begin, coord y_end, unsigned int worker)
+{
+    coord x, y, x2, y2, tx, ty;
+    uint64_t landed = 0;
+    coord x_min = 0, x_max = w->bg_width - 1;
+    coord y_min = 0, y_max = w->bg_height - 1;
+    /* Spans of the rows of the current tile row. */
+    coord lo[FORWARD_TILE], hi[FORWARD_TILE];
+    point quad[4];
+    size_t i;
+
+    bool bounded = map_rect(w->inverse, -0.5, y_begin - 0.5, w->sink_width - 0.5, y_end - 0.5, quad);
+    if (bounded)
+    {
+        double left = INFINITY, right = -INFINITY, top = INFINITY, bottom = -INFINITY;
+        for (i = 0; i < 4; i++)
+        {
+            left = quad[i].x < left ? quad[i].x : left;
+            right = quad[i].x > right ? quad[i].x : right;
+            top = quad[i].y < top ? quad[i].y : top;
+            bottom = quad[i].y > bottom ? quad[i].y : bottom;
+        }
+        left = floor(left) - 1;
+        right = ceil(right) + 1;
+        top = floor(top) - 1;
+        bottom = ceil(bottom) + 1;
+        x_min = left < 0 ? 0 : left >= w->bg_width ? w->bg_width : left;
+        x_max = right < 0 ? -1 : right >= w->bg_width ? w->bg_width - 1 : right;
+        y_min = top < 0 ? 0 : top >= w->bg_height ? w->bg_height : top;
+        y_max = bottom < 0 ? -1 : bottom >= w->bg_height ? w->bg_height - 1 : bottom;
+    }
+
+    for (ty = y_min - y_min % FORWARD_TILE; ty <= y_max; ty += FORWARD_TILE)
+    {
+        coord row_begin = ty > y_min ? ty : y_min;
+        coord row_end = ty + FORWARD_TILE - 1 < y_max ? ty + FORWARD_TILE - 1 : y_max;
+        coord span_min = x_max + 1, span_max = x_min - 1;
+        for (y = row_begin; y <= row_end; y++)
+        {
+            coord *l = &lo[y - ty], *h = &hi[y - ty];
+            *l = x_min;
+            *h = x_max;
+            if (bounded)
+            {
+                double a, b;
+                if (!quad_span(quad, DIR_Y, y, &a, &b))
+                {
+                    *l = 0;
+                    *h = -1;
+                    continue;
+                }
+                a = floor(a) - 1;
+                b = ceil(b) + 1;
+                *l = a < x_min ? x_min : a > x_max ? x_max + 1 : a;
+                *h = b > x_max ? x_max : b < x_min ? x_min - 1 : b;
+            }
+            span_min = *l < span_min ? *l : span_min;
+            span_max = *h > span_max ? *h : span_max;
+        }
+
+        for (tx = span_min - span_min % FORWARD_TILE; tx <= span_max; tx += FORWARD_TILE)
+        {
+            for (y = row_begin; y <= row_end; y++)
+            {
+                coord begin = lo[y - ty] > tx ? lo[y - ty] : tx;
+                coord end = hi[y - ty] < tx + FORWARD_TILE - 1 ? hi[y - ty] : tx + FORWARD_TILE - 1;
+                if (begin > end)
+                {
+                    continue;
+                }
+
+                const color *row = &w->bg_data[(ptrdiff_t)y * w->bg_width];
+                walker k;
+                walker_start(&k, w->matrix, tx, y, 1, 0);
+                for (x = tx; x < begin; x++)
+                {
+                    walker_next(&k);
+                }
+                for (x = begin; x <= end; x++, walker_next(&k))
+                {
+                    point p = walker_point(&k);
+
+                    /* Compare before rounding so that points far away (or at
+                    infinity) never get converted to coordinates. A value rounds
+                    inside [0, max] exactly when it lies in ]-0.5, max + 0.5[. */
+                    if (p.x > -0.5 && p.y > y_begin - 0.5 && p.x < w->sink_width - 0.5 && p.y < y_end - 0.5)
+                    {
+                        /* 'round' is required since a cast floors the value. */
+                        x2 = round(p.x);
+                        y2 = round(p.y);
+                        w->sink_data[(ptrdiff_t)y2 * w->sink_width + x2] = row[x];
+                        mask_set(mask_row(w, y2), x2);
+                        landed++;
+                    }
+                }
+            }
+        }
+    }
+
+    if (w->tallies)
+    {
+        w->tallies[worker].transformed += landed;
+    }
+}
+
+/* Interpolate the holes of rows [y_begin, y_end[ with the mean of the closest
+ring of set pixels. Only pixels set by the forward transformation are read, and
+only the other ones are written, so bands can be filled in parallel. */
+static void square_fill_band(const warp *w, coord y_begin, coord y_end, unsigned int worker)
+{
+    color *sink_data = w->sink_data;
+    coord sink_width = w->sink_width;
+    coord sink_height = w->sink_height;
+    coord x, y, i, j;
+    coord x_min, x_max, y_min, y_max;
+    coord radius, index;
+    uint64_t red_buf, green_buf, blue_buf, alpha_buf;
+    int count;
+    uint64_t holes = 0, radius_sum = 0;
+    coord radius_max = 0;
+
+    /* Interpolate the holes.
+    TODO: Improve interpolation.
+    -Allow choosing between linear and Lanczlos.
+    -Allow choosing between manhattan distance and euclidian distance.
+    http://en.wikipedia.org/wiki/Multivariate_interpolation#Irregular_grid_.28scattered_data.29
+    */
+
+    for (y = y_begin; y < y_end; y++)
+    {
+        const uint64_t *mask = mask_row(w, y);
+        for (x = 0; x < sink_width; x++)
+        {
+            /* Most of the sink is set: skip whole words. */
+            if (x % MASK_BITS == 0 && mask[x / MASK_BITS] == UINT64_MAX)
+            {
+                x += MASK_BITS - 1;
+                continue;
+            }
+            if (!mask_test(mask, x))
+            {
+                /* We will sum the colors of all the pixels in the radius to compute the
+                * mean. We need intermediate variables for colors to prevent
+                * overflow. Integers are exact and avoid floating point. */
+                red_buf = green_buf = blue_buf = alpha_buf = 0;
+                count = 0;
+                for (radius = 1; !count; radius++)
+                {
+                    /* We use a square instead of a circle for performance reasons. */
+                    x_min = x - radius;
+                    x_max = x + radius;
+                    y_min = y - radius;
+                    y_max = y + radius;
+                    x_min = (x_min < 0) ? 0 : x_min;
+                    y_min = (y_min < 0) ? 0 : y_min;
+                    x_max = (x_max >= sink_width) ? (sink_width - 1) : x_max;
+                    y_max = (y_max >= sink_height) ? (sink_height - 1) : y_max;
+
+                    for (i = x_min; i <= x_max; i += x_max - x_min)
+                    {
+                        for (j = y_min; j <= y_max; j++)
+                        {
+                            index = j * sink_width + i;
+                            if (mask_test(mask_row(w, j), i))
+                            {
+                                count++;
+                                red_buf += sink_data[index].red;
+                                green_buf += sink_data[index].green;
+                                blue_buf += sink_data[index].blue;
+                                alpha_buf += sink_data[index].alpha;
+                            }
+                        }
+                    }
+
+                    for (j = y_min; j <= y_max; j += y_max - y_min)
+                    {
+                        const uint64_t *ring = mask_row(w, j);
+                        for (i = x_min; i <= x_max; i++)
+                        {
+                            index = j * sink_width + i;
+                            if (mask_test(ring, i))
+                            {
+                                count++;
+                                red_buf += sink_data[index].red;
+                                green_buf += sink_data[index].green;
+                                blue_buf += sink_data[index].blue;
+                                alpha_buf += sink_data[index].alpha;
+                            }
+                        }
+                    }
+                }
+
+                /* The ring found is the last one. */
+                holes++;
+                radius_sum += radius - 1;
+                radius_max = radius - 1 > radius_max ? radius - 1 : radius_max;
+
+                red_buf /= count;
+                green_buf /= count;
+                blue_buf /= count;
+                alpha_buf /= count;
+                index = y * sink_width + x;
+                sink_data[index].red = red_buf;
+                sink_data[index].green = green_buf;
+                sink_data[index].blue = blue_buf;
+                sink_data[index].alpha = alpha_buf;
+            }
+        }
+    }
+
+    if (w->tallies)
+    {
+        tally *c = &w->tallies[worker];
+        c->holes += holes;
+        c->radius_sum += radius_sum;
+        c->radius_max = radius_max > c->radius_max ? radius_max : c->radius_max;
+    }
+}
+
+/* The distance fill gives every hole the color of the closest set pixel, in
+Euclidean distance. It follows the exact distance transform of Felzenszwalb and
+Huttenlocher, keeping track of the closest pixel instead of the distance: first
+we find the closest set pixel of each column, then for every row we compute the
+lower envelope of the parabolas (x - i)^2 + dy(i)^2, where dy(i) is the
+vertical distance to the closest pixel of column 'i'. Both passes are linear,
+whatever the shape of the holes. */
+
+/* First pass over columns [x_begin, x_end[. Rows are swept in order so that
+memory is accessed sequentially. */
+static void column_distance_band(const warp *w, coord x_begin, coord x_end, unsigned int worker)
+{
+    (void)worker;
+    coord width = w->sink_width;
+    coord x, y;
+    ptrdiff_t index;
+
+    /* Closest set pixel above, or on the pixel itself. */
+    for (y = 0; y < w->sink_height; y++)
+    {
+        const uint64_t *mask = mask_row(w, y);
+        for (x = x_begin; x < x_end; x++)
+        {
+            index = (ptrdiff_t)y * width + x;
+            if (mask_test(mask, x))
+            {
+                w->nearest_row[index] = y;
+            }
+            else
+            {
+                w->nearest_row[index] = y > 0 ? w->nearest_row[index - width] : -1;
+            }
+        }
+    }
+
+    /* If the closest pixel of the next row is below, it is also the closest
+    pixel below the current row. If it is above, it is at least as far as the
+    closest pixel above we already have. */
+    for (y = w->sink_height - 2; y >= 0; y--)
+    {
+        for (x = x_begin; x < x_end; x++)
+        {
+            index = (ptrdiff_t)y * width + x;
+            int32_t above = w->nearest_row[index];
+            int32_t below = w->nearest_row[index + width];
+            if (below > y && (above < 0 || below - y < y - above))
+            {
+                w->nearest_row[index] = below;
+            }
+        }
+    }
+}
+
+/* Second pass over rows [y_begin, y_end[. Only set pixels are read and only
+holes are written. */
+static void distance_fill_band(const warp *w, coord y_begin, coord y_end, unsigned int worker)
+{
+    coord width = w->sink_width;
+    coord x, y, k;
+    /* Columns whose parabola is part of the envelope, and the abscissae where
+    the envelope switches from one to the next. */
+    coord *columns = &w->columns[(size_t)worker * width];
+    double *bounds = &w->bounds[(size_t)worker * (width + 1)];
+    tally *c = w->tallies ? &w->tallies[worker] : NULL;
+
+    for (y = y_begin; y < y_end; y++)
+    {
+        const int32_t *nearest = &w->nearest_row[(ptrdiff_t)y * width];
+        k = -1;
+        for (x = 0; x < width; x++)
+        {
+            if (nearest[x] < 0)
+            {
+                continue;
+            }
+            double dy = nearest[x] - y;
+            double fx = dy * dy + (double)x * x;
+            double s = -INFINITY;
+            while (k >= 0)
+            {
+                double dq = nearest[columns[k]] - y;
+                double fq = dq * dq + (double)columns[k] * columns[k];
+                s = (fx - fq) / (2.0 * (x - columns[k]));
+                if (s > bounds[k])
+                {
+                    break;
+                }
+                k--;
+            }
+            k++;
+            columns[k] = x;
+            bounds[k] = k == 0 ? -INFINITY : s;
+            bounds[k + 1] = INFINITY;
+        }
+
+        /* All columns are empty: nothing was set in the sink at all. */
+        if (k < 0)
+        {
+            continue;
+        }
+
+        color *row = &w->sink_data[(ptrdiff_t)y * width];
+        const uint64_t *mask = mask_row(w, y);
+        k = 0;
+        for (x = 0; x < width; x++)
+        {
+            while (bounds[k + 1] < x)
+            {
+                k++;
+            }
+            if (!mask_test(mask, x))
+            {
+                row[x] = w->sink_data[(ptrdiff_t)nearest[columns[k]] * width + columns[k]];
+                if (c)
+                {
+                    double dx = x - columns[k], dy = nearest[columns[k]] - y;
+                    double radius = sqrt(dx * dx + dy * dy);
+                    c->holes++;
+                    c->radius_sum += radius;
+                    c->radius_max = radius > c->radius_max ? radius : c->radius_max;
+                }
+            }
+        }
+    }
+}
+
+/* Rows [y_begin, y_end[ of level 'reduced', from the previous one. */
+static void reduce_band(const warp *w, coord y_begin, coord y_end, unsigned int worker)
+{
+    (void)worker;
+    const mip_level *src = &w->levels[w->reduced - 1];
+    coord width = w->levels[w->reduced].width;
+    coord x, y;
+
+    for (y = y_begin; y < y_end; y++)
+    {
+        const color *top = src->data + (size_t)2 * y * src->width;
+        const color *bottom = 2 * y + 1 < src->height ? top + src->width : top;
+        color *row = w->reduce_out + (size_t)y * width;
+        for (x = 0; x < width; x++)
+        {
+            coord left = 2 * x, right = 2 * x + 1 < src->width ? 2 * x + 1 : 2 * x;
+            row[x].blue = (top[left].blue + top[right].blue + bottom[left].blue + bottom[right].blue + 2) / 4;
+            row[x].green = (top[left].green + top[right].green + bottom[left].green + bottom[right].green + 2) / 4;
+            row[x].red = (top[left].red + top[right].red + bottom[left].red + bottom[right].red + 2) / 4;
+            row[x].alpha = (top[left].alpha + top[right].alpha + bottom[left].alpha + bottom[right].alpha + 2) / 4;
+        }
+    }
+}
+
+/* Dispatch the processing of the sink over the workers, after building the
+'level_count' levels of 'w' if there is more than one. */
+static bool warp_inverse(warp *w, unsigned int level_count, unsigned int threads)
+{
+    workspace *ws = w->ws;
+    size_t pixels = 0;
+    unsigned int k;
+    for (k = 1; k < level_count; k++)
+    {
+        pixels += (size_t)w->levels[k].width * w->levels[k].height;
+    }
+    if (level_count > 1)
+    {
+        ws->pyramid = reserve(ws->pyramid, &ws->pyramid_size, pixels, sizeof (color), false);
+        if (!ws->pyramid)
+        {
+            fprintf(stderr, "Mipmap allocation error.\n");
+            return false;
+        }
+    }
+
+    w->levels[0].data = w->bg_data;
+    w->reduce_out = ws->pyramid;
+    for (k = 1; k < level_count; k++)
+    {
+        w->reduced = k;
+        if (!run_bands(reduce_band, w, w->levels[k].height, threads))
+        {
+            return false;
+        }
+        w->levels[k].data = w->reduce_out;
+        w->reduce_out += (size_t)w->levels[k].width * w->levels[k].height;
+    }
+    return run_bands(inverse_band, w, w->sink_height, threads);
+}
+
+/* Transform every pixel of 'bg' to the sink, then interpolate the holes. Fill
+'s' if not NULL. */
+static bool warp_forward(warp *w, hole_fill fill, unsigned int threads, stats *s)
+{
+    /* We proceed in two steps: first we transform every pixel in 'bg' between the
+    * anchors to the 'sink'. Every pixel processed in sink is marked in
+    * 'transformed_mask'. Second, we interpolate every pixel from sink that is not
+    * marked in 'transformed_mask'. Each step works on bands of the sink in
+    * parallel; the second step must wait for the first one to be complete
+    * since it reads rows outside its band. */
+
+    workspace *ws = w->ws;
+    size_t pixels = (size_t)w->sink_width * w->sink_height;
+    w->mask_stride = mask_stride(w->sink_width);
+    w->transformed_mask = ws->mask = reserve(ws->mask, &ws->mask_size, w->mask_stride * w->sink_height,
+                                             sizeof (uint64_t), true);
+    if (!w->transformed_mask)
+    {
+        fprintf(stderr, "Transformed mask allocation error.\n");
+        return false;
+    }
+    if (s)
+    {
+        w->tallies = ws->tallies = reserve(ws->tallies, &ws->tallies_size, threads, sizeof (tally), true);
+        if (!w->tallies)
+        {
+            fprintf(stderr, "Stats allocation error.\n");
+            return false;
+        }
+    }
+
+    double start = now();
+    bool status = run_bands(forward_band, w, w->sink_height, threads);
+    double mapped = now();
+    if (status && fill == FILL_SQUARE)
+    {
+        status = run_bands(square_fill_band, w, w->sink_height, threads);
+    }
+    else if (status)
+    {
+        w->nearest_row = ws->nearest_row = reserve(ws->nearest_row, &ws->nearest_size, pixels, sizeof (int32_t), false);
+        /* One envelope per worker of distance_fill_band(). */
+        w->columns = ws->columns = reserve(ws->columns, &ws->columns_size,
+                                           (size_t)threads * w->sink_width, sizeof (coord), false);
+        w->bounds = ws->bounds = reserve(ws->bounds, &ws->bounds_size,
+                                         (size_t)threads * (w->sink_width + 1), sizeof (double), false);
+        if (!w->nearest_row || !w->columns || !w->bounds)
+        {
+            fprintf(stderr, "Distance map allocation error.\n");
+            return false;
+        }
+        /* Columns first, then rows. */
+        status = run_bands(column_distance_band, w, w->sink_width, threads)
+                 && run_bands(distance_fill_band, w, w->sink_height, threads);
+    }
+
+    /* Holes outside the polygon of 'bg' were filled as well: we do not want
+    the holes inside to take the background color. */
+    if (status && w->outside == OUTSIDE_BACKGROUND)
+    {
+        status = run_bands(background_band, w, w->sink_height, threads);
+    }
+
+    if (s)
+    {
+        unsigned int i;
+        double radius_sum = 0;
+        s->map_time = mapped - start;
+        s->fill_time = now() - mapped;
+        s->transformed = s->holes = 0;
+        s->radius_max = 0;
+        for (i = 0; i < threads; i++)
+        {
+            s->transformed += w->tallies[i].transformed;
+            s->holes += w->tallies[i].holes;
+            radius_sum += w->tallies[i].radius_sum;
+            s->radius_max = w->tallies[i].radius_max > s->radius_max ? w->tallies[i].radius_max : s->radius_max;
+        }
+        s->discarded = (uint64_t)w->bg_width * w->bg_height - s->transformed;
+        s->radius_mean = s->holes ? radius_sum / s->holes : 0;
+    }
+    return status;
+}
+
+/* Number of passes of warp_forward(). */
+static unsigned int forward_passes(hole_fill fill, outside out)
+{
+    return 2 + (fill == FILL_DISTANCE) + (out == OUTSIDE_BACKGROUND);
+}
+
+void options_init(options *opts)
+{
+    opts->mapping = MAP_INVERSE;
+    opts->interpolation = INTERP_BILINEAR;
+    opts->fill = FILL_DISTANCE;
+    opts->outside = OUTSIDE_EXTEND;
+    memset(&opts->background, 0, sizeof opts->background);
+    memset(&opts->placement, 0, sizeof opts->placement);
+    opts->threads = 0;
+#ifdef FIXED_POINT
+    opts->fixed_point = true;
+#else
+    opts->fixed_point = false;
+#endif
+    opts->mipmap = false;
+    opts->backend = BACKEND_CPU;
+    opts->progress = NULL;
+    opts->progress_data = NULL;
+    opts->stats = NULL;
+}
+
+bool sink_size(const pixelset *anchors, double ratio, coord *width, coord *height)
+{
+    if (anchors->count == 0 || !(ratio > 0))
+    {
+        return false;
+    }
+
+    size_t i;
+    coord minx = anchors->pixels[0].x;
+    coord miny = anchors->pixels[0].y;
+    coord maxx = anchors->pixels[0].x;
+    coord maxy = anchors->pixels[0].y;
+    for (i = 1; i < anchors->count; i++)
+    {
+        const pixel *p = &anchors->pixels[i];
+        minx = p->x < minx ? p->x : minx;
+        miny = p->y < miny ? p->y : miny;
+        maxx = p->x > maxx ? p->x : maxx;
+        maxy = p->y > maxy ? p->y : maxy;
+    }
+
+    /* Doubles hold the difference of any two coords exactly. */
+    double w = (double)maxx - minx;
+    double h = (double)maxy - miny;
+    if (w < h * ratio)
+    {
+        w = round(h * ratio);
+    }
+    else
+    {
+        h = round(w / ratio);
+    }
+
+    if (w < 1 || h < 1 || w > COORD_MAX || h > COORD_MAX)
+    {
+        return false;
+    }
+    *width = (coord)w;
+    *height = (coord)h;
+    return true;
+}
+
+/* With CROP_KEEP, the whole picture can be arbitrarily bigger than the anchors
+close to the horizon. Past this factor on the area of the sink, we give up
+rather than warp a mostly empty sink. */
+#define KEEP_AREA_MAX 16
+
+/* Largest 'h' such that a rectangle of size (ratio * h, h) fits in the convex
+quadrilateral 'quad'. Each side gives a linear constraint on the center of the
+rectangle and 'h', for the corner of the rectangle farthest along its normal:
+this is a linear program of 3 variables and 4 constraints, whose optimum lies
+at the intersection of 3 of them. Return false if 'quad' is flat. */
+static bool biggest_rect(const point quad[4], double ratio, point *center, double *height)
+{
+    double area = 0;
+    double a[4][3], d[4];
+    size_t i, j;
+    for (i = 0; i < 4; i++)
+    {
+        const point *p = &quad[i], *q = &quad[(i + 1) % 4];
+        area += p->x * q->y - q->x * p->y;
+    }
+    if (area == 0)
+    {
+        return false;
+    }
+
+    /* Inside is n.p <= d, for the outward normal 'n' of each side. */
+    for (i = 0; i < 4; i++)
+    {
+        const point *p = &quad[i], *q = &quad[(i + 1) % 4];
+        double nx = area > 0 ? q->y - p->y : p->y - q->y;
+        double ny = area > 0 ? p->x - q->x : q->x - p->x;
+        a[i][0] = nx;
+        a[i][1] = ny;
+        a[i][2] = (fabs(nx) * ratio + fabs(ny)) / 2;
+        d[i] = nx * p->x + ny * p->y;
+    }
+
+    *height = 0;
+    for (i = 0; i < 4; i++)
+    {
+        /* Constraints other than 'i', by Cramer's rule. */
+        const double *r[3];
+        double rhs[3];
+        size_t k = 0;
+        for (j = 0; j < 4; j++)
+        {
+            if (j != i)
+            {
+                r[k] = a[j];
+                rhs[k++] = d[j];
+            }
+        }
+        double det = r[0][0] * (r[1][1] * r[2][2] - r[1][2] * r[2][1])
+                     - r[0][1] * (r[1][0] * r[2][2] - r[1][2] * r[2][0])
+                     + r[0][2] * (r[1][0] * r[2][1] - r[1][1] * r[2][0]);
+        if (det == 0)
+        {
+            continue;
+        }
+        double x = (rhs[0] * (r[1][1] * r[2][2] - r[1][2] * r[2][1])
+                    - r[0][1] * (rhs[1] * r[2][2] - r[1][2] * rhs[2])
+                    + r[0][2] * (rhs[1] * r[2][1] - r[1][1] * rhs[2])) / det;
+        double y = (r[0][0] * (rhs[1] * r[2][2] - r[1][2] * rhs[2])
+                    - rhs[0] * (r[1][0] * r[2][2] - r[1][2] * r[2][0])
+                    + r[0][2] * (r[1][0] * rhs[2] - rhs[1] * r[2][0])) / det;
+        double h = (r[0][0] * (r[1][1] * rhs[2] - rhs[1] * r[2][1])
+                    - r[0][1] * (r[1][0] * rhs[2] - rhs[1] * r[2][0])
+                    + rhs[0] * (r[1][0] * r[2][1] - r[1][1] * r[2][0])) / det;
+        /* The last constraint, give or take rounding errors. */
+        double slack = d[i] - (a[i][0] * x + a[i][1] * y + a[i][2] * h);
+        if (h > *height && slack >= -1e-9 * (fabs(d[i]) + 1))
+        {
+            center->x = x;
+            center->y = y;
+            *height = h;
+        }
+    }
+    return *height > 0;
+}
+
+bool sink_geometry(const pixelset *anchors, double ratio, crop mode, coord bg_width, coord bg_height,
+                   coord *width, coord *height, placement *place)
+{
+    coord w, h;
+    double m[9];
+    if (!sink_size(anchors, ratio, &w, &h) || !make_transform_matrix(m, anchors, w, h))
+    {
+        return false;
+    }
+
+    memset(place, 0, sizeof *place);
+    if (mode == CROP_ENLARGE)
+    {
+        *width = w;
+        *height = h;
+        return true;
+    }
+
+    if (mode == CROP_SHRINK)
+    {
+        /* The anchors are the preimages of the corners of the sink. */
+        double inverse[9];
+        point corners[4];
+        size_t i;
+        if (!invert_matrix(inverse, m) || !map_rect(inverse, 0, 0, w, h, corners))
+        {
+            return false;
+        }
+        double side[4];
+        for (i = 0; i < 4; i++)
+        {
+            const point *p = &corners[i], *q = &corners[(i + 1) % 4];
+            side[i] = hypot(q->x - p->x, q->y - p->y);
+        }
+        /* Sides 0 and 2 are horizontal in the sink. */
+        double sw = side[0] < side[2] ? side[0] : side[2];
+        double sh = side[1] < side[3] ? side[1] : side[3];
+        if (sw < sh * ratio)
+        {
+            sh = sw / ratio;
+        }
+        else
+        {
+            sw = sh * ratio;
+        }
+        sw = floor(sw) < 1 ? 1 : floor(sw);
+        sh = floor(sh) < 1 ? 1 : floor(sh);
+        if (sw > COORD_MAX || sh > COORD_MAX)
+        {
+            return false;
+        }
+        *width = sw;
+        *height = sh;
+        return true;
+    }
+
+    /* The whole picture, in the plane of the sink: a convex quadrilateral if
+    the horizon does not cross it. Sink pixels whose centers lie on its edges
+    still see the picture. */
+    point quad[4];
+    if (!map_rect(m, 0, 0, bg_width - 1, bg_height - 1, quad))
+    {
+        return false;
+    }
+    point origin;
+    double sw, sh;
+    if (mode == CROP_KEEP)
+    {
+        double right = -INFINITY, bottom = -INFINITY;
+        size_t i;
+        origin.x = origin.y = INFINITY;
+        for (i = 0; i < 4; i++)
+        {
+            origin.x = quad[i].x < origin.x ? quad[i].x : origin.x;
+            origin.y = quad[i].y < origin.y ? quad[i].y : origin.y;
+            right = quad[i].x > right ? quad[i].x : right;
+            bottom = quad[i].y > bottom ? quad[i].y : bottom;
+        }
+        /* Every pixel of the picture rounds into the sink, for the forward
+        mapping. */
+        sw = floor(right - origin.x + 0.5) + 1;
+        sh = floor(bottom - origin.y + 0.5) + 1;
+        if (sw * sh > KEEP_AREA_MAX * (double)w * h)
+        {
+            return false;
+        }
+    }
+    else
+    {
+        point center = { 0, 0 };
+        double rh;
+        if (!biggest_rect(quad, ratio, &center, &rh))
+        {
+            return false;
+        }
+        origin.x = center.x - ratio * rh / 2;
+        origin.y = center.y - rh / 2;
+        sw = floor(ratio * rh) + 1;
+        sh = floor(rh) + 1;
+    }
+    if (sw > COORD_MAX || sh > COORD_MAX || sw * sh > COORD_MAX)
+    {
+        return false;
+    }
+
+    *width = sw;
+    *height = sh;
+    place->x = -origin.x;
+    place->y = -origin.y;
+    place->width = w;
+    place->height = h;
+    return true;
+}
+
+void sink_fit(coord *width, coord *height, placement *place, coord max_width, coord max_height)
+{
+    double scale = 1;
+    if (max_width > 0 && *width > max_width)
+    {
+        scale = (double)max_width / *width;
+    }
+    if (max_height > 0 && *height * scale > max_height)
+    {
+        scale = (double)max_height / *height;
+    }
+    if (scale == 1)
+    {
+        return;
+    }
+
+    coord w = round(*width * scale) < 1 ? 1 : round(*width * scale);
+    coord h = round(*height * scale) < 1 ? 1 : round(*height * scale);
+    if (place->width > 0)
+    {
+        double sx = (double)w / *width, sy = (double)h / *height;
+        place->x *= sx;
+        place->y *= sy;
+        place->width *= sx;
+        place->height *= sy;
+    }
+    *width = w;
+    *height = h;
+}
+
+/* Move the anchors of 'm' from the whole 'width' x 'height' sink to 'p'. */
+static void place_matrix(double m[9], const placement *p, coord width, coord height)
+{
+    size_t i;
+    for (i = 0; i < 3; i++)
+    {
+        m[i] = m[i] * p->width / width + p->x * m[6 + i];
+        m[3 + i] = m[3 + i] * p->height / height + p->y * m[6 + i];
+    }
+}
+
+/******************************************************************************/
+/* Transforms */
+
+static bool choose_levels(transform *t);
+
+struct transform
+{
+    coord sink_width, sink_height;
+    coord bg_width, bg_height;
+    double matrix[9];
+    /* With the forward mapping, the inverse only bounds the part of 'bg' that
+    each band needs. If the matrix is singular, map_rect() fails and we scan the
+    whole picture. */
+    double inverse[9];
+    mapping mapping;
+    hole_fill fill;
+    outside outside;
+    color background;
+    row_kernel kernel;
+    coord radius;
+    unsigned int threads;
+    /* Warps go to the GPU first. */
+    bool gpu;
+    interpolation interpolation;
+    progress_callback progress;
+    void *progress_data;
+    stats *stats;
+    double solve_time;
+    /* With OUTSIDE_BACKGROUND: for every row 'y' of the sink, pixels
+    [spans[2y], spans[2y + 1][ have their source inside 'bg'. */
+    coord *spans;
+    /* With mipmaps: the level of each row of the sink, and the levels with
+    their matrices but without data. */
+    unsigned char *row_levels;
+    unsigned int level_count;
+    mip_level levels[MIP_LEVELS];
+};
+
+transform *transform_new(pixelset *anchors, coord sink_width, coord sink_height,
+                         coord bg_width, coord bg_height, const options *opts)
+{
+    if (sink_width <= 0 || sink_height <= 0 || bg_width <= 0 || bg_height <= 0)
+    {
+        return NULL;
+    }
+
+    if (COORD_MAX / sink_width < sink_height)
+    {
+        fprintf(stderr, "The picture is too big, memory cannot be allocated.\n");
+        return NULL;
+    }
+
+    double start = now();
+    transform *t = malloc(sizeof *t);
+    if (!t)
+    {
+        fprintf(stderr, "Transform allocation error.\n");
+        return NULL;
+    }
+    t->sink_width = sink_width;
+    t->sink_height = sink_height;
+    t->bg_width = bg_width;
+    t->bg_height = bg_height;
+    t->mapping = opts->mapping;
+    t->fill = opts->fill;
+    t->outside = opts->outside;
+    t->background = opts->background;
+    t->kernel = sample_kernel(opts->interpolation, bg_width, bg_height, opts->fixed_point);
+    t->radius = sample_radius(opts->interpolation);
+    t->threads = thread_count(opts->threads, sink_height);
+    t->interpolation = opts->interpolation;
+    t->progress = opts->progress;
+    t->progress_data = opts->progress_data;
+    t->stats = opts->stats;
+    t->spans = NULL;
+    t->row_levels = NULL;
+    t->level_count = 1;
+
+    /* TODO: report status message. */
+    if (!make_transform_matrix(t->matrix, anchors, sink_width, sink_height))
+    {
+        free(t);
+        return NULL;
+    }
+    if (opts->placement.width > 0)
+    {
+        place_matrix(t->matrix, &opts->placement, sink_width, sink_height);
+    }
+    if (!invert_matrix(t->inverse, t->matrix) && t->mapping == MAP_INVERSE)
+    {
+        free(t);
+        return NULL;
+    }
+
+    if (t->outside == OUTSIDE_BACKGROUND)
+    {
+        t->spans = malloc(2 * (size_t)sink_height * sizeof *t->spans);
+        if (!t->spans)
+        {
+            fprintf(stderr, "Span table allocation error.\n");
+            free(t);
+            return NULL;
+        }
+        point quad[4];
+        bool bounded = map_rect(t->matrix, 0, 0, bg_width - 1, bg_height - 1, quad);
+        coord y;
+        for (y = 0; y < sink_height; y++)
+        {
+            polygon_span(quad, bounded, sink_width, y, &t->spans[2 * y], &t->spans[2 * y + 1]);
+        }
+    }
+
+    if (opts->mipmap && t->mapping == MAP_INVERSE && !choose_levels(t))
+    {
+        transform_free(t);
+        return NULL;
+    }
+
+    t->gpu = opts->backend == BACKEND_GPU && t->mapping == MAP_INVERSE && !t->row_levels
+             && gpu_supports(t->interpolation);
+    t->solve_time = now() - start;
+    return t;
+}
+
+/* Pick the mip level of each row of the sink. The area of the source of a sink
+pixel is the determinant of the Jacobian of the inverse mapping, which for a
+homography is det(inverse) / w^3, 'w' being the homogeneous coordinate. Along
+a row 'w' is linear, so the smallest scale of the row is at one of its ends: we
+sample the finest level this scale needs, that is the coarsest one whose
+pixels are no bigger than the source of a sink pixel. Rows crossing the horizon
+keep 'bg'. Return false if the table cannot be allocated. */
+static bool choose_levels(transform *t)
+{
+    const double *m = t->inverse;
+    double det = fabs(m[0] * (m[4] * m[8] - m[5] * m[7]) - m[1] * (m[3] * m[8] - m[5] * m[6])
+                      + m[2] * (m[3] * m[7] - m[4] * m[6]));
+    unsigned int k, i;
+
+    /* Levels stop at a single pixel. */
+    t->levels[0].width = t->bg_width;
+    t->levels[0].height = t->bg_height;
+    for (k = 1; k < MIP_LEVELS && (t->levels[k - 1].width > 1 || t->levels[k - 1].height > 1); k++)
+    {
+        t->levels[k].width = (t->levels[k - 1].width + 1) / 2;
+        t->levels[k].height = (t->levels[k - 1].height + 1) / 2;
+    }
+    unsigned int available = k;
+
+    t->row_levels = malloc(t->sink_height);
+    if (!t->row_levels)
+    {
+        fprintf(stderr, "Mipmap table allocation error.\n");
+        return false;
+    }
+    coord y;
+    t->level_count = 1;
+    for (y = 0; y < t->sink_height; y++)
+    {
+        double w0 = fabs(m[7] * y + m[8]), w1 = fabs(m[6] * (t->sink_width - 1) + m[7] * y + m[8]);
+        double w = w0 > w1 ? w0 : w1;
+        unsigned int level = 0;
+        if ((m[7] * y + m[8]) * (m[6] * (t->sink_width - 1) + m[7] * y + m[8]) > 0)
+        {
+            /* Side of the source of a pixel. */
+            double scale = sqrt(det / (w * w * w));
+            while (level + 1 < available && scale >= 2)
+            {
+                scale /= 2;
+                level++;
+            }
+        }
+        t->row_levels[y] = level;
+        t->level_count = level + 1 > t->level_count ? level + 1 : t->level_count;
+    }
+
+    /* Level 'k' pixel 'i' is centered on pixel (i + 0.5) * 2^k - 0.5 of 'bg'. */
+    memcpy(t->levels[0].inverse, m, sizeof t->levels[0].inverse);
+    for (k = 1; k < t->level_count; k++)
+    {
+        double size = (double)(1 << k);
+        for (i = 0; i < 3; i++)
+        {
+            t->levels[k].inverse[i] = (m[i] + 0.5 * m[6 + i]) / size - 0.5 * m[6 + i];
+            t->levels[k].inverse[3 + i] = (m[3 + i] + 0.5 * m[6 + i]) / size - 0.5 * m[6 + i];
+            t->levels[k].inverse[6 + i] = m[6 + i];
+        }
+    }
+    /* Only one level: sample 'bg' as without mipmaps. */
+    if (t->level_count == 1)
+    {
+        free(t->row_levels);
+        t->row_levels = NULL;
+    }
+    return true;
+}
+
+/* Stats of the inverse mapping of 't', which took 'seconds'. Counting the
+pixels whose source lies inside 'bg' takes a span per row, as with
+OUTSIDE_BACKGROUND. */
+static void inverse_stats(const transform *t, double seconds)
+{
+    stats *s = t->stats;
+    point quad[4];
+    bool bounded = map_rect(t->matrix, 0, 0, t->bg_width - 1, t->bg_height - 1, quad);
+    coord y, begin, end;
+
+    s->solve_time = t->solve_time;
+    s->map_time = seconds;
+    s->fill_time = 0;
+    s->transformed = 0;
+    for (y = 0; y < t->sink_height; y++)
+    {
+        polygon_span(quad, bounded, t->sink_width, y, &begin, &end);
+        s->transformed += end > begin ? end - begin : 0;
+    }
+    s->discarded = (uint64_t)t->sink_width * t->sink_height - s->transformed;
+    s->holes = 0;
+    s->radius_max = s->radius_mean = 0;
+    s->backend = BACKEND_CPU;
+}
+
+/* Warp on the GPU, in a single pass. Return false if it cannot be used. */
+static bool gpu_inverse(const transform *t, warp *w)
+{
+    if (!t->gpu || !gpu_warp(w->sink_data, t->sink_width, t->sink_height, w->bg_data, t->bg_width, t->bg_height,
+                             t->inverse, t->interpolation, t->spans, t->background))
+    {
+        return false;
+    }
+    if (w->progress)
+    {
+        w->progress->lines = t->sink_height;
+        w->progress->lines_done = 0;
+        progress_add(w->progress, t->sink_height);
+    }
+    return true;
+}
+
+bool transform_apply(const transform *t, color *sink_data, const color *bg_data)
+{
+    workspace ws;
+    workspace_init(&ws);
+    bool status = transform_apply_in(t, &ws, sink_data, bg_data);
+    workspace_release(&ws);
+    return status;
+}
+
+bool transform_apply_in(const transform *t, workspace *ws, color *sink_data, const color *bg_data)
+{
+    warp w =
+    {
+        .sink_data = sink_data,
+        .sink_width = t->sink_width,
+        .sink_height = t->sink_height,
+        .bg_data = bg_data,
+        .bg_width = t->bg_width,
+        .bg_height = t->bg_height,
+        .outside = t->outside,
+        .background = t->background,
+        .spans = t->spans,
+        .kernel = t->kernel,
+        .row_levels = t->row_levels,
+        .transformed_mask = NULL,
+        .mask_stride = 0,
+        .nearest_row = NULL,
+        .columns = NULL,
+        .bounds = NULL,
+        .progress = NULL,
+        .tallies = NULL,
+        .ws = ws
+    };
+    memcpy(w.matrix, t->matrix, sizeof w.matrix);
+    memcpy(w.inverse, t->inverse, sizeof w.inverse);
+    memcpy(w.levels, t->levels, t->level_count * sizeof *w.levels);
+
+    progress p;
+    if (t->progress)
+    {
+        progress_init(&p, t->progress, t->progress_data, t->sink_height,
+                      t->mapping == MAP_FORWARD ? forward_passes(t->fill, t->outside) : t->level_count);
+        w.progress = &p;
+    }
+
+    double start = now();
+    bool status;
+    if (t->mapping == MAP_FORWARD)
+    {
+        status = warp_forward(&w, t->fill, t->threads, t->stats);
+        if (t->stats)
+        {
+            t->stats->solve_time = t->solve_time;
+            t->stats->backend = BACKEND_CPU;
+        }
+    }
+    else
+    {
+        bool gpu = gpu_inverse(t, &w);
+        status = gpu ? pass_done(&w) : warp_inverse(&w, t->level_count, t->threads);
+        if (t->stats)
+        {
+            inverse_stats(t, now() - start);
+            t->stats->backend = gpu ? BACKEND_GPU : BACKEND_CPU;
+        }
+    }
+    if (w.progress)
+    {
+        pthread_mutex_destroy(&p.lock);
+    }
+    return status;
+}
+
+/* Rows [*begin, *end[ of 'bg' sampled by rows [y_begin, y_end[ of the sink.
+Walking and rounding errors stay well below the extra pixel of margin. */
+static void source_rows(const transform *t, coord y_begin, coord y_end, coord *begin, coord *end)
+{
+    point quad[4];
+    *begin = 0;
+    *end = t->bg_height;
+    if (!map_rect(t->inverse, 0, y_begin, t->sink_width - 1, y_end - 1, quad))
+    {
+        /* The strip crosses the horizon, its source is unbounded. */
+        return;
+    }
+
+    double top = INFINITY, bottom = -INFINITY;
+    size_t i;
+    for (i = 0; i < 4; i++)
+    {
+        top = quad[i].y < top ? quad[i].y : top;
+        bottom = quad[i].y > bottom ? quad[i].y : bottom;
+    }
+    top = floor(top) - t->radius - 1;
+    bottom = ceil(bottom) + t->radius + 2;
+    /* Positions outside 'bg' are clamped to its edges, so the closest edge row is
+    always included. */
+    *begin = top <= 0 ? 0 : top >= t->bg_height ? t->bg_height - 1 : top;
+    *end = bottom >= t->bg_height ? t->bg_height : bottom <= *begin ? *begin + 1 : bottom;
+}
+
+bool transform_stream(const transform *t, coord strip_height,
+                      row_reader read, void *read_data,
+                      row_writer write, void *write_data)
+{
+    if (t->mapping != MAP_INVERSE || strip_height <= 0)
+    {
+        return false;
+    }
+    if (strip_height > t->sink_height)
+    {
+        strip_height = t->sink_height;
+    }
+
+    color *strip = malloc((size_t)strip_height * t->sink_width * sizeof (color));
+    if (!strip)
+    {
+        fprintf(stderr, "Strip allocation error.\n");
+        return false;
+    }
+
+    /* Source rows [window_begin, window_end[ currently held in 'window'. */
+    color *window = NULL;
+    workspace ws;
+    workspace_init(&ws);
+    coord window_begin = 0, window_end = 0, window_capacity = 0;
+    bool status = true;
+    double seconds = 0;
+    coord y;
+
+    for (y = 0; status && y < t->sink_height; y += strip_height)
+    {
+        coord rows = t->sink_height - y < strip_height ? t->sink_height - y : strip_height;
+        coord begin, end;
+        source_rows(t, y, y + rows, &begin, &end);
+
+        if (end - begin > window_capacity)
+        {
+            color *grown = realloc(window, (size_t)(end - begin) * t->bg_width * sizeof (color));
+            if (!grown)
+            {
+                fprintf(stderr, "Source window allocation error.\n");
+                status = false;
+                break;
+            }
+            window = grown;
+            window_capacity = end - begin;
+        }
+
+        /* Keep the rows shared with the previous window, read the others. */
+        coord keep_begin = begin > window_begin ? begin : window_begin;
+        coord keep_end = end < window_end ? end : window_end;
+        if (keep_begin < keep_end)
+        {
+            memmove(&window[(ptrdiff_t)(keep_begin - begin) * t->bg_width],
+                    &window[(ptrdiff_t)(keep_begin - window_begin) * t->bg_width],
+                    (size_t)(keep_end - keep_begin) * t->bg_width * sizeof (color));
+            status = (begin == keep_begin || read(read_data, begin, keep_begin, window))
+                     && (keep_end == end || read(read_data, keep_end, end, &window[(ptrdiff_t)(keep_end - begin) * t->bg_width]));
+        }
+        else
+        {
+            status = read(read_data, begin, end, window);
+        }
+        window_begin = begin;
+        window_end = status ? end : begin;
+        if (!status)
+        {
+            break;
+        }
+
+        /* The strip is sampled with the positions of the whole sink, so that
+        they are rounded as by transform_apply(), from the rows of 'bg' held
+        in the window. Positions never reach rows outside of it, see
+        source_rows(). */
+        warp w =
+        {
+            .sink_data = strip,
+            .sink_width = t->sink_width,
+            .sink_height = rows,
+            .sink_row = y,
+            .bg_data = window,
+            .bg_width = t->bg_width,
+            .bg_height = t->bg_height,
+            .bg_top = begin,
+            .outside = t->outside,
+            .background = t->background,
+            .spans = t->spans ? &t->spans[2 * (ptrdiff_t)y] : NULL,
+            .kernel = t->kernel,
+            .transformed_mask = NULL,
+            .mask_stride = 0,
+            .nearest_row = NULL,
+            .columns = NULL,
+            .bounds = NULL,
+            .progress = NULL,
+            .tallies = NULL,
+            .ws = &ws
+        };
+        memcpy(w.inverse, t->inverse, sizeof w.inverse);
+
+        double start = now();
+        run_bands(inverse_band, &w, rows, t->threads);
+        seconds += now() - start;
+        status = write(write_data, y, y + rows, strip)
+                 && (!t->progress || t->progress(t->progress_data, y + rows, t->sink_height));
+    }
+
+    workspace_release(&ws);
+    free(window);
+    free(strip);
+    if (t->stats)
+    {
+        /* The time to read and write the rows is not included. */
+        inverse_stats(t, seconds);
+    }
+    return status;
+}
+
+void transform_set_reports(transform *t, progress_callback func, void *data, stats *s)
+{
+    t->progress = func;
+    t->progress_data = data;
+    t->stats = s;
+}
+
+void transform_get_matrix(const transform *t, double matrix[9])
+{
+    memcpy(matrix, t->matrix, 9 * sizeof *matrix);
+}
+
+void transform_free(transform *t)
+{
+    if (t)
+    {
+        free(t->spans);
+        free(t->row_levels);
+        free(t);
+    }
+}
+
+/******************************************************************************/
+
+bool perspector(
+    color *sink_data, coord sink_width, coord sink_height,
+    color *bg_data, coord bg_width, coord bg_height,
+    pixelset *anchors)
+{
+    options opts;
+    options_init(&opts);
+    return perspector_opts(sink_data, sink_width, sink_height, bg_data, bg_width, bg_height, anchors, &opts);
+}
+
+bool perspector_opts(
+    color *sink_data, coord sink_width, coord sink_height,
+    color *bg_data, coord bg_width, coord bg_height,
+    pixelset *anchors, const options *opts)
+{
+    transform *t = transform_new(anchors, sink_width, sink_height, bg_width, bg_height, opts);
+    if (!t)
+    {
+        return false;
+    }
+
+    bool status = transform_apply(t, sink_data, bg_data);
+    transform_free(t);
+    return status;
 }
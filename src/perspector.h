@@ -2,10 +2,8 @@
 #define PERSPECTOR_H
 
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
-#include <gsl/gsl_matrix.h>
-#include <gsl/gsl_linalg.h>
-#include <gsl/gsl_blas.h>
 
 /* Pixel coordinates can be negative to express out-of-screen values. A size of
 2 billion sounds a reasonable upper value, but we never know what can happen, so
@@ -46,9 +44,248 @@ typedef struct
     unsigned char blue, green, red, alpha;
 } color;
 
+/* Warping strategy. */
+typedef enum
+{
+    /* Walk the sink and sample 'bg' through the inverse transformation. */
+    MAP_INVERSE,
+    /* Transform every pixel of 'bg' to the sink, then fill the holes. */
+    MAP_FORWARD
+} mapping;
+
+/* Interpolation used to sample 'bg' with the inverse mapping, from the fastest
+to the sharpest. */
+typedef enum
+{
+    INTERP_NEAREST,
+    INTERP_BILINEAR,
+    /* Catmull-Rom spline, 4x4 neighbours. */
+    INTERP_BICUBIC,
+    /* Lanczos with 3 lobes, 6x6 neighbours. */
+    INTERP_LANCZOS3
+} interpolation;
+
+/* How the forward mapping fills the sink pixels no pixel of 'bg' landed on. */
+typedef enum
+{
+    /* Color of the closest set pixel. Linear time. */
+    FILL_DISTANCE,
+    /* Mean of the closest square ring of set pixels. Can be very slow on large
+    holes. */
+    FILL_SQUARE
+} hole_fill;
+
+/* Sink pixels whose source lies outside 'bg'. */
+typedef enum
+{
+    /* Take the color of the closest edge of 'bg'. */
+    OUTSIDE_EXTEND,
+    /* Take the background color. */
+    OUTSIDE_BACKGROUND
+} outside;
+
+/* Where the inverse mapping runs. */
+typedef enum
+{
+    BACKEND_CPU,
+    /* An OpenCL GPU, see gpu.c. Nearest and bilinear interpolations only, and
+    without mipmaps: other warps, and all of them when no GPU is found, run on
+    the CPU. The result may differ slightly from the CPU one. */
+    BACKEND_GPU
+} backend;
+
+/* Part of the rectified picture shown by the sink, see sink_geometry(). */
+typedef enum
+{
+    /* The anchors, in a sink at least as big as their bounding box: the picture
+    is enlarged and interpolated. */
+    CROP_ENLARGE,
+    /* The anchors, in a sink no bigger than their shortest sides: the picture
+    is never enlarged. */
+    CROP_SHRINK,
+    /* The whole picture, surrounded with the background color: use it with
+    OUTSIDE_BACKGROUND. */
+    CROP_KEEP,
+    /* The biggest rectangle inside the whole picture. */
+    CROP_BIGGEST
+} crop;
+
+/* Rectangle of the sink the anchors are mapped to, of corners (x, y) and
+(x + width, y + height). It may stick out of the sink. */
+typedef struct
+{
+    double x, y, width, height;
+} placement;
+
+/* Progress report: 'done' out of 'total' rows have been processed. Rows of
+every pass count, so 'total' is the sink height for the inverse mapping and a
+few times more for the forward one. Return false to cancel the warp, which then
+fails. Calls are serialized but may come from any worker thread. */
+typedef bool (*progress_callback)(void *data, size_t done, size_t total);
+
+/* What a warp did, to tell where the time went. Times are wall-clock seconds. */
+typedef struct
+{
+    /* Solving the transformation, in transform_new(). */
+    double solve_time;
+    /* Sampling 'bg' with the inverse mapping, mipmaps included, transforming
+    its pixels with the forward one. */
+    double map_time;
+    /* Forward mapping only: filling the holes, and the background. */
+    double fill_time;
+    /* Inverse mapping: sink pixels whose source lies inside 'bg'. Forward
+    mapping: pixels of 'bg' landing in the sink. */
+    uint64_t transformed;
+    /* Inverse mapping: sink pixels whose source lies outside 'bg'. Forward
+    mapping: pixels of 'bg' landing outside the sink. */
+    uint64_t discarded;
+    /* Forward mapping only: sink pixels no pixel of 'bg' landed on. */
+    uint64_t holes;
+    /* Forward mapping only: distance from the holes to the pixels they got their
+    color from, that is the ring with FILL_SQUARE and the closest pixel with
+    FILL_DISTANCE. */
+    double radius_max, radius_mean;
+    /* Where the warp ran: BACKEND_CPU if the GPU was requested but could not
+    be used. */
+    backend backend;
+} stats;
+
+/* Processing options. Use options_init() to get the defaults so that new
+fields do not break existing callers. */
+typedef struct
+{
+    mapping mapping;
+    interpolation interpolation;
+    hole_fill fill;
+    outside outside;
+    color background;
+    /* Where the anchors land, see sink_geometry(). A width of 0, the default,
+    means the whole sink. */
+    placement placement;
+    /* Number of worker threads; 0 means one per processor. The result does not
+    depend on it. */
+    unsigned int threads;
+    /* Inverse mapping only: compute the source positions in fixed point for
+    CPUs with slow floating point, see sample.c. Nearest and bilinear
+    interpolations only; the result differs slightly. False by default unless
+    built with -DFIXED_POINT. */
+    bool fixed_point;
+    /* Inverse mapping only: where the sink shrinks 'bg', sample box-filtered
+    halvings of it instead, picked for each row of the sink. Downscaled results
+    are then free of aliasing, for the cost of reading 'bg' once more. Not used
+    by transform_stream(). */
+    bool mipmap;
+    /* BACKEND_CPU by default. Not used by transform_stream(). */
+    backend backend;
+    /* Called as the warp progresses, if not NULL. */
+    progress_callback progress;
+    void *progress_data;
+    /* Filled at the end of every warp, if not NULL. A transform with stats must
+    not process frames concurrently. */
+    stats *stats;
+} options;
+
+void options_init(options *opts);
+
+/* Size of the smallest rectangle containing the bounding box of 'anchors' and
+whose width / height is 'ratio'. Return false if the anchors are degenerate or
+the result does not fit a coord. */
+bool sink_size(const pixelset *anchors, double ratio, coord *width, coord *height);
+
+/* Shrink the geometry of a sink to fit in 'max_width' x 'max_height', keeping
+its ratio; 0 means no limit. Sinks already fitting are left alone. */
+void sink_fit(coord *width, coord *height, placement *place, coord max_width, coord max_height);
+
+/* Size of the sink showing the 'mode' part of a 'bg_width' x 'bg_height'
+picture rectified by 'anchors', and the placement to put in the options. The
+anchors get the size they have with sink_size(), except with CROP_SHRINK. The
+sink has 'ratio' too, except with CROP_KEEP. Return false if the anchors are
+degenerate, if the horizon of the transformation crosses the picture with
+CROP_KEEP and CROP_BIGGEST, or if the sink would be too big. */
+bool sink_geometry(const pixelset *anchors, double ratio, crop mode, coord bg_width, coord bg_height,
+                   coord *width, coord *height, placement *place);
+
+/* An anchor set checked and solved by solve_anchors(). */
+typedef struct
+{
+    /* The anchors dispatched over the corners of the sink. */
+    rect corners;
+    /* Row-major matrix mapping 'bg' to the sink in homogeneous coordinates, as
+    transform_get_matrix() returns it without placement. */
+    double matrix[9];
+    /* Whether the other fields are set, i.e. the set is usable. */
+    bool valid;
+} solution;
+
+/* Dispatch and solve 'count' anchor sets for a 'width' x 'height' sink into
+'solutions', e.g. to pick the best of many candidates. The sets are given to
+transform_new() as is. Reentrant: concurrent calls need no lock. Return the
+number of usable sets. */
+size_t solve_anchors(const pixelset *anchors, size_t count, coord width, coord height, solution *solutions);
+
+/* Same as perspector() with default options. */
 bool
 perspector(color *sink_data, coord sink_width, coord sink_height,
            color *bg_data, coord bg_width, coord bg_height,
            pixelset *anchors);
 
+bool
+perspector_opts(color *sink_data, coord sink_width, coord sink_height,
+                color *bg_data, coord bg_width, coord bg_height,
+                pixelset *anchors, const options *opts);
+
+/* A transformation solved once for given anchors, sizes and options, and then
+applied to any number of frames sharing them. A transform is read-only once
+created: frames can be processed concurrently with the same one, their progress
+then goes to the same callback. */
+typedef struct transform transform;
+
+/* Return NULL if the anchors configuration is not usable. */
+transform *
+transform_new(pixelset *anchors, coord sink_width, coord sink_height,
+              coord bg_width, coord bg_height, const options *opts);
+
+/* Same result as perspector_opts() with the parameters of 't'. */
+bool transform_apply(const transform *t, color *sink_data, const color *bg_data);
+
+/* Buffers of a warp: the masks and distance maps of the forward mapping, and
+the bookkeeping of the workers, whose threads are started on the first call
+that needs them. They grow on demand and are kept from one call to the next, so
+that a worker warping frames of the same size allocates nothing and starts no
+thread once the first one is done. A workspace serves one call at a time. */
+typedef struct workspace workspace;
+
+workspace *workspace_new(void);
+void workspace_free(workspace *ws);
+
+/* Same as transform_apply() with the buffers of 'ws'. */
+bool transform_apply_in(const transform *t, workspace *ws, color *sink_data, const color *bg_data);
+
+/* Streaming callbacks. A reader fills 'rows' with rows [begin, end[ of 'bg',
+contiguous and 'bg_width' pixels each. Rows may be requested in any order, but
+nearly in order for most transformations. A writer receives rows [begin, end[ of
+the sink, in order. Both return false to abort. */
+typedef bool (*row_reader)(void *data, coord begin, coord end, color *rows);
+typedef bool (*row_writer)(void *data, coord begin, coord end, const color *rows);
+
+/* Produce the sink of 't' in strips of 'strip_height' rows. Each strip only
+reads the rows of 'bg' it samples, so pictures need not fit in memory: peak
+memory is a strip plus the source rows it covers, which is the whole of 'bg'
+only when a strip crosses the horizon or for rotations close to a right angle.
+The result is the same as with transform_apply(). Inverse mapping only.
+Progress is reported after every strip. */
+bool transform_stream(const transform *t, coord strip_height,
+                      row_reader read, void *read_data,
+                      row_writer write, void *write_data);
+
+/* Change where the next frames of 't' report their progress and stats, as set
+by the options of transform_new(), e.g. to reuse 't' for the frames of a
+sequence. 't' must not be processing frames. */
+void transform_set_reports(transform *t, progress_callback func, void *data, stats *s);
+
+/* Row-major matrix mapping 'bg' to the sink in homogeneous coordinates. */
+void transform_get_matrix(const transform *t, double matrix[9]);
+
+void transform_free(transform *t);
+
 #endif
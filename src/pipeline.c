@@ -0,0 +1,146 @@
+/*
+Producer/consumer pipelines.
+
+A pipeline is a chain of stages linked by bounded queues. Every stage has its
+own pool of workers, so that a slow stage only holds back the others when the
+queues in between are full: the whole chain runs at the pace of its slowest
+stage, and the number of items in flight never exceeds the total capacity of the
+queues plus the number of workers.
+*/
+
+#include <stdlib.h>
+
+#include "pipeline.h"
+
+bool queue_init(queue *q, size_t capacity, unsigned int producers)
+{
+    q->items = malloc(capacity * sizeof *q->items);
+    if (!q->items)
+    {
+        return false;
+    }
+    q->capacity = capacity;
+    q->head = 0;
+    q->count = 0;
+    q->producers = producers;
+    pthread_mutex_init(&q->lock, NULL);
+    pthread_cond_init(&q->not_empty, NULL);
+    pthread_cond_init(&q->not_full, NULL);
+    return true;
+}
+
+void queue_destroy(queue *q)
+{
+    pthread_cond_destroy(&q->not_full);
+    pthread_cond_destroy(&q->not_empty);
+    pthread_mutex_destroy(&q->lock);
+    free(q->items);
+}
+
+void queue_push(queue *q, void *item)
+{
+    pthread_mutex_lock(&q->lock);
+    while (q->count == q->capacity)
+    {
+        pthread_cond_wait(&q->not_full, &q->lock);
+    }
+    q->items[(q->head + q->count) % q->capacity] = item;
+    q->count++;
+    pthread_cond_signal(&q->not_empty);
+    pthread_mutex_unlock(&q->lock);
+}
+
+void *queue_pop(queue *q)
+{
+    void *item = NULL;
+    pthread_mutex_lock(&q->lock);
+    while (q->count == 0 && q->producers > 0)
+    {
+        pthread_cond_wait(&q->not_empty, &q->lock);
+    }
+    if (q->count > 0)
+    {
+        item = q->items[q->head];
+        q->head = (q->head + 1) % q->capacity;
+        q->count--;
+        pthread_cond_signal(&q->not_full);
+    }
+    pthread_mutex_unlock(&q->lock);
+    return item;
+}
+
+void queue_close(queue *q)
+{
+    pthread_mutex_lock(&q->lock);
+    q->producers--;
+    if (q->producers == 0)
+    {
+        /* Wake up all the consumers for them to stop. */
+        pthread_cond_broadcast(&q->not_empty);
+    }
+    pthread_mutex_unlock(&q->lock);
+}
+
+/******************************************************************************/
+
+static void *worker(void *data)
+{
+    stage *s = data;
+    void *item;
+    while ((item = queue_pop(s->in)))
+    {
+        s->process(item, s->data);
+        if (s->out)
+        {
+            queue_push(s->out, item);
+        }
+    }
+    if (s->out)
+    {
+        queue_close(s->out);
+    }
+    return NULL;
+}
+
+/* If only some of the workers can be created, the stage runs with fewer. */
+bool stage_start(stage *s)
+{
+    s->threads = malloc(s->workers * sizeof *s->threads);
+    if (!s->threads)
+    {
+        return false;
+    }
+
+    unsigned int i, started = 0;
+    for (i = 0; i < s->workers; i++)
+    {
+        if (pthread_create(&s->threads[started], NULL, worker, s) == 0)
+        {
+            started++;
+        }
+        else if (s->out)
+        {
+            /* 'out' expects one producer per worker. */
+            queue_close(s->out);
+        }
+    }
+    s->workers = started;
+    if (started == 0)
+    {
+        free(s->threads);
+        s->threads = NULL;
+        return false;
+    }
+    return true;
+}
+
+void stage_join(stage *s)
+{
+    unsigned int i;
+    for (i = 0; i < s->workers; i++)
+    {
+        pthread_join(s->threads[i], NULL);
+    }
+    free(s->threads);
+    s->threads = NULL;
+}
@@ -0,0 +1,42 @@
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/* Bounded FIFO of items shared by threads. Pushing blocks while the queue is
+full, which holds back the producers of a stage faster than its consumers. */
+typedef struct
+{
+    void **items;
+    size_t capacity, head, count;
+    /* The queue is closed once all its producers called queue_close(). */
+    unsigned int producers;
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty, not_full;
+} queue;
+
+bool queue_init(queue *q, size_t capacity, unsigned int producers);
+void queue_destroy(queue *q);
+void queue_push(queue *q, void *item);
+/* Return NULL once the queue is closed and empty. */
+void *queue_pop(queue *q);
+void queue_close(queue *q);
+
+/* Pool of workers applying 'process' to the items of 'in', then pushing them to
+'out' if any. Each worker is a producer of 'out'. */
+typedef struct
+{
+    queue *in, *out;
+    void (*process)(void *item, void *data);
+    void *data;
+    unsigned int workers;
+    pthread_t *threads;
+} stage;
+
+/* Start the workers of 's'. Return false if none could start. */
+bool stage_start(stage *s);
+void stage_join(stage *s);
+
+#endif
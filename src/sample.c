@@ -0,0 +1,795 @@
+/*
+Sampling kernels.
+
+The `color` structure is 4 bytes wide, so a pixel fits in a 32-bit word and its
+channels fit in the lanes of a SIMD register. The kernels below compute the
+source positions of several sink pixels at once, fetch their 4 neighbours and
+blend them with integer arithmetic.
+
+All kernels follow the same arithmetic step by step: positions are computed in
+double precision with the same operations in the same order, and the blending
+weights are quantized before use. Thus they all produce exactly the same output
+and the choice of a kernel never changes the result. This requires the compiler
+not to fuse multiplications and additions, see `-ffp-contract=off` in the
+makefiles.
+
+The vectorized kernels are selected at runtime from the features of the CPU.
+Build with `-DNO_SIMD` to only keep the portable kernel.
+
+For CPUs with slow floating point, the nearest and bilinear kernels also have
+fixed-point variants. Those only approximate the positions, see below, so they
+are chosen explicitly.
+*/
+
+#include <math.h>
+#include <pthread.h>
+#include <string.h>
+#include "sample.h"
+
+#if !defined(NO_SIMD) && defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SIMD_X86
+#include <immintrin.h>
+#elif !defined(NO_SIMD) && defined(__aarch64__) && defined(__ARM_NEON)
+#define SIMD_NEON
+#include <arm_neon.h>
+#endif
+
+/* Bilinear weights have 8 bits of precision per dimension, so that the 4
+weights of a pixel sum to 2^16 and the blending fits in 32-bit integers. */
+#define WEIGHT_BITS 8
+#define WEIGHT_ONE (1 << WEIGHT_BITS)
+#define BLEND_SHIFT (2 * WEIGHT_BITS)
+#define BLEND_ROUND (1 << (BLEND_SHIFT - 1))
+
+/******************************************************************************/
+/* Portable kernel */
+
+/* Position of pixel 'i' of the row on 'bg', clamped to its edges. */
+static inline point clamped_position(double i, const double origin[3], const double step[3],
+                                     coord bg_width, coord bg_height)
+{
+    double r = 1 / (origin[2] + i * step[2]);
+    double x = (origin[0] + i * step[0]) * r;
+    double y = (origin[1] + i * step[1]) * r;
+    double x_max = bg_width - 1;
+    double y_max = bg_height - 1;
+
+    /* NaN (points at infinity) goes to 0, just like the SIMD min/max
+    instructions do. */
+    x = x > 0 ? x : 0;
+    x = x < x_max ? x : x_max;
+    y = y > 0 ? y : 0;
+    y = y < y_max ? y : y_max;
+
+    point p = { x, y };
+    return p;
+}
+
+void nearest_row(color *out, coord count,
+                 const double origin[3], const double step[3],
+                 const color *bg_data, coord bg_width, coord bg_height, coord bg_top)
+{
+    coord i;
+    for (i = 0; i < count; i++)
+    {
+        point p = clamped_position(i, origin, step, bg_width, bg_height);
+        /* 'round' is required since a cast floors the value. */
+        coord x = round(p.x);
+        coord y = round(p.y);
+        out[i] = bg_data[(ptrdiff_t)(y - bg_top) * bg_width + x];
+    }
+}
+
+static inline void bilinear_pixel(color *out, double i,
+                                  const double origin[3], const double step[3],
+                                  const color *bg_data, coord bg_width, coord bg_height, coord bg_top)
+{
+    point p = clamped_position(i, origin, step, bg_width, bg_height);
+    double x = p.x;
+    double y = p.y;
+
+    double fx = floor(x);
+    double fy = floor(y);
+    int32_t wx = (x - fx) * WEIGHT_ONE + 0.5;
+    int32_t wy = (y - fy) * WEIGHT_ONE + 0.5;
+    coord x0 = fx;
+    coord y0 = fy;
+
+    /* On the last row or column, the second neighbour is the pixel itself. */
+    ptrdiff_t dx = x0 < bg_width - 1;
+    ptrdiff_t dy = y0 < bg_height - 1 ? bg_width : 0;
+    const unsigned char *p00 = (const unsigned char *)&bg_data[(ptrdiff_t)(y0 - bg_top) * bg_width + x0];
+    const unsigned char *p10 = (const unsigned char *)&bg_data[(ptrdiff_t)(y0 - bg_top) * bg_width + x0 + dx];
+    const unsigned char *p01 = (const unsigned char *)&bg_data[(ptrdiff_t)(y0 - bg_top) * bg_width + x0 + dy];
+    const unsigned char *p11 = (const unsigned char *)&bg_data[(ptrdiff_t)(y0 - bg_top) * bg_width + x0 + dy + dx];
+
+    int32_t w00 = (WEIGHT_ONE - wx) * (WEIGHT_ONE - wy);
+    int32_t w10 = wx * (WEIGHT_ONE - wy);
+    int32_t w01 = (WEIGHT_ONE - wx) * wy;
+    int32_t w11 = wx * wy;
+
+    unsigned char *dst = (unsigned char *)out;
+    size_t c;
+    for (c = 0; c < sizeof (color); c++)
+    {
+        dst[c] = (p00[c] * w00 + p10[c] * w10 + p01[c] * w01 + p11[c] * w11 + BLEND_ROUND) >> BLEND_SHIFT;
+    }
+}
+
+void bilinear_row(color *out, coord count,
+                  const double origin[3], const double step[3],
+                  const color *bg_data, coord bg_width, coord bg_height, coord bg_top)
+{
+    coord i;
+    for (i = 0; i < count; i++)
+    {
+        bilinear_pixel(&out[i], i, origin, step, bg_data, bg_width, bg_height, bg_top);
+    }
+}
+
+/******************************************************************************/
+/* Separable filters */
+
+/* Filters are evaluated at the same 8-bit fractional positions as the bilinear
+weights, so the weights of every position are computed once and for all. */
+#define PHASES WEIGHT_ONE
+#define MAX_TAPS 6
+
+/* Not part of C99. */
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+typedef struct
+{
+    /* Number of neighbours per dimension. The first one is at offset
+    1 - taps / 2 from the integer part of the position. */
+    int taps;
+    /* Normalized weights for a fractional position of 'phase / PHASES'. */
+    double weights[PHASES + 1][MAX_TAPS];
+} filter;
+
+static filter bicubic_filter = { .taps = 4 };
+static filter lanczos3_filter = { .taps = 6 };
+static pthread_once_t filters_once = PTHREAD_ONCE_INIT;
+
+/* Catmull-Rom spline, i.e. the Keys cubic with a = -0.5. */
+static double bicubic_weight(double t)
+{
+    t = fabs(t);
+    if (t < 1)
+    {
+        return (1.5 * t - 2.5) * t * t + 1;
+    }
+    if (t < 2)
+    {
+        return ((-0.5 * t + 2.5) * t - 4) * t + 2;
+    }
+    return 0;
+}
+
+static double lanczos3_weight(double t)
+{
+    if (t == 0)
+    {
+        return 1;
+    }
+    if (fabs(t) >= 3)
+    {
+        return 0;
+    }
+    double pt = M_PI * t;
+    return 3 * sin(pt) * sin(pt / 3) / (pt * pt);
+}
+
+static void init_filter(filter *f, double (*weight)(double))
+{
+    int phase, k;
+    for (phase = 0; phase <= PHASES; phase++)
+    {
+        double frac = (double)phase / PHASES;
+        double sum = 0;
+        for (k = 0; k < f->taps; k++)
+        {
+            f->weights[phase][k] = weight(frac - (1 - f->taps / 2 + k));
+            sum += f->weights[phase][k];
+        }
+        /* Normalize so that flat areas stay flat. */
+        for (k = 0; k < f->taps; k++)
+        {
+            f->weights[phase][k] /= sum;
+        }
+    }
+}
+
+static void init_filters(void)
+{
+    init_filter(&bicubic_filter, bicubic_weight);
+    init_filter(&lanczos3_filter, lanczos3_weight);
+}
+
+static inline coord clamp_index(coord value, coord max)
+{
+    return value < 0 ? 0 : value > max ? max : value;
+}
+
+/* Filter the rows first, then the column of filtered values. Neighbours outside
+'bg' are replaced by the closest edge pixel. */
+static void filter_row(const filter *f, color *out, coord count,
+                       const double origin[3], const double step[3],
+                       const color *bg_data, coord bg_width, coord bg_height, coord bg_top)
+{
+    coord i;
+    int j, k;
+    size_t c;
+    coord cols[MAX_TAPS];
+
+    for (i = 0; i < count; i++)
+    {
+        point p = clamped_position(i, origin, step, bg_width, bg_height);
+        double fx = floor(p.x);
+        double fy = floor(p.y);
+        const double *wx = f->weights[(int)((p.x - fx) * PHASES + 0.5)];
+        const double *wy = f->weights[(int)((p.y - fy) * PHASES + 0.5)];
+        coord x0 = (coord)fx + 1 - f->taps / 2;
+        coord y0 = (coord)fy + 1 - f->taps / 2;
+
+        for (k = 0; k < f->taps; k++)
+        {
+            cols[k] = clamp_index(x0 + k, bg_width - 1);
+        }
+
+        double acc[sizeof (color)] = { 0 };
+        for (j = 0; j < f->taps; j++)
+        {
+            const unsigned char *row = (const unsigned char *)&bg_data[(ptrdiff_t)(clamp_index(y0 + j, bg_height - 1) - bg_top) * bg_width];
+            double row_acc[sizeof (color)] = { 0 };
+            for (k = 0; k < f->taps; k++)
+            {
+                const unsigned char *src = row + cols[k] * sizeof (color);
+                for (c = 0; c < sizeof (color); c++)
+                {
+                    row_acc[c] += wx[k] * src[c];
+                }
+            }
+            for (c = 0; c < sizeof (color); c++)
+            {
+                acc[c] += wy[j] * row_acc[c];
+            }
+        }
+
+        /* The filters have negative lobes, so they can overshoot. */
+        unsigned char *dst = (unsigned char *)&out[i];
+        for (c = 0; c < sizeof (color); c++)
+        {
+            dst[c] = acc[c] <= 0 ? 0 : acc[c] >= 255 ? 255 : (unsigned char)(acc[c] + 0.5);
+        }
+    }
+}
+
+void bicubic_row(color *out, coord count,
+                 const double origin[3], const double step[3],
+                 const color *bg_data, coord bg_width, coord bg_height, coord bg_top)
+{
+    pthread_once(&filters_once, init_filters);
+    filter_row(&bicubic_filter, out, count, origin, step, bg_data, bg_width, bg_height, bg_top);
+}
+
+void lanczos3_row(color *out, coord count,
+                  const double origin[3], const double step[3],
+                  const color *bg_data, coord bg_width, coord bg_height, coord bg_top)
+{
+    pthread_once(&filters_once, init_filters);
+    filter_row(&lanczos3_filter, out, count, origin, step, bg_data, bg_width, bg_height, bg_top);
+}
+
+/******************************************************************************/
+/* Fixed-point kernels */
+
+/* Positions have 16 fractional bits and are interpolated linearly between
+exact positions, computed in double precision with one reciprocal each. The
+distance between two exact positions is the longest power of 2 up to FIXED_SPAN
+for which the interpolation error is below FIXED_TOLERANCE pixels. For
+f(i) = (a + b i) / (c + d i), that error is at most L^2 / 8 * |f''| on a segment
+of length L, with |f''| = 2 |d (b c - a d)| / |c + d i|^3 largest at the end of
+the segment closest to the horizon. Each interpolated position also carries the
+rounding of its slope, L * 2^-17 pixels at most. Segments close to the horizon or
+far away from 'bg' are computed exactly, one pixel at a time.
+
+Thus positions are within 1/200 of a pixel of the double ones, about the
+resolution of the bilinear weights. On photographs of 9 to 48 megapixels warped
+by rectifications of various strength, bilinear outputs differ on less than 1%
+of the channels, by 2 levels at most; nearest picks another pixel for less than
+0.2% of the pixels. Positions then cost 2 integer additions per pixel instead of
+a division, which halves the time of the portable kernels; the vectorized
+bilinear kernels of x86 remain faster there. */
+#define FIXED_BITS 16
+#define FIXED_ONE ((int64_t)1 << FIXED_BITS)
+#define FIXED_SPAN 64
+#define FIXED_TOLERANCE (1.0 / 256)
+/* Farther away, positions are computed exactly so that they fit 48 bits. */
+#define FIXED_LIMIT 16777216.0
+
+typedef struct
+{
+    const double *origin, *step;
+    /* 2 |d (b c - a d)| for both axes, see above. */
+    double curvature_x, curvature_y;
+    coord bg_width, bg_height;
+    int64_t x_max, y_max;
+} fixed_row;
+
+static void fixed_start(fixed_row *r, const double origin[3], const double step[3],
+                        coord bg_width, coord bg_height)
+{
+    r->origin = origin;
+    r->step = step;
+    r->curvature_x = 2 * fabs(step[2] * (step[0] * origin[2] - origin[0] * step[2]));
+    r->curvature_y = 2 * fabs(step[2] * (step[1] * origin[2] - origin[1] * step[2]));
+    r->bg_width = bg_width;
+    r->bg_height = bg_height;
+    r->x_max = (int64_t)(bg_width - 1) << FIXED_BITS;
+    r->y_max = (int64_t)(bg_height - 1) << FIXED_BITS;
+}
+
+static inline int64_t to_fixed(double v)
+{
+    return (int64_t)floor(v * FIXED_ONE + 0.5);
+}
+
+static inline int64_t clamp_fixed(int64_t v, int64_t max)
+{
+    return v < 0 ? 0 : v > max ? max : v;
+}
+
+/* Whether positions [i, i + length] can be interpolated, and their exact
+unclamped ends if so. */
+static bool fixed_segment(const fixed_row *r, double i, coord length, point *first, point *last)
+{
+    const double *o = r->origin, *s = r->step;
+    double w0 = o[2] + i * s[2];
+    double w1 = o[2] + (i + length) * s[2];
+    if (!(w0 * w1 > 0))
+    {
+        return false;
+    }
+    double w_min = fabs(w0) < fabs(w1) ? fabs(w0) : fabs(w1);
+    double curvature = r->curvature_x > r->curvature_y ? r->curvature_x : r->curvature_y;
+    if ((double)length * length / 8 * curvature > FIXED_TOLERANCE * w_min * w_min * w_min)
+    {
+        return false;
+    }
+
+    first->x = (o[0] + i * s[0]) / w0;
+    first->y = (o[1] + i * s[1]) / w0;
+    last->x = (o[0] + (i + length) * s[0]) / w1;
+    last->y = (o[1] + (i + length) * s[1]) / w1;
+    return fabs(first->x) < FIXED_LIMIT && fabs(first->y) < FIXED_LIMIT
+           && fabs(last->x) < FIXED_LIMIT && fabs(last->y) < FIXED_LIMIT;
+}
+
+/* Fill 'xs' and 'ys' with the clamped fixed-point positions of the pixels of
+the next segment from pixel 'i', and return its length. */
+static coord fixed_positions(const fixed_row *r, coord i, coord count, int64_t xs[FIXED_SPAN], int64_t ys[FIXED_SPAN])
+{
+    coord length = FIXED_SPAN;
+    point first = { 0, 0 }, last = { 0, 0 };
+    while (length > count - i)
+    {
+        length /= 2;
+    }
+    while (length > 1 && !fixed_segment(r, i, length, &first, &last))
+    {
+        length /= 2;
+    }
+
+    if (length == 1)
+    {
+        point p = clamped_position(i, r->origin, r->step, r->bg_width, r->bg_height);
+        xs[0] = to_fixed(p.x);
+        ys[0] = to_fixed(p.y);
+        return 1;
+    }
+
+    int64_t x = to_fixed(first.x), y = to_fixed(first.y);
+    int64_t dx = to_fixed((last.x - first.x) / length);
+    int64_t dy = to_fixed((last.y - first.y) / length);
+    coord j;
+    for (j = 0; j < length; j++, x += dx, y += dy)
+    {
+        xs[j] = clamp_fixed(x, r->x_max);
+        ys[j] = clamp_fixed(y, r->y_max);
+    }
+    return length;
+}
+
+void nearest_row_fixed(color *out, coord count,
+                       const double origin[3], const double step[3],
+                       const color *bg_data, coord bg_width, coord bg_height, coord bg_top)
+{
+    int64_t xs[FIXED_SPAN], ys[FIXED_SPAN];
+    fixed_row r;
+    fixed_start(&r, origin, step, bg_width, bg_height);
+
+    coord i, j, length;
+    for (i = 0; i < count; i += length)
+    {
+        length = fixed_positions(&r, i, count, xs, ys);
+        for (j = 0; j < length; j++)
+        {
+            coord x = (xs[j] + FIXED_ONE / 2) >> FIXED_BITS;
+            coord y = (ys[j] + FIXED_ONE / 2) >> FIXED_BITS;
+            out[i + j] = bg_data[(ptrdiff_t)(y - bg_top) * bg_width + x];
+        }
+    }
+}
+
+void bilinear_row_fixed(color *out, coord count,
+                        const double origin[3], const double step[3],
+                        const color *bg_data, coord bg_width, coord bg_height, coord bg_top)
+{
+    int64_t xs[FIXED_SPAN], ys[FIXED_SPAN];
+    fixed_row r;
+    fixed_start(&r, origin, step, bg_width, bg_height);
+
+    /* Rounds the fraction to WEIGHT_BITS bits like bilinear_pixel(). */
+    const int shift = FIXED_BITS - WEIGHT_BITS;
+    const int64_t frac_mask = FIXED_ONE - 1;
+    coord i, j, length;
+    for (i = 0; i < count; i += length)
+    {
+        length = fixed_positions(&r, i, count, xs, ys);
+        for (j = 0; j < length; j++)
+        {
+            coord x0 = xs[j] >> FIXED_BITS;
+            coord y0 = ys[j] >> FIXED_BITS;
+            int32_t wx = ((xs[j] & frac_mask) + (1 << (shift - 1))) >> shift;
+            int32_t wy = ((ys[j] & frac_mask) + (1 << (shift - 1))) >> shift;
+
+            ptrdiff_t dx = x0 < bg_width - 1;
+            ptrdiff_t dy = y0 < bg_height - 1 ? bg_width : 0;
+            const unsigned char *p00 = (const unsigned char *)&bg_data[(ptrdiff_t)(y0 - bg_top) * bg_width + x0];
+            const unsigned char *p10 = p00 + dx * sizeof (color);
+            const unsigned char *p01 = p00 + dy * sizeof (color);
+            const unsigned char *p11 = p01 + dx * sizeof (color);
+
+            int32_t w00 = (WEIGHT_ONE - wx) * (WEIGHT_ONE - wy);
+            int32_t w10 = wx * (WEIGHT_ONE - wy);
+            int32_t w01 = (WEIGHT_ONE - wx) * wy;
+            int32_t w11 = wx * wy;
+
+            unsigned char *dst = (unsigned char *)&out[i + j];
+            size_t c;
+            for (c = 0; c < sizeof (color); c++)
+            {
+                dst[c] = (p00[c] * w00 + p10[c] * w10 + p01[c] * w01 + p11[c] * w11 + BLEND_ROUND) >> BLEND_SHIFT;
+            }
+        }
+    }
+}
+
+/******************************************************************************/
+/* x86 kernels */
+
+#ifdef SIMD_X86
+
+/* Source positions of 2 consecutive pixels: integer coordinates of the top-left
+neighbour, and quantized weights. */
+__attribute__((target("sse4.1")))
+static inline void sse41_positions(int32_t x0[2], int32_t y0[2], int32_t wx[2], int32_t wy[2], double i,
+                                   const double origin[3], const double step[3],
+                                   coord bg_width, coord bg_height)
+{
+    const __m128d zero = _mm_setzero_pd();
+    const __m128d half = _mm_set1_pd(0.5);
+    const __m128d weight_one = _mm_set1_pd(WEIGHT_ONE);
+    __m128d di = _mm_add_pd(_mm_set1_pd(i), _mm_set_pd(1, 0));
+
+    __m128d r = _mm_div_pd(_mm_set1_pd(1), _mm_add_pd(_mm_set1_pd(origin[2]), _mm_mul_pd(di, _mm_set1_pd(step[2]))));
+    __m128d x = _mm_mul_pd(_mm_add_pd(_mm_set1_pd(origin[0]), _mm_mul_pd(di, _mm_set1_pd(step[0]))), r);
+    __m128d y = _mm_mul_pd(_mm_add_pd(_mm_set1_pd(origin[1]), _mm_mul_pd(di, _mm_set1_pd(step[1]))), r);
+
+    /* max returns its second operand on NaN. */
+    x = _mm_min_pd(_mm_max_pd(x, zero), _mm_set1_pd(bg_width - 1));
+    y = _mm_min_pd(_mm_max_pd(y, zero), _mm_set1_pd(bg_height - 1));
+
+    __m128d fx = _mm_floor_pd(x);
+    __m128d fy = _mm_floor_pd(y);
+
+    int32_t buf[4];
+    _mm_storeu_si128((__m128i *)buf, _mm_cvttpd_epi32(fx));
+    x0[0] = buf[0], x0[1] = buf[1];
+    _mm_storeu_si128((__m128i *)buf, _mm_cvttpd_epi32(fy));
+    y0[0] = buf[0], y0[1] = buf[1];
+    _mm_storeu_si128((__m128i *)buf, _mm_cvttpd_epi32(_mm_add_pd(_mm_mul_pd(_mm_sub_pd(x, fx), weight_one), half)));
+    wx[0] = buf[0], wx[1] = buf[1];
+    _mm_storeu_si128((__m128i *)buf, _mm_cvttpd_epi32(_mm_add_pd(_mm_mul_pd(_mm_sub_pd(y, fy), weight_one), half)));
+    wy[0] = buf[0], wy[1] = buf[1];
+}
+
+__attribute__((target("sse4.1")))
+static inline __m128i sse41_load(const color *p)
+{
+    int32_t v;
+    memcpy(&v, p, sizeof v);
+    return _mm_cvtepu8_epi32(_mm_cvtsi32_si128(v));
+}
+
+/* Blend the 4 neighbours of a pixel, one channel per lane. */
+__attribute__((target("sse4.1")))
+static inline void sse41_blend(color *out, int32_t x0, int32_t y0, int32_t wx, int32_t wy,
+                               const color *bg_data, coord bg_width, coord bg_height, coord bg_top)
+{
+    ptrdiff_t dx = x0 < bg_width - 1;
+    ptrdiff_t dy = y0 < bg_height - 1 ? bg_width : 0;
+    const color *p = &bg_data[(ptrdiff_t)(y0 - bg_top) * bg_width + x0];
+
+    __m128i acc = _mm_mullo_epi32(sse41_load(p), _mm_set1_epi32((WEIGHT_ONE - wx) * (WEIGHT_ONE - wy)));
+    acc = _mm_add_epi32(acc, _mm_mullo_epi32(sse41_load(p + dx), _mm_set1_epi32(wx * (WEIGHT_ONE - wy))));
+    acc = _mm_add_epi32(acc, _mm_mullo_epi32(sse41_load(p + dy), _mm_set1_epi32((WEIGHT_ONE - wx) * wy)));
+    acc = _mm_add_epi32(acc, _mm_mullo_epi32(sse41_load(p + dy + dx), _mm_set1_epi32(wx * wy)));
+    acc = _mm_srli_epi32(_mm_add_epi32(acc, _mm_set1_epi32(BLEND_ROUND)), BLEND_SHIFT);
+
+    __m128i packed = _mm_packus_epi16(_mm_packus_epi32(acc, acc), acc);
+    int32_t v = _mm_cvtsi128_si32(packed);
+    memcpy(out, &v, sizeof v);
+}
+
+/* 4 pixels per iteration. SSE4.1 has no gather instruction, so positions are
+vectorized but neighbours are fetched one pixel at a time. */
+__attribute__((target("sse4.1")))
+static void bilinear_row_sse41(color *out, coord count,
+                               const double origin[3], const double step[3],
+                               const color *bg_data, coord bg_width, coord bg_height, coord bg_top)
+{
+    coord i;
+    int j;
+    int32_t x0[4], y0[4], wx[4], wy[4];
+
+    for (i = 0; i + 4 <= count; i += 4)
+    {
+        sse41_positions(x0, y0, wx, wy, i, origin, step, bg_width, bg_height);
+        sse41_positions(x0 + 2, y0 + 2, wx + 2, wy + 2, i + 2, origin, step, bg_width, bg_height);
+        for (j = 0; j < 4; j++)
+        {
+            sse41_blend(&out[i + j], x0[j], y0[j], wx[j], wy[j], bg_data, bg_width, bg_height, bg_top);
+        }
+    }
+    for (; i < count; i++)
+    {
+        bilinear_pixel(&out[i], i, origin, step, bg_data, bg_width, bg_height, bg_top);
+    }
+}
+
+/* 4 pixels per iteration, neighbours are gathered. Indices are 32-bit, so 'bg'
+must have less than 2^31 pixels. */
+__attribute__((target("avx2")))
+static void bilinear_row_avx2(color *out, coord count,
+                              const double origin[3], const double step[3],
+                              const color *bg_data, coord bg_width, coord bg_height, coord bg_top)
+{
+    const __m256d zero = _mm256_setzero_pd();
+    const __m256d half = _mm256_set1_pd(0.5);
+    const __m256d one = _mm256_set1_pd(1);
+    const __m256d weight_one = _mm256_set1_pd(WEIGHT_ONE);
+    const __m256d lanes = _mm256_set_pd(3, 2, 1, 0);
+    const __m256d o0 = _mm256_set1_pd(origin[0]);
+    const __m256d o1 = _mm256_set1_pd(origin[1]);
+    const __m256d o2 = _mm256_set1_pd(origin[2]);
+    const __m256d s0 = _mm256_set1_pd(step[0]);
+    const __m256d s1 = _mm256_set1_pd(step[1]);
+    const __m256d s2 = _mm256_set1_pd(step[2]);
+    const __m256d x_max = _mm256_set1_pd(bg_width - 1);
+    const __m256d y_max = _mm256_set1_pd(bg_height - 1);
+
+    const __m128i x_last = _mm_set1_epi32(bg_width - 1);
+    const __m128i y_last = _mm_set1_epi32(bg_height - 1);
+    const __m128i width = _mm_set1_epi32(bg_width);
+    const __m128i top = _mm_set1_epi32(bg_top);
+    const __m128i ione = _mm_set1_epi32(1);
+    const __m128i iweight_one = _mm_set1_epi32(WEIGHT_ONE);
+    const __m256i round = _mm256_set1_epi32(BLEND_ROUND);
+    /* Broadcast the weight of pixels 0, 1 (resp. 2, 3) to their channels. */
+    const __m256i select_lo = _mm256_setr_epi32(0, 0, 0, 0, 1, 1, 1, 1);
+    const __m256i select_hi = _mm256_setr_epi32(2, 2, 2, 2, 3, 3, 3, 3);
+    /* Reorder the pixels after packing, see below. */
+    const __m256i reorder = _mm256_setr_epi32(0, 4, 1, 5, 0, 0, 0, 0);
+
+    const int *base = (const int *)bg_data;
+    coord i;
+
+    for (i = 0; i + 4 <= count; i += 4)
+    {
+        __m256d di = _mm256_add_pd(_mm256_set1_pd(i), lanes);
+        __m256d r = _mm256_div_pd(one, _mm256_add_pd(o2, _mm256_mul_pd(di, s2)));
+        __m256d x = _mm256_mul_pd(_mm256_add_pd(o0, _mm256_mul_pd(di, s0)), r);
+        __m256d y = _mm256_mul_pd(_mm256_add_pd(o1, _mm256_mul_pd(di, s1)), r);
+
+        x = _mm256_min_pd(_mm256_max_pd(x, zero), x_max);
+        y = _mm256_min_pd(_mm256_max_pd(y, zero), y_max);
+
+        __m256d fx = _mm256_floor_pd(x);
+        __m256d fy = _mm256_floor_pd(y);
+        __m128i wx = _mm256_cvttpd_epi32(_mm256_add_pd(_mm256_mul_pd(_mm256_sub_pd(x, fx), weight_one), half));
+        __m128i wy = _mm256_cvttpd_epi32(_mm256_add_pd(_mm256_mul_pd(_mm256_sub_pd(y, fy), weight_one), half));
+        __m128i x0 = _mm256_cvttpd_epi32(fx);
+        __m128i y0 = _mm256_cvttpd_epi32(fy);
+
+        __m128i dx = _mm_and_si128(_mm_cmplt_epi32(x0, x_last), ione);
+        __m128i dy = _mm_and_si128(_mm_cmplt_epi32(y0, y_last), width);
+        __m128i i00 = _mm_add_epi32(_mm_mullo_epi32(_mm_sub_epi32(y0, top), width), x0);
+        __m128i i10 = _mm_add_epi32(i00, dx);
+        __m128i i01 = _mm_add_epi32(i00, dy);
+        __m128i i11 = _mm_add_epi32(i01, dx);
+
+        __m128i iwx = _mm_sub_epi32(iweight_one, wx);
+        __m128i iwy = _mm_sub_epi32(iweight_one, wy);
+        __m256i w00 = _mm256_castsi128_si256(_mm_mullo_epi32(iwx, iwy));
+        __m256i w10 = _mm256_castsi128_si256(_mm_mullo_epi32(wx, iwy));
+        __m256i w01 = _mm256_castsi128_si256(_mm_mullo_epi32(iwx, wy));
+        __m256i w11 = _mm256_castsi128_si256(_mm_mullo_epi32(wx, wy));
+
+        __m128i p00 = _mm_i32gather_epi32(base, i00, 4);
+        __m128i p10 = _mm_i32gather_epi32(base, i10, 4);
+        __m128i p01 = _mm_i32gather_epi32(base, i01, 4);
+        __m128i p11 = _mm_i32gather_epi32(base, i11, 4);
+
+        /* One channel per 32-bit lane: pixels 0 and 1 in 'lo', 2 and 3 in
+        'hi'. */
+#define BLEND(half_, select_, shift_) \
+        __m256i half_ = _mm256_mullo_epi32(_mm256_cvtepu8_epi32(_mm_srli_si128(p00, shift_)), _mm256_permutevar8x32_epi32(w00, select_)); \
+        half_ = _mm256_add_epi32(half_, _mm256_mullo_epi32(_mm256_cvtepu8_epi32(_mm_srli_si128(p10, shift_)), _mm256_permutevar8x32_epi32(w10, select_))); \
+        half_ = _mm256_add_epi32(half_, _mm256_mullo_epi32(_mm256_cvtepu8_epi32(_mm_srli_si128(p01, shift_)), _mm256_permutevar8x32_epi32(w01, select_))); \
+        half_ = _mm256_add_epi32(half_, _mm256_mullo_epi32(_mm256_cvtepu8_epi32(_mm_srli_si128(p11, shift_)), _mm256_permutevar8x32_epi32(w11, select_))); \
+        half_ = _mm256_srli_epi32(_mm256_add_epi32(half_, round), BLEND_SHIFT);
+
+        BLEND(lo, select_lo, 0)
+        BLEND(hi, select_hi, 8)
+#undef BLEND
+
+        /* Packing works within 128-bit lanes: after packing to 8 bits, the
+        32-bit elements hold pixels 0, 2, 0, 2, 1, 3, 1, 3. */
+        __m256i packed = _mm256_packus_epi32(lo, hi);
+        packed = _mm256_packus_epi16(packed, packed);
+        packed = _mm256_permutevar8x32_epi32(packed, reorder);
+        _mm_storeu_si128((__m128i *)&out[i], _mm256_castsi256_si128(packed));
+    }
+    for (; i < count; i++)
+    {
+        bilinear_pixel(&out[i], i, origin, step, bg_data, bg_width, bg_height, bg_top);
+    }
+}
+
+#endif
+
+/******************************************************************************/
+/* ARM kernels */
+
+#ifdef SIMD_NEON
+
+static inline uint32x4_t neon_load(const color *p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof v);
+    return vmovl_u16(vget_low_u16(vmovl_u8(vreinterpret_u8_u32(vdup_n_u32(v)))));
+}
+
+/* 2 pixels per iteration. NEON has no gather instruction, so positions are
+vectorized but neighbours are fetched one pixel at a time. */
+static void bilinear_row_neon(color *out, coord count,
+                              const double origin[3], const double step[3],
+                              const color *bg_data, coord bg_width, coord bg_height, coord bg_top)
+{
+    const double lane_values[2] = { 0, 1 };
+    const float64x2_t lanes = vld1q_f64(lane_values);
+    const float64x2_t zero = vdupq_n_f64(0);
+    const float64x2_t half = vdupq_n_f64(0.5);
+    const float64x2_t one = vdupq_n_f64(1);
+    const float64x2_t weight_one = vdupq_n_f64(WEIGHT_ONE);
+    const float64x2_t x_max = vdupq_n_f64(bg_width - 1);
+    const float64x2_t y_max = vdupq_n_f64(bg_height - 1);
+    coord i;
+    int j;
+    int64_t x0[2], y0[2], wx[2], wy[2];
+
+    for (i = 0; i + 2 <= count; i += 2)
+    {
+        float64x2_t di = vaddq_f64(vdupq_n_f64(i), lanes);
+        float64x2_t r = vdivq_f64(one, vaddq_f64(vdupq_n_f64(origin[2]), vmulq_f64(di, vdupq_n_f64(step[2]))));
+        float64x2_t x = vmulq_f64(vaddq_f64(vdupq_n_f64(origin[0]), vmulq_f64(di, vdupq_n_f64(step[0]))), r);
+        float64x2_t y = vmulq_f64(vaddq_f64(vdupq_n_f64(origin[1]), vmulq_f64(di, vdupq_n_f64(step[1]))), r);
+
+        /* The 'nm' variants return the number when the other operand is
+        NaN. */
+        x = vminnmq_f64(vmaxnmq_f64(x, zero), x_max);
+        y = vminnmq_f64(vmaxnmq_f64(y, zero), y_max);
+
+        float64x2_t fx = vrndmq_f64(x);
+        float64x2_t fy = vrndmq_f64(y);
+        vst1q_s64(wx, vcvtq_s64_f64(vaddq_f64(vmulq_f64(vsubq_f64(x, fx), weight_one), half)));
+        vst1q_s64(wy, vcvtq_s64_f64(vaddq_f64(vmulq_f64(vsubq_f64(y, fy), weight_one), half)));
+        vst1q_s64(x0, vcvtq_s64_f64(fx));
+        vst1q_s64(y0, vcvtq_s64_f64(fy));
+
+        for (j = 0; j < 2; j++)
+        {
+            ptrdiff_t dx = x0[j] < bg_width - 1;
+            ptrdiff_t dy = y0[j] < bg_height - 1 ? bg_width : 0;
+            const color *p = &bg_data[(y0[j] - bg_top) * bg_width + x0[j]];
+            uint32_t iwx = WEIGHT_ONE - wx[j];
+            uint32_t iwy = WEIGHT_ONE - wy[j];
+
+            uint32x4_t acc = vmulq_n_u32(neon_load(p), iwx * iwy);
+            acc = vmlaq_n_u32(acc, neon_load(p + dx), wx[j] * iwy);
+            acc = vmlaq_n_u32(acc, neon_load(p + dy), iwx * wy[j]);
+            acc = vmlaq_n_u32(acc, neon_load(p + dy + dx), wx[j] * wy[j]);
+            acc = vshrq_n_u32(vaddq_u32(acc, vdupq_n_u32(BLEND_ROUND)), BLEND_SHIFT);
+
+            uint16x4_t narrow = vmovn_u32(acc);
+            uint8x8_t bytes = vmovn_u16(vcombine_u16(narrow, narrow));
+            uint32_t v = vget_lane_u32(vreinterpret_u32_u8(bytes), 0);
+            memcpy(&out[i + j], &v, sizeof v);
+        }
+    }
+    for (; i < count; i++)
+    {
+        bilinear_pixel(&out[i], i, origin, step, bg_data, bg_width, bg_height, bg_top);
+    }
+}
+
+#endif
+
+/******************************************************************************/
+
+row_kernel bilinear_kernel(coord bg_width, coord bg_height)
+{
+    (void)bg_width;
+    (void)bg_height;
+
+#if defined(SIMD_X86)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2") && (int64_t)bg_width * bg_height <= INT32_MAX)
+    {
+        return bilinear_row_avx2;
+    }
+    if (__builtin_cpu_supports("sse4.1"))
+    {
+        return bilinear_row_sse41;
+    }
+#elif defined(SIMD_NEON)
+    return bilinear_row_neon;
+#endif
+
+    return bilinear_row;
+}
+
+coord sample_radius(interpolation interp)
+{
+    switch (interp)
+    {
+    case INTERP_BICUBIC:
+        return 2;
+    case INTERP_LANCZOS3:
+        return 3;
+    case INTERP_NEAREST:
+    case INTERP_BILINEAR:
+    default:
+        return 1;
+    }
+}
+
+row_kernel sample_kernel(interpolation interp, coord bg_width, coord bg_height, bool fixed)
+{
+    switch (interp)
+    {
+    case INTERP_NEAREST:
+        return fixed ? nearest_row_fixed : nearest_row;
+    case INTERP_BICUBIC:
+        return bicubic_row;
+    case INTERP_LANCZOS3:
+        return lanczos3_row;
+    case INTERP_BILINEAR:
+    default:
+        return fixed ? bilinear_row_fixed : bilinear_kernel(bg_width, bg_height);
+    }
+}
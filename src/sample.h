@@ -0,0 +1,57 @@
+#ifndef SAMPLE_H
+#define SAMPLE_H
+
+#include "perspector.h"
+
+/* Sampling kernels used by the inverse mapping. A kernel fills 'count'
+consecutive pixels of a sink row: the homogeneous source position of pixel 'i'
+is 'origin + i * step', which is then projected on 'bg'. Positions falling
+outside 'bg' are clamped to its edges. 'bg_data' holds the rows of 'bg' from
+'bg_top' on, which are the only ones sampled: pixel (x, y) of 'bg' is
+'bg_data[(y - bg_top) * bg_width + x]'. */
+typedef void (*row_kernel)(color *out, coord count,
+                           const double origin[3], const double step[3],
+                           const color *bg_data, coord bg_width, coord bg_height, coord bg_top);
+
+void nearest_row(color *out, coord count,
+                 const double origin[3], const double step[3],
+                 const color *bg_data, coord bg_width, coord bg_height, coord bg_top);
+
+/* Separable filters, see sample.c. */
+void bicubic_row(color *out, coord count,
+                 const double origin[3], const double step[3],
+                 const color *bg_data, coord bg_width, coord bg_height, coord bg_top);
+
+void lanczos3_row(color *out, coord count,
+                  const double origin[3], const double step[3],
+                  const color *bg_data, coord bg_width, coord bg_height, coord bg_top);
+
+/* Portable bilinear kernel. The vectorized kernels produce exactly the same
+output. */
+void bilinear_row(color *out, coord count,
+                  const double origin[3], const double step[3],
+                  const color *bg_data, coord bg_width, coord bg_height, coord bg_top);
+
+/* Fixed-point variants, within 1/200 of a pixel of the positions above, see
+sample.c. */
+void nearest_row_fixed(color *out, coord count,
+                       const double origin[3], const double step[3],
+                       const color *bg_data, coord bg_width, coord bg_height, coord bg_top);
+
+void bilinear_row_fixed(color *out, coord count,
+                        const double origin[3], const double step[3],
+                        const color *bg_data, coord bg_width, coord bg_height, coord bg_top);
+
+/* Fastest bilinear kernel supported by the running CPU for a 'bg' of the given
+size. */
+row_kernel bilinear_kernel(coord bg_width, coord bg_height);
+
+/* The pixels read around a position by 'interp' are within this distance on
+both axes. */
+coord sample_radius(interpolation interp);
+
+/* Kernel implementing 'interp', with fixed-point positions if 'fixed' and the
+interpolation has such a kernel. */
+row_kernel sample_kernel(interpolation interp, coord bg_width, coord bg_height, bool fixed);
+
+#endif
@@ -0,0 +1,553 @@
+/*
+Resident service.
+
+The jobs of perspector-batch, see manifest.c, sent by the clients of a Unix
+socket: each line of a connection is a job, answered by one line, either
+
+    OK width height seconds
+
+with the size of the result and the time spent on the request, or
+
+    ERROR message
+
+The server is started once, so that what a warp sets up outlives the
+requests: each worker keeps its buffers and threads, see workspace in
+perspector.c, and its last transform, which is reused as long as the anchors
+and the sizes do not change. A request then costs its decoding, its warp and
+its encoding; with raw pictures, which are memory-mapped, hardly more than the
+warp.
+
+Every worker accepts a connection and serves it until the client closes it or
+stays silent for IDLE_TIMEOUT seconds, so that up to -w clients are served at
+the same time, the next ones waiting in the backlog of the socket. The socket
+is only open to the user running the server. As in manifests, a job without anchors takes those of
+the previous job of its connection.
+
+The server stops on SIGINT, SIGTERM or SIGHUP, abandoning the requests in
+progress, and removes its socket.
+*/
+
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "cache.h"
+#include "image.h"
+#include "manifest.h"
+#include "perspector.h"
+
+#define STR(x) #x
+#define XSTR(x) STR(x)
+
+/* Seconds a connection may stay silent before it is closed, so that idle
+clients do not hold the workers forever. */
+#define IDLE_TIMEOUT 60
+
+static const char *interpolation_names[] =
+{
+    [INTERP_NEAREST] = "nearest",
+    [INTERP_BILINEAR] = "bilinear",
+    [INTERP_BICUBIC] = "bicubic",
+    [INTERP_LANCZOS3] = "lanczos3"
+};
+
+static const char *crop_names[] =
+{
+    [CROP_ENLARGE] = "enlarge",
+    [CROP_SHRINK] = "shrink",
+    [CROP_KEEP] = "keep",
+    [CROP_BIGGEST] = "biggest"
+};
+
+static const char *backend_names[] =
+{
+    [BACKEND_CPU] = "cpu",
+    [BACKEND_GPU] = "gpu"
+};
+
+static const char *mapping_names[] =
+{
+    [MAP_INVERSE] = "inverse",
+    [MAP_FORWARD] = "forward"
+};
+
+/* Index of 'name' in 'names', or -1. */
+static int lookup(const char *name, const char **names, size_t count)
+{
+    size_t i;
+    for (i = 0; i < count; i++)
+    {
+        if (!strcmp(name, names[i]))
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static void usage(const char *name)
+{
+    printf("Usage: %s [OPTIONS] SOCKET\n\n", name);
+    puts("Rectify the pictures of the jobs sent to the Unix socket SOCKET, one per line.\n");
+    puts("Options:");
+    puts("  -b BACKEND Where to warp: cpu (default) or gpu, which falls back to the CPU");
+    puts("             when no GPU is found. JSON jobs may choose theirs.");
+    puts("  -c CROP    Part of the picture to keep: enlarge (default) or shrink to fit the");
+    puts("             anchors, keep the whole picture, or its biggest rectangle.");
+    puts("  -f         Compute positions in fixed point, for CPUs with slow floating");
+    puts("             point. Nearest and bilinear interpolations only.");
+    puts("  -h         Print this help.");
+    puts("  -i INTERP  Interpolation: nearest, bilinear (default), bicubic or lanczos3.");
+    puts("  -m MAP     Mapping: inverse (default) or forward.");
+    puts("  -t N       Number of threads per picture, 0 for one per processor. By default");
+    puts("             the processors are shared among the workers.");
+    puts("  -v         Print the jobs as they are done, with their time.");
+    puts("  -V         Print version.");
+    puts("  -w N       Number of workers, i.e. of clients served at once (default 1).");
+    puts("  -z SIZE    Shrink the results to fit in SIZE x SIZE pixels, sampling halvings");
+    puts("             of the pictures to avoid aliasing.");
+}
+
+static void version(void)
+{
+    printf("perspector-server %s\n", XSTR(VERSION));
+    printf("Copyright © %s %s\n", XSTR(YEAR), XSTR(AUTHORS));
+}
+
+/* Shared by the workers. */
+typedef struct
+{
+    options opts;
+    crop crop;
+    /* Largest side of the results, 0 for no limit. */
+    coord size;
+    bool verbose;
+    int listener;
+} server;
+
+/* What a worker keeps from one request to the next. */
+typedef struct
+{
+    const server *srv;
+    workspace *ws;
+    cache cache;
+    pthread_t thread;
+} worker;
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Rectify the picture of 'j' and save it, 'last' being the anchors of the
+previous job of the connection. Return NULL on success, with the size of the
+result, or the error. */
+static const char *run_job(worker *w, job *j, pixelset *last, coord *width, coord *height)
+{
+    const server *srv = w->srv;
+    const char *error = NULL;
+
+    if (j->anchors.count)
+    {
+        *last = j->anchors;
+    }
+    else if (last->count)
+    {
+        j->anchors = *last;
+    }
+    else
+    {
+        return "Missing anchors.";
+    }
+
+    image bg, sink;
+    if (!image_load(&bg, j->input, &error))
+    {
+        return error;
+    }
+    options opts = srv->opts;
+    if (!sink_geometry(&j->anchors, j->ratio, srv->crop, bg.width, bg.height, width, height, &opts.placement))
+    {
+        image_free(&bg);
+        return srv->crop == CROP_ENLARGE ? "Anchors configuration is not usable."
+               : "The picture cannot be cropped this way.";
+    }
+    sink_fit(width, height, &opts.placement, srv->size, srv->size);
+    if (j->has_backend)
+    {
+        opts.backend = j->backend;
+    }
+    if (!image_create_output(&sink, j->output, *width, *height, &error))
+    {
+        image_free(&bg);
+        return error;
+    }
+
+    bool reused;
+    transform *tr = cache_transform(&w->cache, &j->anchors, *width, *height, bg.width, bg.height, &opts, &reused);
+    bool status = tr && transform_apply_in(tr, w->ws, sink.data, bg.data);
+    image_free(&bg);
+    if (!status)
+    {
+        /* Requests are never cancelled: a warp with a transform only fails
+        when memory runs out. */
+        image_free(&sink);
+        return tr ? "Not enough memory to warp the picture." : "Anchors configuration is not usable.";
+    }
+    image_save(&sink, j->output, &error);
+    image_free(&sink);
+    return error;
+}
+
+/* Answer the jobs of connection 'fd' until the client closes it or stays idle
+for IDLE_TIMEOUT seconds. */
+static void serve(worker *w, int fd)
+{
+    struct timeval timeout = { .tv_sec = IDLE_TIMEOUT };
+    if (setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof timeout))
+    {
+        fprintf(stderr, "Cannot set the timeout of the connection: %s\n", strerror(errno));
+    }
+    int out_fd = dup(fd);
+    FILE *in = fdopen(fd, "r");
+    FILE *out = out_fd >= 0 ? fdopen(out_fd, "w") : NULL;
+    if (!in || !out)
+    {
+        fprintf(stderr, "Cannot open the connection: %s\n", strerror(errno));
+        if (in)
+        {
+            fclose(in);
+        }
+        else
+        {
+            close(fd);
+        }
+        if (out)
+        {
+            fclose(out);
+        }
+        else if (out_fd >= 0)
+        {
+            close(out_fd);
+        }
+        return;
+    }
+
+    char *line = NULL;
+    size_t size = 0;
+    pixelset last = { .count = 0 };
+    while (getline(&line, &size, in) != -1)
+    {
+        job j;
+        const char *error;
+        parse_status status = job_parse(&j, line, &error);
+        if (status == PARSE_SKIP)
+        {
+            continue;
+        }
+
+        double start = now();
+        coord width = 0, height = 0;
+        if (status == PARSE_OK)
+        {
+            error = run_job(w, &j, &last, &width, &height);
+        }
+        double seconds = now() - start;
+        if (error)
+        {
+            fprintf(out, "ERROR %s\n", error);
+        }
+        else
+        {
+            fprintf(out, "OK %" PRId32 " %" PRId32 " %.3f\n", width, height, seconds);
+        }
+
+        if (status == PARSE_OK)
+        {
+            if (w->srv->verbose)
+            {
+                if (error)
+                {
+                    printf("%s: %s\n", j.input, error);
+                }
+                else
+                {
+                    printf("%s -> %s (%.3f s)\n", j.input, j.output, seconds);
+                }
+                fflush(stdout);
+            }
+            job_free(&j);
+        }
+        /* The client is gone. */
+        if (fflush(out) == EOF)
+        {
+            break;
+        }
+    }
+    free(line);
+    fclose(in);
+    fclose(out);
+}
+
+static void *worker_thread(void *data)
+{
+    worker *w = data;
+    for (;;)
+    {
+        int fd = accept(w->srv->listener, NULL, NULL);
+        if (fd >= 0)
+        {
+            serve(w, fd);
+        }
+        else if (errno != EINTR && errno != ECONNABORTED)
+        {
+            /* Running out of descriptors is temporary. */
+            fprintf(stderr, "Cannot accept connections: %s\n", strerror(errno));
+            sleep(1);
+        }
+    }
+    return NULL;
+}
+
+/* Return the socket listening on 'path', or -1. A socket left by a server that
+is no longer running is replaced. The socket is only accessible to its owner,
+whatever the umask, since its clients read and write files as the server. */
+static int listen_on(const char *path)
+{
+    struct sockaddr_un address;
+    if (strlen(path) >= sizeof address.sun_path)
+    {
+        fprintf(stderr, "Socket path too long '%s'.\n", path);
+        return -1;
+    }
+    memset(&address, 0, sizeof address);
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+    {
+        perror("socket");
+        return -1;
+    }
+    struct stat st;
+    if (!stat(path, &st) && S_ISSOCK(st.st_mode))
+    {
+        if (!connect(fd, (struct sockaddr *)&address, sizeof address))
+        {
+            fprintf(stderr, "%s: A server is already running.\n", path);
+            close(fd);
+            return -1;
+        }
+        unlink(path);
+    }
+    /* No thread runs yet: changing the umask affects nothing else. */
+    mode_t mask = umask(0177);
+    int status = bind(fd, (struct sockaddr *)&address, sizeof address);
+    umask(mask);
+    if (status || listen(fd, SOMAXCONN))
+    {
+        perror(path);
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/* Parse a strictly positive number of workers. */
+static bool parse_count(const char *arg, unsigned int *count)
+{
+    char *end;
+    unsigned long n = strtoul(arg, &end, 10);
+    if (*arg == '\0' || *end != '\0' || n == 0 || n > 1024)
+    {
+        fprintf(stderr, "Wrong count '%s'.\n", arg);
+        return false;
+    }
+    *count = n;
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    server srv = { .crop = CROP_ENLARGE, .size = 0, .verbose = false, .listener = -1 };
+    options_init(&srv.opts);
+    unsigned int workers = 1;
+    bool threads_set = false;
+
+    int c;
+    while ((c = getopt(argc, argv, "b:c:fhi:m:t:vVw:z:")) != -1)
+    {
+        switch (c)
+        {
+        case 'b':
+            c = lookup(optarg, backend_names, sizeof backend_names / sizeof backend_names[0]);
+            if (c < 0)
+            {
+                fprintf(stderr, "Unknown backend '%s'.\n", optarg);
+                return EXIT_FAILURE;
+            }
+            srv.opts.backend = c;
+            break;
+        case 'c':
+            c = lookup(optarg, crop_names, sizeof crop_names / sizeof crop_names[0]);
+            if (c < 0)
+            {
+                fprintf(stderr, "Unknown crop '%s'.\n", optarg);
+                return EXIT_FAILURE;
+            }
+            srv.crop = c;
+            /* The picture is surrounded with the background color. */
+            srv.opts.outside = c == CROP_KEEP ? OUTSIDE_BACKGROUND : OUTSIDE_EXTEND;
+            break;
+        case 'f':
+            srv.opts.fixed_point = true;
+            break;
+        case 'h':
+            usage(argv[0]);
+            return EXIT_SUCCESS;
+        case 'i':
+            c = lookup(optarg, interpolation_names, sizeof interpolation_names / sizeof interpolation_names[0]);
+            if (c < 0)
+            {
+                fprintf(stderr, "Unknown interpolation '%s'.\n", optarg);
+                return EXIT_FAILURE;
+            }
+            srv.opts.interpolation = c;
+            break;
+        case 'm':
+            c = lookup(optarg, mapping_names, sizeof mapping_names / sizeof mapping_names[0]);
+            if (c < 0)
+            {
+                fprintf(stderr, "Unknown mapping '%s'.\n", optarg);
+                return EXIT_FAILURE;
+            }
+            srv.opts.mapping = c;
+            break;
+        case 't':
+        {
+            char *end;
+            unsigned long threads = strtoul(optarg, &end, 10);
+            if (*optarg == '\0' || *end != '\0' || threads > 1024)
+            {
+                fprintf(stderr, "Wrong number of threads '%s'.\n", optarg);
+                return EXIT_FAILURE;
+            }
+            srv.opts.threads = threads;
+            threads_set = true;
+            break;
+        }
+        case 'v':
+            srv.verbose = true;
+            break;
+        case 'V':
+            version();
+            return EXIT_SUCCESS;
+        case 'w':
+            if (!parse_count(optarg, &workers))
+            {
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'z':
+        {
+            char *end;
+            unsigned long size = strtoul(optarg, &end, 10);
+            if (*optarg == '\0' || *end != '\0' || size == 0 || size > COORD_MAX)
+            {
+                fprintf(stderr, "Wrong size '%s'.\n", optarg);
+                return EXIT_FAILURE;
+            }
+            srv.size = size;
+            srv.opts.mipmap = true;
+            break;
+        }
+        default:
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (argc - optind != 1)
+    {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    const char *path = argv[optind];
+
+    /* Share the processors among the workers. */
+    if (!threads_set && workers > 1)
+    {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        srv.opts.threads = cpus > workers ? cpus / workers : 1;
+    }
+
+    /* Clients closing their connection early must not kill the server, and
+    the stop signals are only received by the main thread, which waits for
+    them below. */
+    signal(SIGPIPE, SIG_IGN);
+    sigset_t stop;
+    sigemptyset(&stop);
+    sigaddset(&stop, SIGINT);
+    sigaddset(&stop, SIGTERM);
+    sigaddset(&stop, SIGHUP);
+    pthread_sigmask(SIG_BLOCK, &stop, NULL);
+
+    srv.listener = listen_on(path);
+    if (srv.listener < 0)
+    {
+        return EXIT_FAILURE;
+    }
+
+    worker *pool = malloc(workers * sizeof *pool);
+    if (!pool)
+    {
+        fprintf(stderr, "Cannot allocate the workers.\n");
+        unlink(path);
+        return EXIT_FAILURE;
+    }
+    unsigned int i, started = 0;
+    for (i = 0; i < workers; i++)
+    {
+        worker *w = &pool[started];
+        w->srv = &srv;
+        w->ws = workspace_new();
+        memset(&w->cache, 0, sizeof w->cache);
+        if (!w->ws)
+        {
+            break;
+        }
+        if (pthread_create(&w->thread, NULL, worker_thread, w) != 0)
+        {
+            workspace_free(w->ws);
+            break;
+        }
+        started++;
+    }
+    if (!started)
+    {
+        fprintf(stderr, "Cannot start the workers.\n");
+        unlink(path);
+        return EXIT_FAILURE;
+    }
+
+    int sig;
+    sigwait(&stop, &sig);
+    /* The workers may be in the middle of a request: their memory is left to
+    the system. */
+    close(srv.listener);
+    unlink(path);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,122 @@
+/*
+Anchor tracking.
+
+For footage of a fixed camera, the anchors only drift by a few pixels between
+frames. Each anchor is followed by block matching: the square of luma around
+it in the seed frame is the reference, and in every next frame we look for the
+displacement of at most 'radius' pixels, around the previous position, whose
+square differs the least from the reference, by sum of absolute differences.
+
+The reference is never updated from the tracked frames, so errors do not add up
+over a long sequence. On ties the smallest displacement wins, and the search
+stops as soon as the reference matches exactly, so that still frames cost
+little and keep their anchors, which lets the transformation be reused.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "track.h"
+
+/* References are squares of 2 * PATCH_RADIUS + 1 pixels. */
+#define PATCH_RADIUS 8
+#define PATCH_SIZE (2 * PATCH_RADIUS + 1)
+
+struct tracker
+{
+    coord radius;
+    unsigned char references[4][PATCH_SIZE * PATCH_SIZE];
+};
+
+tracker *tracker_new(coord radius)
+{
+    tracker *t = malloc(sizeof *t);
+    if (!t)
+    {
+        fprintf(stderr, "Tracker allocation error.\n");
+        return NULL;
+    }
+    t->radius = radius;
+    return t;
+}
+
+void tracker_free(tracker *t)
+{
+    free(t);
+}
+
+static inline coord clamp(coord v, coord max)
+{
+    return v < 0 ? 0 : v > max ? max : v;
+}
+
+/* Luma of pixel (x, y) of the frame, clamped to its edges. */
+static inline unsigned char luma(const color *frame, coord width, coord height, coord x, coord y)
+{
+    const color *c = &frame[(ptrdiff_t)clamp(y, height - 1) * width + clamp(x, width - 1)];
+    return (c->red * 77 + c->green * 150 + c->blue * 29) >> 8;
+}
+
+void tracker_seed(tracker *t, const color *frame, coord width, coord height, const pixelset *anchors)
+{
+    size_t k;
+    coord x, y;
+    for (k = 0; k < 4; k++)
+    {
+        pixel a = anchors->pixels[k];
+        unsigned char *r = t->references[k];
+        for (y = -PATCH_RADIUS; y <= PATCH_RADIUS; y++)
+        {
+            for (x = -PATCH_RADIUS; x <= PATCH_RADIUS; x++)
+            {
+                *r++ = luma(frame, width, height, a.x + x, a.y + y);
+            }
+        }
+    }
+}
+
+/* Difference between 'reference' and the square around (cx, cy), or 'limit'
+if it is not smaller. */
+static unsigned long difference(const unsigned char *reference, const color *frame, coord width, coord height,
+                                coord cx, coord cy, unsigned long limit)
+{
+    unsigned long sum = 0;
+    coord x, y;
+    for (y = -PATCH_RADIUS; y <= PATCH_RADIUS && sum < limit; y++)
+    {
+        for (x = -PATCH_RADIUS; x <= PATCH_RADIUS; x++)
+        {
+            sum += abs(*reference++ - luma(frame, width, height, cx + x, cy + y));
+        }
+    }
+    return sum < limit ? sum : limit;
+}
+
+void tracker_update(tracker *t, const color *frame, coord width, coord height, pixelset *anchors)
+{
+    size_t k;
+    coord dx, dy;
+    for (k = 0; k < 4; k++)
+    {
+        pixel a = anchors->pixels[k], best = a;
+        unsigned long best_sum = difference(t->references[k], frame, width, height, a.x, a.y, (unsigned long)-1);
+        coord best_distance = 0;
+        for (dy = -t->radius; dy <= t->radius && best_sum > 0; dy++)
+        {
+            for (dx = -t->radius; dx <= t->radius && best_sum > 0; dx++)
+            {
+                coord distance = dx * dx + dy * dy;
+                /* Equal sums only win when closer, the limit keeps them. */
+                unsigned long limit = best_sum + (distance < best_distance);
+                unsigned long sum = difference(t->references[k], frame, width, height, a.x + dx, a.y + dy, limit);
+                if (sum < limit)
+                {
+                    best_sum = sum;
+                    best_distance = distance;
+                    best.x = a.x + dx;
+                    best.y = a.y + dy;
+                }
+            }
+        }
+        anchors->pixels[k] = best;
+    }
+}
@@ -0,0 +1,22 @@
+#ifndef TRACK_H
+#define TRACK_H
+
+#include "perspector.h"
+
+/* Follows anchors from frame to frame by block matching, see track.c. */
+typedef struct tracker tracker;
+
+/* Anchors move by at most 'radius' pixels on both axes between two frames.
+Return NULL if the tracker cannot be allocated. */
+tracker *tracker_new(coord radius);
+void tracker_free(tracker *t);
+
+/* Take the surroundings of 'anchors' in a 'width' x 'height' frame as the
+reference for the next frames. */
+void tracker_seed(tracker *t, const color *frame, coord width, coord height, const pixelset *anchors);
+
+/* Move 'anchors' to where the references best match in the next frame. The
+anchors only move when the match improves, so still footage keeps them. */
+void tracker_update(tracker *t, const color *frame, coord width, coord height, pixelset *anchors);
+
+#endif
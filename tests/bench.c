@@ -0,0 +1,241 @@
+/*
+Benchmark of the matrix solver, the warp and the hole fill on generated
+pictures, over a grid of sizes, perspective strengths and thread counts.
+
+Usage: bench [MAX_MEGAPIXELS]
+
+Each line is a measurement, with space-separated fields:
+	phase variant width height strength threads seconds mpix_s ns_px rss_kib
+'seconds' is the best of a few runs. Throughputs count sink pixels; for the
+matrix, 'ns_px' is the time of one solve. 'rss_kib' is the peak resident memory
+of the process so far, sizes grow so it matches the largest run. Lines starting
+with '#' are comments.
+
+The forward mapping is split into its phases from the progress reports, which
+adds a little overhead to it compared to the inverse mapping.
+*/
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include "perspector.h"
+
+bool make_transform_matrix(double transform_matrix[9], const pixelset *anchors, coord width, coord height);
+
+/* Sink sizes in megapixels. */
+static const double sizes[] = { 1, 4, 16, 100 };
+/* Fraction of the width the top edge of the anchors is shrunk by on both
+sides: 0 is a plain rectangle. */
+static const double strengths[] = { 0, 0.2, 0.4 };
+/* Size of the runs of the other variants. */
+#define VARIANT_MEGAPIXELS 4
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static long peak_rss(void) {
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	return usage.ru_maxrss;
+}
+
+static void report(const char *phase, const char *variant, coord width, coord height,
+		double strength, unsigned int threads, double seconds, double items) {
+	printf("%s %s %i %i %.2f %u %.6f %.2f %.3f %ld\n", phase, variant, width, height, strength, threads,
+		seconds, items / seconds / 1e6, seconds / items * 1e9, peak_rss());
+	fflush(stdout);
+}
+
+/* Reproducible noise over smooth gradients, so that neither the caches nor the
+filters see a flat picture. */
+static void generate(color *data, coord width, coord height) {
+	uint32_t state = 2463534242u;
+	coord x, y;
+	for (y = 0; y < height; y++) {
+		for (x = 0; x < width; x++) {
+			state ^= state << 13;
+			state ^= state >> 17;
+			state ^= state << 5;
+			color c = { (x * 255 / width + (state & 31)) & 255, (y * 255 / height + (state >> 8 & 31)) & 255,
+				(state >> 16) & 255, 255 };
+			data[(size_t)y * width + x] = c;
+		}
+	}
+}
+
+static pixelset make_anchors(coord width, coord height, double strength) {
+	coord inset = strength * width;
+	pixelset anchors = { .pixels = { { inset, 0 }, { width - 1 - inset, 0 }, { width - 1, height - 1 }, { 0, height - 1 } }, .count = 4 };
+	return anchors;
+}
+
+/* Best time of a few runs, fewer for large pictures. */
+static int runs(coord width, coord height) {
+	double megapixels = (double)width * height / 1e6;
+	return megapixels <= 4 ? 3 : megapixels <= 16 ? 2 : 1;
+}
+
+/* Records the end of each pass of a warp. */
+#define MAX_PASSES 4
+typedef struct {
+	size_t height;
+	int passes;
+	double ends[MAX_PASSES];
+} pass_timer;
+
+static bool time_passes(void *data, size_t done, size_t total) {
+	pass_timer *pt = data;
+	(void)total;
+	while (pt->passes < MAX_PASSES && done >= (size_t)(pt->passes + 1) * pt->height) {
+		pt->ends[pt->passes++] = now();
+	}
+	return true;
+}
+
+static void bench_matrix(void) {
+	enum { COUNT = 100000 };
+	pixelset anchors = make_anchors(4000, 3000, 0.2);
+	double m[9];
+	int i;
+	double start = now();
+	for (i = 0; i < COUNT; i++) {
+		anchors.pixels[0].x = 800 + i % 7;
+		make_transform_matrix(m, &anchors, 4000, 3000);
+	}
+	report("matrix", "closed-form", 0, 0, 0.2, 1, now() - start, COUNT);
+
+	/* The same sets, solved at once. */
+	static pixelset sets[COUNT];
+	static solution solutions[COUNT];
+	for (i = 0; i < COUNT; i++) {
+		sets[i] = anchors;
+		sets[i].pixels[0].x = 800 + i % 7;
+	}
+	start = now();
+	solve_anchors(sets, COUNT, 4000, 3000, solutions);
+	report("matrix", "batch", 0, 0, 0.2, 1, now() - start, COUNT);
+}
+
+static void bench_inverse(const char *variant, const options *opts, const color *bg, color *sink,
+		coord width, coord height, double strength, workspace *ws) {
+	pixelset anchors = make_anchors(width, height, strength);
+	transform *t = transform_new(&anchors, width, height, width, height, opts);
+	double best = 0;
+	int i;
+	for (i = 0; i < runs(width, height) && t; i++) {
+		double start = now();
+		transform_apply_in(t, ws, sink, bg);
+		double seconds = now() - start;
+		best = i == 0 || seconds < best ? seconds : best;
+	}
+	transform_free(t);
+	if (t) {
+		report("warp", variant, width, height, strength, opts->threads, best, (double)width * height);
+	}
+}
+
+/* The forward pass, then the fill passes. */
+static void bench_forward(const char *variant, options opts, const color *bg, color *sink,
+		coord width, coord height, double strength, workspace *ws) {
+	pixelset anchors = make_anchors(width, height, strength);
+	pass_timer pt;
+	opts.mapping = MAP_FORWARD;
+	opts.progress = time_passes;
+	opts.progress_data = &pt;
+	transform *t = transform_new(&anchors, width, height, width, height, &opts);
+	double best_forward = 0, best_fill = 0;
+	int i;
+	for (i = 0; i < runs(width, height) && t; i++) {
+		pt.height = height;
+		pt.passes = 0;
+		double start = now();
+		transform_apply_in(t, ws, sink, bg);
+		double end = now();
+		double forward = pt.passes > 0 ? pt.ends[0] - start : end - start;
+		best_forward = i == 0 || forward < best_forward ? forward : best_forward;
+		best_fill = i == 0 || end - start - forward < best_fill ? end - start - forward : best_fill;
+	}
+	transform_free(t);
+	if (t) {
+		report("forward", variant, width, height, strength, opts.threads, best_forward, (double)width * height);
+		report("fill", variant, width, height, strength, opts.threads, best_fill, (double)width * height);
+	}
+}
+
+int main(int argc, char **argv) {
+	double max_megapixels = argc > 1 ? atof(argv[1]) : 100;
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	unsigned int threads[8];
+	size_t thread_count = 0, i, j, k;
+	unsigned int n;
+
+	/* 1, 2, 4... and all the processors. */
+	for (n = 1; n < cpus && thread_count < 7; n *= 2) {
+		threads[thread_count++] = n;
+	}
+	threads[thread_count++] = cpus > 0 ? cpus : 1;
+
+	printf("# phase variant width height strength threads seconds mpix_s ns_px rss_kib\n");
+	bench_matrix();
+
+	workspace *ws = workspace_new();
+	for (i = 0; i < sizeof sizes / sizeof sizes[0] && sizes[i] <= max_megapixels && ws; i++) {
+		/* 4:3 pictures. */
+		coord height = sqrt(sizes[i] * 1e6 * 3 / 4);
+		coord width = height * 4 / 3;
+		color *bg = malloc((size_t)width * height * sizeof (color));
+		color *sink = malloc((size_t)width * height * sizeof (color));
+		if (!bg || !sink) {
+			fprintf(stderr, "Cannot allocate %gMP pictures.\n", sizes[i]);
+			free(bg);
+			free(sink);
+			break;
+		}
+		generate(bg, width, height);
+
+		for (j = 0; j < sizeof strengths / sizeof strengths[0]; j++) {
+			for (k = 0; k < thread_count; k++) {
+				options opts;
+				options_init(&opts);
+				opts.threads = threads[k];
+				bench_inverse("bilinear", &opts, bg, sink, width, height, strengths[j], ws);
+				bench_forward("distance", opts, bg, sink, width, height, strengths[j], ws);
+				opts.fill = FILL_SQUARE;
+				bench_forward("square", opts, bg, sink, width, height, strengths[j], ws);
+			}
+		}
+
+		if (sizes[i] == VARIANT_MEGAPIXELS) {
+			static const struct {
+				const char *name;
+				interpolation interp;
+				bool fixed;
+			} variants[] = {
+				{ "nearest", INTERP_NEAREST, false },
+				{ "bicubic", INTERP_BICUBIC, false },
+				{ "lanczos3", INTERP_LANCZOS3, false },
+				{ "nearest-fixed", INTERP_NEAREST, true },
+				{ "bilinear-fixed", INTERP_BILINEAR, true }
+			};
+			for (j = 0; j < sizeof variants / sizeof variants[0]; j++) {
+				options opts;
+				options_init(&opts);
+				opts.interpolation = variants[j].interp;
+				opts.fixed_point = variants[j].fixed;
+				opts.threads = threads[thread_count - 1];
+				bench_inverse(variants[j].name, &opts, bg, sink, width, height, strengths[1], ws);
+			}
+		}
+
+		free(bg);
+		free(sink);
+	}
+	workspace_free(ws);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,496 @@
+/*
+Fuzzing of the anchor solver on generated anchor sets, random and nearly
+degenerate: projectable(), which checks the anchors and dispatches them over
+the corners of the sink, then the solvers of the matrix.
+
+Usage: fuzz [SETS]
+
+SETS sets of each family are generated, 200000 by default, each for a sink of
+random size. For every set we check that
+
+- projectable() gives the same answer whatever the order of the anchors;
+- the dispatched solver, i.e. the closed form or else the SVD, maps the
+  anchors to the corners of the sink within TOLERANCE whenever it solves a set;
+  it refuses the ones with 3 anchors on a line, which no homography maps to a
+  rectangle, and only those unless built without GSL: the closed form alone
+  then refuses the ill-conditioned sets too, which is expected and counted
+  apart;
+- solve_anchors() gives exactly the results of make_transform_matrix(), on
+  one thread and on THREADS.
+
+The closed form and the SVD are also compared on the sets both solve, by the
+distance between their images of the anchors and of their barycenter. Then
+every solver is timed on the sets of the family.
+
+Each line is a measurement, with space-separated fields:
+	check family sets accepted solved closed svd refused error_closed error_svd gap failures
+	speed family solver solves seconds solves_s ns_solve
+'accepted' counts the sets projectable() accepts, 'solved' those the dispatched
+solver solves, 'closed' and 'svd' those each solver alone solves among the
+solved ones, 'refused' the sets without 3 anchors on a line the build
+without GSL refuses. Errors and gap are the maxima, in pixels of the sink. The exit status is non-zero if any check failed.
+*/
+
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "perspector.h"
+
+/* Forward declarations of private functions being tested. */
+bool projectable(rect *result, const pixelset *anchors);
+bool make_transform_matrix(double transform_matrix[9], const pixelset *anchors, coord width, coord height);
+bool closed_form_matrix(double transform_matrix[9], const rect *vertices, coord width, coord height);
+#ifndef NO_GSL
+bool svd_matrix(double transform_matrix[9], const rect *vertices, coord width, coord height);
+#endif
+
+/* Largest reprojection error of the dispatched solver, relative to the size of
+the sink. */
+#define TOLERANCE 1e-6
+#define THREADS 4
+/* Largest side of the generated sinks and frames. */
+#define SIZE 8192
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint32_t next(uint32_t *state) {
+	*state ^= *state << 13;
+	*state ^= *state >> 17;
+	*state ^= *state << 5;
+	return *state;
+}
+
+/* Uniform in [lo, hi]. */
+static coord uniform(uint32_t *state, coord lo, coord hi) {
+	return lo + (coord)(next(state) % ((uint32_t)(hi - lo) + 1));
+}
+
+static pixel random_pixel(uint32_t *state, coord lo, coord hi) {
+	pixel p = { uniform(state, lo, hi), uniform(state, lo, hi) };
+	return p;
+}
+
+/* Anchors anywhere in the frame. */
+static void random_set(uint32_t *state, pixelset *set) {
+	size_t i;
+	for (i = 0; i < 4; i++) {
+		set->pixels[i] = random_pixel(state, 0, SIZE - 1);
+	}
+}
+
+/* A picture taken nearly face on: a rectangle, each corner off by a few
+pixels. */
+static void rectangle_set(uint32_t *state, pixelset *set) {
+	coord x = uniform(state, 0, SIZE / 2), y = uniform(state, 0, SIZE / 2);
+	coord w = uniform(state, 16, SIZE / 2), h = uniform(state, 16, SIZE / 2);
+	pixel corners[4] = { { x, y }, { x + w, y }, { x + w, y + h }, { x, y + h } };
+	size_t i;
+	for (i = 0; i < 4; i++) {
+		set->pixels[i].x = corners[i].x + uniform(state, -3, 3);
+		set->pixels[i].y = corners[i].y + uniform(state, -3, 3);
+	}
+}
+
+/* A strong perspective: one side of a rectangle shrunk towards its middle, as
+a facade seen from below. */
+static void perspective_set(uint32_t *state, pixelset *set) {
+	coord x = uniform(state, 0, SIZE / 2), y = uniform(state, 0, SIZE / 2);
+	coord w = uniform(state, 16, SIZE / 2), h = uniform(state, 16, SIZE / 2);
+	coord shrink = uniform(state, 0, w / 2 - 1);
+	pixel corners[4] = { { x, y }, { x + w, y }, { x + w - shrink, y + h }, { x + shrink, y + h } };
+	size_t i;
+	/* Any side may be the shrunk one. */
+	bool transpose = next(state) & 1;
+	for (i = 0; i < 4; i++) {
+		set->pixels[i].x = transpose ? corners[i].y : corners[i].x;
+		set->pixels[i].y = transpose ? corners[i].x : corners[i].y;
+	}
+}
+
+/* 3 anchors on a line, or off it by a pixel. */
+static void collinear_set(uint32_t *state, pixelset *set) {
+	pixel a = random_pixel(state, 0, SIZE / 2);
+	coord dx = uniform(state, -SIZE / 4, SIZE / 4), dy = uniform(state, -SIZE / 4, SIZE / 4);
+	set->pixels[0] = a;
+	set->pixels[1].x = a.x + dx + uniform(state, -1, 1);
+	set->pixels[1].y = a.y + dy + uniform(state, -1, 1);
+	set->pixels[2].x = a.x + 2 * dx;
+	set->pixels[2].y = a.y + 2 * dy;
+	set->pixels[3] = random_pixel(state, 0, SIZE - 1);
+}
+
+/* 2 anchors on the same pixel or next to each other. */
+static void close_set(uint32_t *state, pixelset *set) {
+	random_set(state, set);
+	set->pixels[1].x = set->pixels[0].x + uniform(state, -1, 1);
+	set->pixels[1].y = set->pixels[0].y + uniform(state, -1, 1);
+}
+
+/* A long and thin quadrilateral, at most 3 pixels high. */
+static void sliver_set(uint32_t *state, pixelset *set) {
+	coord x = uniform(state, 0, SIZE / 2), y = uniform(state, 0, SIZE - 4);
+	coord w = uniform(state, 16, SIZE / 2);
+	set->pixels[0].x = x;
+	set->pixels[0].y = y;
+	set->pixels[1].x = x + w;
+	set->pixels[1].y = y + uniform(state, 0, 1);
+	set->pixels[2].x = x + w + uniform(state, -1, 1);
+	set->pixels[2].y = y + uniform(state, 2, 3);
+	set->pixels[3].x = x + uniform(state, -1, 1);
+	set->pixels[3].y = y + uniform(state, 1, 3);
+}
+
+/* Anchors far out of the frame, as a GUI may let them be. */
+static void far_set(uint32_t *state, pixelset *set) {
+	size_t i;
+	for (i = 0; i < 4; i++) {
+		set->pixels[i] = random_pixel(state, -1000000, 1000000);
+	}
+}
+
+static const struct {
+	const char *name;
+	void (*generate)(uint32_t *state, pixelset *set);
+} families[] = {
+	{ "random", random_set },
+	{ "rectangle", rectangle_set },
+	{ "perspective", perspective_set },
+	{ "collinear", collinear_set },
+	{ "close", close_set },
+	{ "sliver", sliver_set },
+	{ "far", far_set },
+};
+
+/* Largest distance between the images of the vertices of 'r' by 'm' and the
+corners of a 'width' x 'height' sink. */
+static double reprojection(const double m[9], const rect *r, coord width, coord height) {
+	const pixel *vertices = &r->bl;
+	const double corners[4][2] = { { 0, 0 }, { width, 0 }, { width, height }, { 0, height } };
+	double error = 0;
+	int i;
+	for (i = 0; i < 4; i++) {
+		double u = m[0] * vertices[i].x + m[1] * vertices[i].y + m[2];
+		double v = m[3] * vertices[i].x + m[4] * vertices[i].y + m[5];
+		double w = m[6] * vertices[i].x + m[7] * vertices[i].y + m[8];
+		double e = hypot(u / w - corners[i][0], v / w - corners[i][1]);
+		/* NaN when 'w' vanishes. */
+		error = e > error || e != e ? e : error;
+	}
+	return error;
+}
+
+#ifndef NO_GSL
+/* Largest distance between the images by 'a' and 'b' of the vertices of 'r'
+and of their barycenter. */
+static double gap(const double a[9], const double b[9], const rect *r) {
+	const pixel *vertices = &r->bl;
+	double points[5][2];
+	double distance = 0;
+	int i;
+	points[4][0] = points[4][1] = 0;
+	for (i = 0; i < 4; i++) {
+		points[i][0] = vertices[i].x;
+		points[i][1] = vertices[i].y;
+		points[4][0] += vertices[i].x / 4.0;
+		points[4][1] += vertices[i].y / 4.0;
+	}
+	for (i = 0; i < 5; i++) {
+		double x = points[i][0], y = points[i][1];
+		double aw = a[6] * x + a[7] * y + a[8], bw = b[6] * x + b[7] * y + b[8];
+		double d = hypot((a[0] * x + a[1] * y + a[2]) / aw - (b[0] * x + b[1] * y + b[2]) / bw,
+			(a[3] * x + a[4] * y + a[5]) / aw - (b[3] * x + b[4] * y + b[5]) / bw);
+		distance = d > distance || d != d ? d : distance;
+	}
+	return distance;
+}
+#endif
+
+/* Magnitude and sign of a * b, exact: the factors are differences of coords,
+below 2^32, so that the magnitude fits 64 bits. */
+static uint64_t magnitude(int64_t a, int64_t b, int *sign) {
+	*sign = ((a > 0) - (a < 0)) * ((b > 0) - (b < 0));
+	return (a < 0 ? -(uint64_t)a : (uint64_t)a) * (b < 0 ? -(uint64_t)b : (uint64_t)b);
+}
+
+/* Whether 3 vertices of 'r' are on a line, in exact integers. */
+static bool flat(const rect *r) {
+	const pixel *p = &r->bl;
+	int i;
+	for (i = 0; i < 4; i++) {
+		pixel a = p[(i + 3) % 4], b = p[i], c = p[(i + 1) % 4];
+		int sign1, sign2;
+		uint64_t left = magnitude((int64_t)b.x - a.x, (int64_t)c.y - a.y, &sign1);
+		uint64_t right = magnitude((int64_t)b.y - a.y, (int64_t)c.x - a.x, &sign2);
+		if (sign1 == sign2 && left == right) {
+			return true;
+		}
+	}
+	return false;
+}
+
+static bool same_rect(const rect *a, const rect *b) {
+	const pixel *p = &a->bl, *q = &b->bl;
+	int i;
+	for (i = 0; i < 4; i++) {
+		if (p[i].x != q[i].x || p[i].y != q[i].y) {
+			return false;
+		}
+	}
+	return true;
+}
+
+/* The sets of a family, with the sink of each. */
+typedef struct {
+	size_t count;
+	pixelset *sets;
+	coord *widths, *heights;
+	/* Results of projectable() and make_transform_matrix(). */
+	rect *vertices;
+	solution *expected;
+	/* Results of solve_anchors(). */
+	solution *solutions;
+} sample;
+
+/* solve_anchors() takes one sink size for all its sets: sets are solved in
+runs of the same size. */
+static void solve_runs(const sample *s, size_t begin, size_t end, solution *solutions) {
+	size_t i, j;
+	for (i = begin; i < end; i = j) {
+		for (j = i + 1; j < end && s->widths[j] == s->widths[i] && s->heights[j] == s->heights[i]; j++) {
+		}
+		solve_anchors(&s->sets[i], j - i, s->widths[i], s->heights[i], &solutions[i]);
+	}
+}
+
+typedef struct {
+	const sample *sample;
+	size_t begin, end;
+	pthread_t thread;
+} slice;
+
+static void *solve_slice(void *data) {
+	slice *c = data;
+	solve_runs(c->sample, c->begin, c->end, c->sample->solutions);
+	return NULL;
+}
+
+static bool same_solutions(const sample *s) {
+	size_t i;
+	for (i = 0; i < s->count; i++) {
+		const solution *a = &s->expected[i], *b = &s->solutions[i];
+		if (a->valid != b->valid || (a->valid && (!same_rect(&a->corners, &b->corners)
+				|| memcmp(a->matrix, b->matrix, sizeof a->matrix)))) {
+			return false;
+		}
+	}
+	return true;
+}
+
+static void speed(const char *family, const char *solver, size_t solves, double seconds) {
+	printf("speed %s %s %zu %.6f %.0f %.1f\n", family, solver, solves, seconds,
+		seconds > 0 ? solves / seconds : 0, solves ? seconds / solves * 1e9 : 0);
+	fflush(stdout);
+}
+
+/* Run the checks on a family, then time its solvers. Return the number of
+failures. */
+static size_t fuzz(const char *name, void (*generate)(uint32_t *state, pixelset *set), sample *s, uint32_t *state) {
+	size_t i, accepted = 0, solved = 0, closed = 0, svd = 0, refused = 0, failures = 0;
+	double error_closed = 0, error_svd = 0, max_gap = 0;
+	double m[9];
+
+	/* Runs of a few sets share their sink so that solve_anchors() gets
+	batches. */
+	coord width = 0, height = 0;
+	for (i = 0; i < s->count; i++) {
+		if (i % 16 == 0) {
+			width = uniform(state, 16, SIZE);
+			height = uniform(state, 16, SIZE);
+		}
+		s->sets[i].count = 4;
+		generate(state, &s->sets[i]);
+		s->widths[i] = width;
+		s->heights[i] = height;
+	}
+
+	for (i = 0; i < s->count; i++) {
+		const pixelset *set = &s->sets[i];
+		coord w = s->widths[i], h = s->heights[i];
+		rect *r = &s->vertices[i];
+		solution *e = &s->expected[i];
+
+		bool ok = projectable(r, set);
+		/* Shuffle the anchors. */
+		pixelset shuffled = *set;
+		size_t j;
+		for (j = 3; j > 0; j--) {
+			size_t k = next(state) % (j + 1);
+			pixel t = shuffled.pixels[j];
+			shuffled.pixels[j] = shuffled.pixels[k];
+			shuffled.pixels[k] = t;
+		}
+		rect other;
+		bool again = projectable(&other, &shuffled);
+		if (again != ok || (again && !same_rect(r, &other))) {
+			failures++;
+			fprintf(stderr, "%s: order matters for (%i, %i) (%i, %i) (%i, %i) (%i, %i)\n", name,
+				set->pixels[0].x, set->pixels[0].y, set->pixels[1].x, set->pixels[1].y,
+				set->pixels[2].x, set->pixels[2].y, set->pixels[3].x, set->pixels[3].y);
+		}
+
+		e->valid = make_transform_matrix(e->matrix, set, w, h);
+		if (!ok) {
+			continue;
+		}
+		e->corners = *r;
+		accepted++;
+#ifdef NO_GSL
+		if (!e->valid && !flat(r)) {
+			refused++;
+		} else
+#endif
+		if (e->valid == flat(r)) {
+			failures++;
+			fprintf(stderr, "%s: %s (%i, %i) (%i, %i) (%i, %i) (%i, %i)\n", name, e->valid ? "solved" : "refused",
+				r->bl.x, r->bl.y, r->br.x, r->br.y, r->tr.x, r->tr.y, r->tl.x, r->tl.y);
+		}
+		if (!e->valid) {
+			continue;
+		}
+		solved++;
+		double error = reprojection(e->matrix, r, w, h);
+		if (!(error <= TOLERANCE * (w > h ? w : h))) {
+			failures++;
+			fprintf(stderr, "%s: error %g for (%i, %i) (%i, %i) (%i, %i) (%i, %i) on %i x %i\n", name, error,
+				r->bl.x, r->bl.y, r->br.x, r->br.y, r->tr.x, r->tr.y, r->tl.x, r->tl.y, w, h);
+		}
+
+		bool closed_form = closed_form_matrix(m, r, w, h);
+		if (closed_form) {
+			closed++;
+			error = reprojection(m, r, w, h);
+			error_closed = error > error_closed ? error : error_closed;
+		}
+#ifndef NO_GSL
+		double n[9];
+		if (svd_matrix(n, r, w, h)) {
+			svd++;
+			error = reprojection(n, r, w, h);
+			error_svd = error > error_svd ? error : error_svd;
+			if (closed_form) {
+				double d = gap(m, n, r);
+				max_gap = d > max_gap ? d : max_gap;
+			}
+		}
+#endif
+	}
+
+	/* Batches, then batches from several threads. */
+	solve_runs(s, 0, s->count, s->solutions);
+	if (!same_solutions(s)) {
+		failures++;
+		fprintf(stderr, "%s: solve_anchors() differs from make_transform_matrix()\n", name);
+	}
+	memset(s->solutions, 0, s->count * sizeof *s->solutions);
+	slice slices[THREADS];
+	for (i = 0; i < THREADS; i++) {
+		slices[i].sample = s;
+		slices[i].begin = s->count * i / THREADS;
+		slices[i].end = s->count * (i + 1) / THREADS;
+		pthread_create(&slices[i].thread, NULL, solve_slice, &slices[i]);
+	}
+	for (i = 0; i < THREADS; i++) {
+		pthread_join(slices[i].thread, NULL);
+	}
+	if (!same_solutions(s)) {
+		failures++;
+		fprintf(stderr, "%s: solve_anchors() differs on %i threads\n", name, THREADS);
+	}
+
+	printf("check %s %zu %zu %zu %zu %zu %zu %.3g %.3g %.3g %zu\n", name, s->count, accepted, solved, closed, svd,
+		refused, error_closed, error_svd, max_gap, failures);
+
+	double start = now();
+	for (i = 0; i < s->count; i++) {
+		rect r;
+		projectable(&r, &s->sets[i]);
+	}
+	speed(name, "projectable", s->count, now() - start);
+
+	start = now();
+	for (i = 0; i < s->count; i++) {
+		if (s->expected[i].valid) {
+			closed_form_matrix(m, &s->vertices[i], s->widths[i], s->heights[i]);
+		}
+	}
+	speed(name, "closed-form", solved, now() - start);
+
+#ifndef NO_GSL
+	start = now();
+	for (i = 0; i < s->count; i++) {
+		if (s->expected[i].valid) {
+			svd_matrix(m, &s->vertices[i], s->widths[i], s->heights[i]);
+		}
+	}
+	speed(name, "svd", solved, now() - start);
+#endif
+
+	start = now();
+	for (i = 0; i < s->count; i++) {
+		make_transform_matrix(m, &s->sets[i], s->widths[i], s->heights[i]);
+	}
+	speed(name, "dispatch", s->count, now() - start);
+
+	start = now();
+	solve_runs(s, 0, s->count, s->solutions);
+	speed(name, "batch", s->count, now() - start);
+	return failures;
+}
+
+int main(int argc, char **argv) {
+	size_t count = 200000;
+	if (argc > 1) {
+		char *end;
+		unsigned long n = strtoul(argv[1], &end, 10);
+		if (*argv[1] == '\0' || *end != '\0' || n == 0) {
+			fprintf(stderr, "Wrong number of sets '%s'.\n", argv[1]);
+			return EXIT_FAILURE;
+		}
+		count = n;
+	}
+
+	sample s = { .count = count };
+	s.sets = malloc(count * sizeof *s.sets);
+	s.widths = malloc(count * sizeof *s.widths);
+	s.heights = malloc(count * sizeof *s.heights);
+	s.vertices = malloc(count * sizeof *s.vertices);
+	s.expected = malloc(count * sizeof *s.expected);
+	s.solutions = malloc(count * sizeof *s.solutions);
+	if (!s.sets || !s.widths || !s.heights || !s.vertices || !s.expected || !s.solutions) {
+		fprintf(stderr, "Cannot allocate %zu sets.\n", count);
+		return EXIT_FAILURE;
+	}
+
+	printf("# check family sets accepted solved closed svd refused error_closed error_svd gap failures\n");
+	printf("# speed family solver solves seconds solves_s ns_solve\n");
+	uint32_t state = 2463534242u;
+	size_t i, failures = 0;
+	for (i = 0; i < sizeof families / sizeof families[0]; i++) {
+		failures += fuzz(families[i].name, families[i].generate, &s, &state);
+	}
+
+	free(s.sets);
+	free(s.widths);
+	free(s.heights);
+	free(s.vertices);
+	free(s.expected);
+	free(s.solutions);
+	return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
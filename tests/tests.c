@@ -1,18 +1,31 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <math.h>
+#include <png.h>
+#include <pthread.h>
 #include <string.h>
+#include <unistd.h>
 #include "perspector.h"
+#include "cache.h"
+#include "image.h"
+#include "manifest.h"
+#include "sample.h"
+#include "track.h"
 
 /* Forward declarations of private functions being tested. */
-bool projectable(rect *result, pixelset *anchors);
-bool make_transform_matrix(double transform_matrix[9], pixelset *anchors, coord width, coord height);
+bool projectable(rect *result, const pixelset *anchors);
+bool make_transform_matrix(double transform_matrix[9], const pixelset *anchors, coord width, coord height);
+bool closed_form_matrix(double transform_matrix[9], const rect *vertices, coord width, coord height);
+#ifndef NO_GSL
+bool svd_matrix(double transform_matrix[9], const rect *vertices, coord width, coord height);
+#endif
 
-static void test_transform(gsl_matrix *m, coord x, coord y) {
-	double a[3] = { x, y, 1 };
-	gsl_vector_view vec = gsl_vector_view_array(a, 3);
+static void test_transform(const double m[9], coord x, coord y) {
 	double vbuf[3];
-	gsl_vector_view check = gsl_vector_view_array(vbuf, 3);
-	gsl_blas_dgemv(CblasNoTrans, 1.0, m, &vec.vector, 0.0, &check.vector);
+	int i;
+	for (i = 0; i < 3; i++) {
+		vbuf[i] = m[3 * i] * x + m[3 * i + 1] * y + m[3 * i + 2];
+	}
 
 	/* 'round' is required since a cast floors the value. */
 	coord x2 = round(vbuf[0] / vbuf[2]);
@@ -64,6 +77,1062 @@ static void test_project(coord blx, coord bly, coord brx, coord bry, coord trx,
 		tl.x, tl.y, tlmsg);
 }
 
+/* Anchors aligned with the barycentre on opposite sides, e.g. the diagonals of a
+parallelogram, compare strictly: they are accepted as they always were, given in
+order bl, br, tr, tl, and every order of the anchors gives these corners. */
+static void test_opposed(coord blx, coord bly, coord brx, coord bry, coord trx, coord try, coord tlx, coord tly) {
+	rect expect = { { blx, bly }, { brx, bry }, { trx, try }, { tlx, tly } };
+	const pixel *corners = &expect.bl;
+	int permutation, failures = 0;
+
+	/* The 24 orders, by swapping each anchor with one of the previous ones. */
+	for (permutation = 0; permutation < 24; permutation++) {
+		int order[4] = { 0, 1, 2, 3 };
+		int k = permutation, i, t;
+		for (i = 1; i < 4; i++) {
+			int j = k % (i + 1);
+			k /= i + 1;
+			t = order[i];
+			order[i] = order[j];
+			order[j] = t;
+		}
+		pixelset anchors = { .count = 4 };
+		for (i = 0; i < 4; i++) {
+			anchors.pixels[i] = corners[order[i]];
+		}
+		rect r;
+		failures += !projectable(&r, &anchors) || memcmp(&r, &expect, sizeof r) != 0;
+	}
+	printf("%s [opposed] (%i, %i) (%i, %i) (%i, %i) (%i, %i): %i orders differ\n", failures ? "FAIL" : "OK",
+		blx, bly, brx, bry, trx, try, tlx, tly, failures);
+}
+
+/* Warp a generated picture and check that the sink is fully covered and that
+the first anchor lands on the origin. */
+static void test_warp(mapping map, hole_fill fill, const char *name) {
+	coord bg_width = 64, bg_height = 48;
+	coord sink_width = 80, sink_height = 60;
+	color bg_data[64 * 48];
+	color sink_data[80 * 60];
+	coord x, y;
+
+	for (y = 0; y < bg_height; y++) {
+		for (x = 0; x < bg_width; x++) {
+			color c = { x * 4, y * 5, (x + y) * 2, 255 };
+			bg_data[y * bg_width + x] = c;
+		}
+	}
+	memset(sink_data, 0, sizeof sink_data);
+
+	pixelset anchors = { .pixels = { { 8, 4 }, { 56, 10 }, { 60, 44 }, { 2, 40 } }, .count = 4 };
+	options opts;
+	options_init(&opts);
+	opts.mapping = map;
+	opts.fill = fill;
+	bool result = perspector_opts(sink_data, sink_width, sink_height, bg_data, bg_width, bg_height, &anchors, &opts);
+
+	coord uncovered = 0;
+	for (x = 0; x < sink_width * sink_height; x++) {
+		if (sink_data[x].alpha != 255) {
+			uncovered++;
+		}
+	}
+	color origin = bg_data[4 * bg_width + 8];
+	bool ok = result && uncovered == 0
+		&& memcmp(&sink_data[0], &origin, sizeof (color)) == 0;
+
+	printf("%s [warp %s] uncovered=%i, origin=(%i, %i, %i)\n",
+		ok ? "OK" : "FAIL", name, uncovered,
+		sink_data[0].red, sink_data[0].green, sink_data[0].blue);
+}
+
+static uint32_t xorshift(uint32_t *state) {
+	*state ^= *state << 13;
+	*state ^= *state >> 17;
+	*state ^= *state << 5;
+	return *state;
+}
+
+/* Colors varying from a pixel to the next, and repeating far apart. */
+static void fill_colors(color *data, coord count) {
+	coord i;
+	for (i = 0; i < count; i++) {
+		color c = { i * 7, i * 13, i * 3, 255 };
+		data[i] = c;
+	}
+}
+
+/* The warp most tests start from: 'bg' is FIXTURE_BG_W x FIXTURE_BG_H pixels of
+fill_colors(), the anchors stick out of it, the options are the defaults with
+'map'. The sink is usually FIXTURE_SINK_W x FIXTURE_SINK_H. */
+enum { FIXTURE_BG_W = 97, FIXTURE_BG_H = 71, FIXTURE_SINK_W = 113, FIXTURE_SINK_H = 89 };
+
+static color *fixture(mapping map, pixelset *anchors, options *opts) {
+	static color bg_data[FIXTURE_BG_W * FIXTURE_BG_H];
+	static const pixelset corners = { .pixels = { { -5, 9 }, { 90, 2 }, { 100, 66 }, { 12, 60 } }, .count = 4 };
+	fill_colors(bg_data, FIXTURE_BG_W * FIXTURE_BG_H);
+	*anchors = corners;
+	options_init(opts);
+	opts->mapping = map;
+	return bg_data;
+}
+
+/* The forward mapping must not depend on the number of threads on random
+warps, mostly shrinking 'bg': several source pixels then land on the same sink
+pixel, some of them near the boundaries of the bands. */
+static void test_threads_random(hole_fill fill, const char *name) {
+	enum { TRIALS = 300, MAX = 256 };
+	static color bg_data[MAX * MAX];
+	static color single[MAX * MAX];
+	static color multi[MAX * MAX];
+	uint32_t state = 99;
+	int trial, warps = 0, failures = 0;
+	coord i;
+
+	fill_colors(bg_data, MAX * MAX);
+	options opts;
+	options_init(&opts);
+	opts.mapping = MAP_FORWARD;
+	opts.fill = fill;
+	for (trial = 0; trial < TRIALS; trial++) {
+		coord bg_width = 32 + xorshift(&state) % (MAX - 32);
+		coord bg_height = 32 + xorshift(&state) % (MAX - 32);
+		coord sink_width = 8 + xorshift(&state) % bg_width;
+		coord sink_height = 8 + xorshift(&state) % bg_height;
+		unsigned int threads = 2 + xorshift(&state) % 15;
+		pixelset anchors = { .count = 4 };
+		for (i = 0; i < 4; i++) {
+			anchors.pixels[i].x = xorshift(&state) % bg_width;
+			anchors.pixels[i].y = xorshift(&state) % bg_height;
+		}
+		opts.threads = 1;
+		if (!perspector_opts(single, sink_width, sink_height, bg_data, bg_width, bg_height, &anchors, &opts)) {
+			continue;
+		}
+		opts.threads = threads;
+		bool ok = perspector_opts(multi, sink_width, sink_height, bg_data, bg_width, bg_height, &anchors, &opts)
+			&& memcmp(single, multi, (size_t)sink_width * sink_height * sizeof (color)) == 0;
+		failures += !ok;
+		warps++;
+	}
+	bool ok = failures == 0 && warps > TRIALS / 2;
+	printf("%s [threads random %s] %i warps, %i differ\n", ok ? "OK" : "FAIL", name, warps, failures);
+}
+
+/* The result must not depend on the number of threads. */
+static void test_threads(mapping map, const char *name) {
+	enum { BG_W = FIXTURE_BG_W, BG_H = FIXTURE_BG_H, SINK_W = FIXTURE_SINK_W, SINK_H = FIXTURE_SINK_H };
+	static color single[SINK_W * SINK_H];
+	static color multi[SINK_W * SINK_H];
+	pixelset anchors;
+	options opts;
+	color *bg_data = fixture(map, &anchors, &opts);
+
+	opts.threads = 1;
+	perspector_opts(single, SINK_W, SINK_H, bg_data, BG_W, BG_H, &anchors, &opts);
+	opts.threads = 5;
+	perspector_opts(multi, SINK_W, SINK_H, bg_data, BG_W, BG_H, &anchors, &opts);
+
+	bool ok = memcmp(single, multi, sizeof single) == 0;
+	printf("%s [threads %s] 1 vs 5 threads\n", ok ? "OK" : "FAIL", name);
+}
+
+/* The closed form must map the vertices to the corners of the sink, and agree
+with the SVD when both apply. */
+static void test_solver(coord blx, coord bly, coord brx, coord bry, coord trx, coord try, coord tlx, coord tly, bool expect) {
+	rect r = { { blx, bly }, { brx, bry }, { trx, try }, { tlx, tly } };
+	const pixel *vertices = &r.bl;
+	pixel corners[4] = { { 0, 0 }, { 640, 0 }, { 640, 480 }, { 0, 480 } };
+	double m[9];
+	int i, j;
+
+	bool solved = closed_form_matrix(m, &r, 640, 480);
+	bool ok = solved == expect;
+	for (i = 0; i < 4 && solved; i++) {
+		double v[3];
+		for (j = 0; j < 3; j++) {
+			v[j] = m[3 * j] * vertices[i].x + m[3 * j + 1] * vertices[i].y + m[3 * j + 2];
+		}
+		ok = ok && fabs(v[0] / v[2] - corners[i].x) < 1e-6 && fabs(v[1] / v[2] - corners[i].y) < 1e-6;
+	}
+#ifndef NO_GSL
+	double svd[9];
+	if (solved && svd_matrix(svd, &r, 640, 480)) {
+		/* Both have unit norm, up to the sign. */
+		double sign = m[8] * svd[8] < 0 ? -1 : 1;
+		for (i = 0; i < 9; i++) {
+			ok = ok && fabs(m[i] - sign * svd[i]) < 1e-9;
+		}
+	}
+#endif
+	printf("%s [solver] (%i, %i) (%i, %i) (%i, %i) (%i, %i)\n", ok ? "OK" : "FAIL", blx, bly, brx, bry, trx, try, tlx, tly);
+}
+
+/* Anchors which projectable() accepts but no homography maps to the corners of
+a rectangle must be refused by the dispatched solver, nearly flat ones solved. */
+static void test_flat(coord blx, coord bly, coord brx, coord bry, coord trx, coord try, coord tlx, coord tly, bool expect) {
+	pixelset anchors = { .pixels = { { blx, bly }, { brx, bry }, { trx, try }, { tlx, tly } }, .count = 4 };
+	rect r;
+	double m[9];
+	bool ok = projectable(&r, &anchors) && make_transform_matrix(m, &anchors, 640, 480) == expect;
+	printf("%s [flat] (%i, %i) (%i, %i) (%i, %i) (%i, %i)\n", ok ? "OK" : "FAIL", blx, bly, brx, bry, trx, try, tlx, tly);
+}
+
+/* A transform applied to successive frames must give the same results as
+solving each frame again. */
+static void test_reuse(mapping map, const char *name) {
+	enum { BG_W = FIXTURE_BG_W, BG_H = FIXTURE_BG_H, SINK_W = FIXTURE_SINK_W, SINK_H = FIXTURE_SINK_H };
+	static color expected[SINK_W * SINK_H];
+	static color got[SINK_W * SINK_H];
+	coord i;
+	int frame;
+	bool ok = true;
+
+	pixelset anchors;
+	options opts;
+	color *bg_data = fixture(map, &anchors, &opts);
+	opts.outside = OUTSIDE_BACKGROUND;
+	transform *t = transform_new(&anchors, SINK_W, SINK_H, BG_W, BG_H, &opts);
+
+	for (frame = 0; frame < 3 && t; frame++) {
+		for (i = 0; i < BG_W * BG_H; i++) {
+			color c = { i * 7 + frame, i * 13, i * 3 * frame, 255 };
+			bg_data[i] = c;
+		}
+		perspector_opts(expected, SINK_W, SINK_H, bg_data, BG_W, BG_H, &anchors, &opts);
+		ok = ok && transform_apply(t, got, bg_data) && memcmp(expected, got, sizeof got) == 0;
+	}
+
+	printf("%s [reuse %s] 3 frames\n", t && ok ? "OK" : "FAIL", name);
+	transform_free(t);
+}
+
+/* A workspace reused by warps of decreasing and increasing sizes must not
+change their results. */
+static void test_workspace(hole_fill fill, outside out, const char *name) {
+	enum { BG_W = FIXTURE_BG_W, BG_H = FIXTURE_BG_H, SINK_MAX = 160 };
+	static color expected[SINK_MAX * SINK_MAX];
+	static color got[SINK_MAX * SINK_MAX];
+	static const coord sizes[][2] = { { 160, 120 }, { 40, 30 }, { 113, 89 }, { 160, 160 } };
+	size_t k;
+	bool ok = true;
+
+	pixelset anchors;
+	options opts;
+	color *bg_data = fixture(MAP_FORWARD, &anchors, &opts);
+	opts.fill = fill;
+	opts.outside = out;
+	opts.threads = 3;
+	workspace *ws = workspace_new();
+
+	for (k = 0; k < sizeof sizes / sizeof sizes[0] && ws; k++) {
+		coord w = sizes[k][0], h = sizes[k][1];
+		transform *t = transform_new(&anchors, w, h, BG_W, BG_H, &opts);
+		ok = ok && t && perspector_opts(expected, w, h, bg_data, BG_W, BG_H, &anchors, &opts)
+		     && transform_apply_in(t, ws, got, bg_data)
+		     && memcmp(expected, got, w * h * sizeof (color)) == 0;
+		transform_free(t);
+	}
+
+	printf("%s [workspace %s] %zu sizes\n", ws && ok ? "OK" : "FAIL", name, k);
+	workspace_free(ws);
+}
+
+/* The threads of a workspace serve warps of any number of threads, growing
+when more are needed. */
+static void test_pool(mapping map, const char *name) {
+	enum { BG_W = FIXTURE_BG_W, BG_H = FIXTURE_BG_H, SINK_W = FIXTURE_SINK_W, SINK_H = FIXTURE_SINK_H };
+	static color single[SINK_W * SINK_H];
+	static color got[SINK_W * SINK_H];
+	static const unsigned int threads[] = { 5, 2, 8, 1, 5 };
+	size_t k;
+
+	pixelset anchors;
+	options opts;
+	color *bg_data = fixture(map, &anchors, &opts);
+	opts.threads = 1;
+	bool ok = perspector_opts(single, SINK_W, SINK_H, bg_data, BG_W, BG_H, &anchors, &opts);
+	workspace *ws = workspace_new();
+
+	for (k = 0; k < sizeof threads / sizeof threads[0] && ws; k++) {
+		opts.threads = threads[k];
+		transform *t = transform_new(&anchors, SINK_W, SINK_H, BG_W, BG_H, &opts);
+		memset(got, 0, sizeof got);
+		ok = ok && t && transform_apply_in(t, ws, got, bg_data) && memcmp(single, got, sizeof got) == 0;
+		transform_free(t);
+	}
+
+	printf("%s [pool %s] %zu thread counts\n", ws && ok ? "OK" : "FAIL", name, k);
+	workspace_free(ws);
+}
+
+/* Counts the calls, checks that progress never goes back and stops after
+'limit' calls if not 0. */
+typedef struct {
+	size_t calls, done, total, limit;
+	bool ordered;
+} progress_test;
+
+static bool count_progress(void *data, size_t done, size_t total) {
+	progress_test *pt = data;
+	pt->ordered = pt->ordered && done >= pt->done && done <= total && (!pt->total || total == pt->total);
+	pt->done = done;
+	pt->total = total;
+	pt->calls++;
+	return !pt->limit || pt->calls < pt->limit;
+}
+
+/* Progress must reach the total without changing the result, and returning
+false must stop the warp. */
+static void test_progress(mapping map, const char *name) {
+	/* A tall sink, for many bands. */
+	enum { BG_W = FIXTURE_BG_W, BG_H = FIXTURE_BG_H, SINK_W = FIXTURE_SINK_W, SINK_H = 389 };
+	static color expected[SINK_W * SINK_H];
+	static color got[SINK_W * SINK_H];
+
+	pixelset anchors;
+	options opts;
+	color *bg_data = fixture(map, &anchors, &opts);
+	opts.threads = 3;
+	perspector_opts(expected, SINK_W, SINK_H, bg_data, BG_W, BG_H, &anchors, &opts);
+
+	progress_test pt = { .ordered = true };
+	opts.progress = count_progress;
+	opts.progress_data = &pt;
+	bool ok = perspector_opts(got, SINK_W, SINK_H, bg_data, BG_W, BG_H, &anchors, &opts)
+	          && memcmp(expected, got, sizeof got) == 0
+	          && pt.ordered && pt.calls > 1 && pt.done == pt.total;
+
+	progress_test cancel = { .ordered = true, .limit = 2 };
+	opts.progress_data = &cancel;
+	ok = ok && !perspector_opts(got, SINK_W, SINK_H, bg_data, BG_W, BG_H, &anchors, &opts)
+	     && cancel.done < cancel.total;
+
+	printf("%s [progress %s] %zu calls\n", ok ? "OK" : "FAIL", name, pt.calls);
+}
+
+/* Stats do not change the result nor depend on the number of threads. */
+static void test_stats(mapping map, hole_fill fill, const char *name) {
+	/* Taller than 'bg', for holes. */
+	enum { BG_W = FIXTURE_BG_W, BG_H = FIXTURE_BG_H, SINK_W = FIXTURE_SINK_W, SINK_H = 189 };
+	static color expected[SINK_W * SINK_H];
+	static color got[SINK_W * SINK_H];
+
+	pixelset anchors;
+	options opts;
+	color *bg_data = fixture(map, &anchors, &opts);
+	opts.fill = fill;
+	opts.threads = 1;
+	perspector_opts(expected, SINK_W, SINK_H, bg_data, BG_W, BG_H, &anchors, &opts);
+
+	stats one, three;
+	opts.stats = &one;
+	bool ok = perspector_opts(got, SINK_W, SINK_H, bg_data, BG_W, BG_H, &anchors, &opts)
+	          && memcmp(expected, got, sizeof got) == 0;
+	opts.stats = &three;
+	opts.threads = 3;
+	ok = ok && perspector_opts(got, SINK_W, SINK_H, bg_data, BG_W, BG_H, &anchors, &opts);
+
+	uint64_t total = map == MAP_FORWARD ? BG_W * BG_H : SINK_W * SINK_H;
+	ok = ok && one.transformed == three.transformed && one.holes == three.holes
+	     && one.radius_max == three.radius_max && fabs(one.radius_mean - three.radius_mean) < 1e-9
+	     && one.transformed + one.discarded == total && one.transformed > 0
+	     && (map == MAP_FORWARD ? one.holes > 0 && one.holes < SINK_W * SINK_H : one.holes == 0)
+	     && one.radius_max >= one.radius_mean && one.solve_time >= 0 && one.map_time >= 0 && one.fill_time >= 0;
+
+	printf("%s [stats %s] %llu transformed, %llu discarded, %llu holes, radius %g/%g\n", ok ? "OK" : "FAIL", name,
+		(unsigned long long)one.transformed, (unsigned long long)one.discarded, (unsigned long long)one.holes,
+		one.radius_mean, one.radius_max);
+}
+
+/* The GPU backend gives the CPU result when it falls back, and nearly the same
+one otherwise, on a smooth picture. Unsupported interpolations stay on the CPU. */
+static void test_backend(interpolation interp, outside out, const char *name) {
+	enum { BG_W = 97, BG_H = 71, SINK_W = 113, SINK_H = 89 };
+	static color bg_data[BG_W * BG_H];
+	static color expected[SINK_W * SINK_H];
+	static color got[SINK_W * SINK_H];
+	coord x, y, i;
+	int diff = 0;
+
+	for (y = 0; y < BG_H; y++) {
+		for (x = 0; x < BG_W; x++) {
+			color c = { x * 2, y * 3, x + y, 255 };
+			bg_data[y * BG_W + x] = c;
+		}
+	}
+	pixelset anchors = { .pixels = { { -5, 9 }, { 90, 2 }, { 100, 66 }, { 12, 60 } }, .count = 4 };
+	options opts;
+	options_init(&opts);
+	opts.interpolation = interp;
+	opts.outside = out;
+	bool ok = perspector_opts(expected, SINK_W, SINK_H, bg_data, BG_W, BG_H, &anchors, &opts);
+
+	stats st;
+	opts.backend = BACKEND_GPU;
+	opts.stats = &st;
+	ok = ok && perspector_opts(got, SINK_W, SINK_H, bg_data, BG_W, BG_H, &anchors, &opts);
+	for (i = 0; i < SINK_W * SINK_H; i++) {
+		int d = abs(expected[i].blue - got[i].blue) + abs(expected[i].green - got[i].green)
+			+ abs(expected[i].red - got[i].red) + abs(expected[i].alpha - got[i].alpha);
+		diff = d > diff ? d : diff;
+	}
+	ok = ok && (st.backend == BACKEND_CPU ? diff == 0 : diff <= 8 && interp <= INTERP_BILINEAR);
+
+	printf("%s [backend %s] %s, difference %i\n", ok ? "OK" : "FAIL", name,
+		st.backend == BACKEND_GPU ? "gpu" : "cpu", diff);
+}
+
+/* Downscaling a checkerboard of single pixels gives grey with mipmaps, and
+aliasing without them. Mipmaps change nothing when the sink does not shrink
+'bg'. */
+static void test_mipmap(void) {
+	enum { BG_W = 256, BG_H = 192, SINK_W = BG_W / 4, SINK_H = BG_H / 4 };
+	static color bg_data[BG_W * BG_H];
+	static color sink_data[SINK_W * SINK_H];
+	static color expected[BG_W * BG_H];
+	static color got[BG_W * BG_H];
+	coord x, y, i;
+	int spread = 0, aliased = 0;
+
+	for (y = 0; y < BG_H; y++) {
+		for (x = 0; x < BG_W; x++) {
+			unsigned char v = (x + y) % 2 ? 255 : 0;
+			color c = { v, v, v, 255 };
+			bg_data[y * BG_W + x] = c;
+		}
+	}
+	pixelset anchors = { .pixels = { { 0, 0 }, { BG_W - 1, 10 }, { BG_W - 1, BG_H - 11 }, { 0, BG_H - 1 } }, .count = 4 };
+	options opts;
+	options_init(&opts);
+	bool ok = perspector_opts(sink_data, SINK_W, SINK_H, bg_data, BG_W, BG_H, &anchors, &opts);
+	for (i = 0; i < SINK_W * SINK_H; i++) {
+		aliased = abs(sink_data[i].red - 128) > aliased ? abs(sink_data[i].red - 128) : aliased;
+	}
+	opts.mipmap = true;
+	ok = ok && perspector_opts(sink_data, SINK_W, SINK_H, bg_data, BG_W, BG_H, &anchors, &opts);
+	for (i = 0; i < SINK_W * SINK_H; i++) {
+		spread = abs(sink_data[i].red - 128) > spread ? abs(sink_data[i].red - 128) : spread;
+	}
+
+	/* Slightly enlarged. */
+	pixelset inner = { .pixels = { { 10, 10 }, { BG_W - 10, 12 }, { BG_W - 12, BG_H - 10 }, { 12, BG_H - 12 } }, .count = 4 };
+	opts.mipmap = false;
+	ok = ok && perspector_opts(expected, BG_W, BG_H, bg_data, BG_W, BG_H, &inner, &opts);
+	opts.mipmap = true;
+	ok = ok && perspector_opts(got, BG_W, BG_H, bg_data, BG_W, BG_H, &inner, &opts)
+	     && memcmp(expected, got, sizeof got) == 0;
+
+	ok = ok && spread <= 4 && aliased > 64;
+	printf("%s [mipmap] spread %i, %i without\n", ok ? "OK" : "FAIL", spread, aliased);
+}
+
+/* Streaming callbacks over pictures in memory. */
+typedef struct {
+	const color *bg;
+	color *sink;
+	coord bg_width, sink_width;
+	coord rows_read, next_row;
+} stream_test;
+
+static bool stream_read(void *data, coord begin, coord end, color *rows) {
+	stream_test *st = data;
+	memcpy(rows, &st->bg[begin * st->bg_width], (end - begin) * st->bg_width * sizeof (color));
+	st->rows_read += end - begin;
+	return true;
+}
+
+static bool stream_write(void *data, coord begin, coord end, const color *rows) {
+	stream_test *st = data;
+	if (begin != st->next_row) {
+		return false;
+	}
+	memcpy(&st->sink[begin * st->sink_width], rows, (end - begin) * st->sink_width * sizeof (color));
+	st->next_row = end;
+	return true;
+}
+
+/* Strips must give the same result as the whole picture. */
+static void test_stream(interpolation interp, outside out, coord strip, const char *name) {
+	enum { BG_W = 97, BG_H = 171, SINK_W = 83, SINK_H = 129 };
+	static color bg_data[BG_W * BG_H];
+	static color expected[SINK_W * SINK_H];
+	static color got[SINK_W * SINK_H];
+
+	fill_colors(bg_data, BG_W * BG_H);
+	pixelset anchors = { .pixels = { { -5, 9 }, { 90, 22 }, { 100, 166 }, { 12, 140 } }, .count = 4 };
+	options opts;
+	options_init(&opts);
+	opts.interpolation = interp;
+	opts.outside = out;
+	transform *t = transform_new(&anchors, SINK_W, SINK_H, BG_W, BG_H, &opts);
+	stream_test st = { bg_data, got, BG_W, SINK_W, 0, 0 };
+
+	bool ok = t && transform_apply(t, expected, bg_data)
+		&& transform_stream(t, strip, stream_read, &st, stream_write, &st)
+		&& st.next_row == SINK_H && memcmp(expected, got, sizeof got) == 0;
+	printf("%s [stream %s] strips of %i rows, %i source rows read\n", ok ? "OK" : "FAIL", name, strip, st.rows_read);
+	transform_free(t);
+}
+
+/* Same on random transformations and strips: the positions must be rounded as
+with the whole picture, the strips ending anywhere. */
+static void test_stream_random(interpolation interp, outside out, const char *name) {
+	enum { TRIALS = 300, MAX = 160 };
+	static color bg_data[MAX * MAX];
+	static color expected[MAX * MAX];
+	static color got[MAX * MAX];
+	uint32_t state = 12345;
+	int trial, warps = 0, failures = 0;
+	coord i;
+
+	fill_colors(bg_data, MAX * MAX);
+
+	options opts;
+	options_init(&opts);
+	opts.interpolation = interp;
+	opts.outside = out;
+	for (trial = 0; trial < TRIALS; trial++) {
+		coord bg_width = 16 + xorshift(&state) % (MAX - 16);
+		coord bg_height = 16 + xorshift(&state) % (MAX - 16);
+		coord sink_width = 16 + xorshift(&state) % (MAX - 16);
+		coord sink_height = 16 + xorshift(&state) % (MAX - 16);
+		coord strip = 1 + xorshift(&state) % 64;
+		pixelset anchors = { .count = 4 };
+		for (i = 0; i < 4; i++) {
+			anchors.pixels[i].x = xorshift(&state) % bg_width;
+			anchors.pixels[i].y = xorshift(&state) % bg_height;
+		}
+		transform *t = transform_new(&anchors, sink_width, sink_height, bg_width, bg_height, &opts);
+		if (!t) {
+			continue;
+		}
+		stream_test st = { bg_data, got, bg_width, sink_width, 0, 0 };
+		bool ok = transform_apply(t, expected, bg_data)
+			&& transform_stream(t, strip, stream_read, &st, stream_write, &st)
+			&& st.next_row == sink_height
+			&& memcmp(expected, got, (size_t)sink_width * sink_height * sizeof (color)) == 0;
+		failures += !ok;
+		warps++;
+		transform_free(t);
+	}
+	bool ok = failures == 0 && warps > TRIALS / 2;
+	printf("%s [stream random %s] %i warps, %i differ\n", ok ? "OK" : "FAIL", name, warps, failures);
+}
+
+/* Streamed PNG files hold straight alpha like the ones of Cairo, while the rows
+are premultiplied: every premultiplied pixel must come back unchanged. */
+static void test_stream_alpha(void) {
+	enum { W = 256, H = 256 };
+	static color rows[W * H];
+	static color back[W * H];
+	static color file[W * H];
+	char path[] = "/tmp/perspector-tests-XXXXXX";
+	const char *error = NULL;
+	coord x, y;
+
+	for (y = 0; y < H; y++) {
+		for (x = 0; x < W; x++) {
+			/* Every alpha with every valid level of blue. */
+			color c = { x <= y ? x : y, x * y % (y + 1), y / 2, y };
+			rows[y * W + x] = c;
+		}
+	}
+	int fd = mkstemp(path);
+	if (fd < 0) {
+		printf("FAIL [stream alpha] cannot create %s\n", path);
+		return;
+	}
+	close(fd);
+
+	image_writer *w = image_writer_open(path, W, H, &error);
+	bool ok = w && image_write_rows(w, 0, H / 2, rows) && image_write_rows(w, H / 2, H, &rows[H / 2 * W]);
+	ok = w && image_writer_close(w, &error) && ok;
+	image_reader *r = ok ? image_reader_open(path, &error) : NULL;
+	ok = r && image_read_rows(r, 0, H, back) && memcmp(rows, back, sizeof back) == 0;
+	if (r) {
+		image_reader_close(r);
+	}
+
+	/* What other programs read: 64 of 128 is 128 of 255. */
+	png_image img;
+	memset(&img, 0, sizeof img);
+	img.version = PNG_IMAGE_VERSION;
+	ok = ok && png_image_begin_read_from_file(&img, path);
+	img.format = PNG_FORMAT_BGRA;
+	ok = ok && png_image_finish_read(&img, NULL, file, 0, NULL);
+	png_image_free(&img);
+	color half = file[128 * W + 64];
+	ok = ok && half.blue == 128 && half.alpha == 128 && file[0].alpha == 0 && file[0].blue == 0
+		&& file[(H - 1) * W + 17].blue == 17;
+	unlink(path);
+
+	printf("%s [stream alpha] premultiplied rows, straight file%s%s\n", ok ? "OK" : "FAIL",
+		error ? ": " : "", error ? error : "");
+}
+
+/* The kernel selected for this CPU must match the portable one, including
+outside of the picture. */
+static void test_kernel(double ox, double oy, double ow, double sx, double sy, double sw) {
+	enum { BG_W = 37, BG_H = 23, COUNT = 67 };
+	static color bg_data[BG_W * BG_H];
+	color expected[COUNT];
+	color got[COUNT];
+	double origin[3] = { ox, oy, ow };
+	double step[3] = { sx, sy, sw };
+	coord i;
+
+	for (i = 0; i < BG_W * BG_H; i++) {
+		color c = { i * 5, i * 11, i * 17, 255 - i };
+		bg_data[i] = c;
+	}
+
+	bilinear_row(expected, COUNT, origin, step, bg_data, BG_W, BG_H, 0);
+	bilinear_kernel(BG_W, BG_H)(got, COUNT, origin, step, bg_data, BG_W, BG_H, 0);
+
+	bool ok = memcmp(expected, got, sizeof expected) == 0;
+	printf("%s [kernel] origin (%g, %g, %g), step (%g, %g, %g)\n", ok ? "OK" : "FAIL", ox, oy, ow, sx, sy, sw);
+}
+
+/* On a smooth picture, fixed-point positions must stay within a couple of
+levels of the double ones. */
+static void test_fixed(double ox, double oy, double ow, double sx, double sy, double sw) {
+	enum { BG_W = 37, BG_H = 23, COUNT = 203 };
+	static color bg_data[BG_W * BG_H];
+	color expected[COUNT];
+	color got[COUNT];
+	double origin[3] = { ox, oy, ow };
+	double step[3] = { sx, sy, sw };
+	coord x, y;
+	size_t i;
+	int worst = 0;
+
+	for (y = 0; y < BG_H; y++) {
+		for (x = 0; x < BG_W; x++) {
+			color c = { x * 6, y * 10, (x + y) * 4, 255 };
+			bg_data[y * BG_W + x] = c;
+		}
+	}
+
+	bilinear_row(expected, COUNT, origin, step, bg_data, BG_W, BG_H, 0);
+	bilinear_row_fixed(got, COUNT, origin, step, bg_data, BG_W, BG_H, 0);
+	for (i = 0; i < sizeof expected; i++) {
+		int d = abs(((unsigned char *)expected)[i] - ((unsigned char *)got)[i]);
+		worst = d > worst ? d : worst;
+	}
+
+	printf("%s [fixed] origin (%g, %g, %g), step (%g, %g, %g): %d levels\n", worst <= 2 ? "OK" : "FAIL", ox, oy, ow, sx, sy, sw, worst);
+}
+
+/* With anchors on the corners of the picture, every filter must give back the
+picture unchanged. */
+static void test_identity(interpolation interp, bool fixed, const char *name) {
+	enum { W = 41, H = 29 };
+	static color bg_data[W * H];
+	static color sink_data[W * H];
+	coord i;
+
+	for (i = 0; i < W * H; i++) {
+		color c = { i * 3, i * 7, i * 11, 255 };
+		bg_data[i] = c;
+	}
+
+	pixelset anchors = { .pixels = { { 0, 0 }, { W, 0 }, { W, H }, { 0, H } }, .count = 4 };
+	options opts;
+	options_init(&opts);
+	opts.interpolation = interp;
+	opts.fixed_point = fixed;
+	bool result = perspector_opts(sink_data, W, H, bg_data, W, H, &anchors, &opts);
+
+	bool ok = result && memcmp(bg_data, sink_data, sizeof bg_data) == 0;
+	printf("%s [identity %s]\n", ok ? "OK" : "FAIL", name);
+}
+
+/* Anchors around the picture: the border of the sink has no source and must
+take the background color, the center must not. */
+static void test_outside(mapping map, const char *name) {
+	enum { W = 40, H = 30 };
+	static color bg_data[W * H];
+	static color sink_data[W * H];
+	coord i;
+
+	for (i = 0; i < W * H; i++) {
+		color c = { 10, 20, 30, 255 };
+		bg_data[i] = c;
+	}
+
+	pixelset anchors = { .pixels = { { -10, -10 }, { W + 10, -10 }, { W + 10, H + 10 }, { -10, H + 10 } }, .count = 4 };
+	options opts;
+	options_init(&opts);
+	opts.mapping = map;
+	opts.outside = OUTSIDE_BACKGROUND;
+	opts.background.red = 200;
+	bool result = perspector_opts(sink_data, W, H, bg_data, W, H, &anchors, &opts);
+
+	color corner = sink_data[0];
+	color center = sink_data[(H / 2) * W + W / 2];
+	bool ok = result && corner.red == 200 && corner.alpha == 0 && center.red == 30;
+	printf("%s [outside %s] corner red=%i, center red=%i\n", ok ? "OK" : "FAIL", name, corner.red, center.red);
+}
+
+/* Candidate quads solved at once, from several threads, match the ones solved
+one by one. */
+#define SOLVE_SETS 500
+#define SOLVE_THREADS 4
+
+typedef struct {
+	pixelset sets[SOLVE_SETS];
+	solution solutions[SOLVE_SETS];
+	size_t valid;
+} solve_batch;
+
+static void *solve_thread(void *data) {
+	solve_batch *b = data;
+	b->valid = solve_anchors(b->sets, SOLVE_SETS, 400, 300, b->solutions);
+	return NULL;
+}
+
+static void test_solve_anchors(void) {
+	static solve_batch batches[SOLVE_THREADS];
+	pthread_t threads[SOLVE_THREADS];
+	uint32_t state = 2463534242u;
+	size_t i, j, k, expected = 0;
+	bool ok = true;
+
+	for (i = 0; i < SOLVE_SETS; i++) {
+		pixelset *a = &batches[0].sets[i];
+		for (k = 0; k < 4; k++) {
+			state ^= state << 13;
+			state ^= state >> 17;
+			state ^= state << 5;
+			/* Small coordinates give degenerate sets too. */
+			coord range = i % 2 ? 8 : 1000;
+			a->pixels[k].x = state % range;
+			a->pixels[k].y = (state >> 16) % range;
+		}
+		a->count = i == 7 ? 3 : 4;
+	}
+	for (j = 1; j < SOLVE_THREADS; j++) {
+		memcpy(batches[j].sets, batches[0].sets, sizeof batches[0].sets);
+	}
+	for (j = 0; j < SOLVE_THREADS; j++) {
+		if (pthread_create(&threads[j], NULL, solve_thread, &batches[j])) {
+			solve_thread(&batches[j]);
+			threads[j] = pthread_self();
+		}
+	}
+	for (j = 0; j < SOLVE_THREADS; j++) {
+		if (!pthread_equal(threads[j], pthread_self())) {
+			pthread_join(threads[j], NULL);
+		}
+	}
+
+	for (i = 0; i < SOLVE_SETS; i++) {
+		double m[9];
+		bool valid = batches[0].sets[i].count == 4 && make_transform_matrix(m, &batches[0].sets[i], 400, 300);
+		expected += valid;
+		for (j = 0; j < SOLVE_THREADS; j++) {
+			const solution *s = &batches[j].solutions[i];
+			ok = ok && s->valid == valid && (!valid || memcmp(s->matrix, m, sizeof m) == 0);
+		}
+	}
+	for (j = 0; j < SOLVE_THREADS; j++) {
+		ok = ok && batches[j].valid == expected;
+	}
+	ok = ok && expected > 0 && expected < SOLVE_SETS && !batches[0].solutions[7].valid;
+
+	printf("%s [solve anchors] %zu of %d sets valid, %d threads\n", ok ? "OK" : "FAIL", expected, SOLVE_SETS,
+		SOLVE_THREADS);
+}
+
+static void test_sink_size(double ratio, coord expect_w, coord expect_h) {
+	pixelset anchors = { .pixels = { { 10, 20 }, { 110, 25 }, { 100, 70 }, { 15, 60 } }, .count = 4 };
+	coord w = 0, h = 0;
+	bool ok = sink_size(&anchors, ratio, &w, &h) && w == expect_w && h == expect_h;
+	printf("%s [sink size] ratio %g -> %ix%i\n", ok ? "OK" : "FAIL", ratio, w, h);
+}
+
+/* Both manifest syntaxes must describe the same job. */
+/* Image of (x, y) by 'm'. */
+static point apply_matrix(const double m[9], double x, double y) {
+	double w = m[6] * x + m[7] * y + m[8];
+	point p = { (m[0] * x + m[1] * y + m[2]) / w, (m[3] * x + m[4] * y + m[5]) / w };
+	return p;
+}
+
+/* The walkers of the forward mapping must put every pixel of 'bg' where the
+matrix puts it, give or take POSITION_TOLERANCE pixels: only pixels that close to
+the edge of a sink pixel may land on its neighbour. Each sink pixel one of them
+clearly lands on must hold one of them. */
+#define POSITION_TOLERANCE 1e-6
+static void test_forward_positions(coord blx, coord bly, coord brx, coord bry, coord trx, coord try, coord tlx, coord tly) {
+	enum { BG_W = 331, BG_H = 257, SINK_W = 293, SINK_H = 311 };
+	static color bg_data[BG_W * BG_H];
+	static color sink_data[SINK_W * SINK_H];
+	static bool clear[SINK_W * SINK_H];
+	coord x, y;
+	int checked = 0, failures = 0;
+
+	/* The color of a pixel tells where it comes from. */
+	for (y = 0; y < BG_H * BG_W; y++) {
+		color c = { y & 0xff, y >> 8 & 0xff, y >> 16, 255 };
+		bg_data[y] = c;
+	}
+
+	pixelset anchors = { .pixels = { { blx, bly }, { brx, bry }, { trx, try }, { tlx, tly } }, .count = 4 };
+	options opts;
+	options_init(&opts);
+	opts.mapping = MAP_FORWARD;
+	transform *t = transform_new(&anchors, SINK_W, SINK_H, BG_W, BG_H, &opts);
+	if (!t || !transform_apply(t, sink_data, bg_data)) {
+		printf("FAIL [forward positions] cannot warp (%i, %i) (%i, %i) (%i, %i) (%i, %i)\n",
+			blx, bly, brx, bry, trx, try, tlx, tly);
+		transform_free(t);
+		return;
+	}
+	double m[9];
+	transform_get_matrix(t, m);
+	transform_free(t);
+
+	memset(clear, 0, sizeof clear);
+	for (y = 0; y < BG_H; y++) {
+		for (x = 0; x < BG_W; x++) {
+			point p = apply_matrix(m, x, y);
+			double fx = p.x - floor(p.x), fy = p.y - floor(p.y);
+			if (fabs(fx - 0.5) > POSITION_TOLERANCE && fabs(fy - 0.5) > POSITION_TOLERANCE
+				&& p.x > -0.5 && p.y > -0.5 && p.x < SINK_W - 0.5 && p.y < SINK_H - 0.5) {
+				clear[(coord)round(p.y) * SINK_W + (coord)round(p.x)] = true;
+			}
+		}
+	}
+	for (y = 0; y < SINK_H; y++) {
+		for (x = 0; x < SINK_W; x++) {
+			if (!clear[y * SINK_W + x]) {
+				continue;
+			}
+			color c = sink_data[y * SINK_W + x];
+			coord i = c.blue | c.green << 8 | c.red << 16;
+			point p = apply_matrix(m, i % BG_W, i / BG_W);
+			failures += !(fabs(p.x - x) <= 0.5 + POSITION_TOLERANCE && fabs(p.y - y) <= 0.5 + POSITION_TOLERANCE);
+			checked++;
+		}
+	}
+	bool ok = checked > SINK_W * SINK_H / 4 && failures == 0;
+	printf("%s [forward positions] (%i, %i) (%i, %i) (%i, %i) (%i, %i): %i pixels, %i misplaced\n", ok ? "OK" : "FAIL",
+		blx, bly, brx, bry, trx, try, tlx, tly, checked, failures);
+}
+
+/* When several pixels of 'bg' land on the same sink pixel, the last one in the
+order of the scan wins: tiles of 64 x 64 pixels, row-major, and rows in each
+tile. The colors tell which one won. */
+static void test_collision(void) {
+	enum { BG_W = 130, BG_H = 130, SINK_W = 61, SINK_H = 61 };
+	static color bg_data[BG_W * BG_H];
+	static color sink_data[SINK_W * SINK_H];
+	/* Sink pixel, then the expected winner. */
+	static const pixel cases[][2] = {
+		/* (18, 101) lands there too, but comes first in its tile. */
+		{ { 10, 59 }, { 17, 102 } },
+		/* (63, 21) lands there too, but its tile comes first. */
+		{ { 26, 6 }, { 64, 20 } }
+	};
+	coord i;
+	size_t k;
+
+	for (i = 0; i < BG_W * BG_H; i++) {
+		color c = { i & 0xff, i >> 8 & 0xff, 0, 255 };
+		bg_data[i] = c;
+	}
+	pixelset anchors = { .pixels = { { 20, 0 }, { 129, 25 }, { 105, 129 }, { 0, 100 } }, .count = 4 };
+	options opts;
+	options_init(&opts);
+	opts.mapping = MAP_FORWARD;
+	bool ok = perspector_opts(sink_data, SINK_W, SINK_H, bg_data, BG_W, BG_H, &anchors, &opts);
+	for (k = 0; k < sizeof cases / sizeof cases[0]; k++) {
+		color c = sink_data[cases[k][0].y * SINK_W + cases[k][0].x];
+		i = c.blue | c.green << 8;
+		ok = ok && i % BG_W == cases[k][1].x && i / BG_W == cases[k][1].y;
+	}
+	printf("%s [collision] last pixel of the last tile wins\n", ok ? "OK" : "FAIL");
+}
+
+/* The anchors land on the corners of the frame, and the sink shows what the
+mode promises: only the picture when cropping, the whole picture when keeping
+it. */
+static void test_crop(crop mode, const char *name) {
+	enum { BG_W = 97, BG_H = 71 };
+	static color bg_data[BG_W * BG_H];
+	static color sink_data[400 * 400];
+	coord i, w = 0, h = 0, ew, eh;
+	size_t j, k;
+
+	fill_colors(bg_data, BG_W * BG_H);
+	pixelset anchors = { .pixels = { { 10, 9 }, { 80, 2 }, { 90, 66 }, { 12, 50 } }, .count = 4 };
+	placement f;
+	double ratio = 1.5;
+	bool ok = sink_size(&anchors, ratio, &ew, &eh)
+	          && sink_geometry(&anchors, ratio, mode, BG_W, BG_H, &w, &h, &f) && w * h <= 400 * 400;
+
+	options opts;
+	options_init(&opts);
+	opts.placement = f;
+	opts.outside = OUTSIDE_BACKGROUND;
+	transform *t = ok ? transform_new(&anchors, w, h, BG_W, BG_H, &opts) : NULL;
+	ok = ok && t && transform_apply(t, sink_data, bg_data);
+
+	double m[9];
+	if (t) {
+		transform_get_matrix(t, m);
+		transform_free(t);
+	}
+	placement whole = { 0, 0, w, h };
+	const placement *r = f.width > 0 ? &f : &whole;
+	for (j = 0; ok && j < 4; j++) {
+		point p = apply_matrix(m, anchors.pixels[j].x, anchors.pixels[j].y);
+		bool corner = false;
+		for (k = 0; k < 4; k++) {
+			double x = r->x + (k & 1 ? r->width : 0), y = r->y + (k & 2 ? r->height : 0);
+			corner = corner || (fabs(p.x - x) < 1e-6 && fabs(p.y - y) < 1e-6);
+		}
+		ok = corner;
+	}
+
+	/* The background is transparent. */
+	bool filled = true, bordered = false;
+	for (i = 0; i < w * h; i++) {
+		filled = filled && sink_data[i].alpha == 255;
+		bordered = bordered || sink_data[i].alpha == 0;
+	}
+	switch (mode) {
+	case CROP_ENLARGE:
+		ok = ok && w == ew && h == eh && f.width == 0;
+		break;
+	case CROP_SHRINK:
+		ok = ok && w <= ew && h <= eh && fabs((double)w / h - ratio) < 0.05 && f.width == 0;
+		break;
+	case CROP_KEEP:
+		for (j = 0; ok && j < 4; j++) {
+			point p = apply_matrix(m, j & 1 ? BG_W - 1 : 0, j & 2 ? BG_H - 1 : 0);
+			ok = p.x > -0.5 && p.y > -0.5 && p.x < w - 0.5 && p.y < h - 0.5;
+		}
+		ok = ok && w >= ew && h >= eh && bordered;
+		break;
+	case CROP_BIGGEST:
+		ok = ok && filled && fabs((double)w / h - ratio) < 0.05;
+		break;
+	}
+	printf("%s [crop %s] %ix%i\n", ok ? "OK" : "FAIL", name, w, h);
+}
+
+static void test_sink_fit(coord max_w, coord max_h, coord expect_w, coord expect_h) {
+	coord w = 400, h = 300;
+	placement p = { -20, 10, 200, 100 };
+	sink_fit(&w, &h, &p, max_w, max_h);
+	double s = (double)w / 400;
+	bool ok = w == expect_w && h == expect_h && fabs(p.x + 20 * s) < 1e-9 && fabs(p.width - 200 * s) < 1e-9;
+	printf("%s [sink fit] %ix%i -> %ix%i\n", ok ? "OK" : "FAIL", max_w, max_h, w, h);
+}
+
+static void test_manifest(const char *line, parse_status expect) {
+	job j;
+	const char *error = "";
+	parse_status status = job_parse(&j, line, &error);
+	bool ok = status == expect;
+	if (ok && status == PARSE_OK) {
+		ok = !strcmp(j.input, "in, 1.png") && !strcmp(j.output, "out.png") && j.anchors.count == 4
+			&& j.anchors.pixels[0].x == 1 && j.anchors.pixels[0].y == 2
+			&& j.anchors.pixels[3].x == 7 && j.anchors.pixels[3].y == -8
+			&& fabs(j.ratio - 4.0 / 3) < 1e-12
+			&& (strstr(line, "\"gpu\"") ? j.has_backend && j.backend == BACKEND_GPU : !j.has_backend);
+		job_free(&j);
+	}
+	printf("%s [manifest] %s", ok ? "OK" : "FAIL", line);
+}
+
+/* Frames of a sequence may leave their anchors to the previous ones. */
+static void test_frame(const char *line) {
+	job j;
+	const char *error = "";
+	bool ok = job_parse(&j, line, &error) == PARSE_OK;
+	if (ok) {
+		ok = !strcmp(j.input, "in, 1.png") && !strcmp(j.output, "out.png") && j.anchors.count == 0
+			&& fabs(j.ratio - 4.0 / 3) < 1e-12;
+		job_free(&j);
+	}
+	printf("%s [frame] %s", ok ? "OK" : "FAIL", line);
+}
+
+/* Anchors follow a shifted frame, and stay on a still one. */
+static void test_track(coord dx, coord dy, coord radius, bool found) {
+	enum { W = 120, H = 90 };
+	static color frame[W * H];
+	static color shifted[W * H];
+	uint32_t state = 2463534242u;
+	coord x, y;
+	size_t k;
+
+	for (y = 0; y < H; y++) {
+		for (x = 0; x < W; x++) {
+			state ^= state << 13;
+			state ^= state >> 17;
+			state ^= state << 5;
+			color c = { state & 255, state >> 8 & 255, state >> 16 & 255, 255 };
+			frame[y * W + x] = c;
+		}
+	}
+	for (y = 0; y < H; y++) {
+		for (x = 0; x < W; x++) {
+			coord sx = x - dx < 0 ? 0 : x - dx >= W ? W - 1 : x - dx;
+			coord sy = y - dy < 0 ? 0 : y - dy >= H ? H - 1 : y - dy;
+			shifted[y * W + x] = frame[sy * W + sx];
+		}
+	}
+
+	pixelset seed = { .pixels = { { 20, 15 }, { 100, 18 }, { 95, 70 }, { 25, 75 } }, .count = 4 };
+	pixelset anchors = seed;
+	tracker *t = tracker_new(radius);
+	bool ok = t != NULL;
+	if (t) {
+		tracker_seed(t, frame, W, H, &seed);
+		tracker_update(t, frame, W, H, &anchors);
+		for (k = 0; k < 4; k++) {
+			ok = ok && anchors.pixels[k].x == seed.pixels[k].x && anchors.pixels[k].y == seed.pixels[k].y;
+		}
+		tracker_update(t, shifted, W, H, &anchors);
+		for (k = 0; k < 4; k++) {
+			bool moved = anchors.pixels[k].x == seed.pixels[k].x + dx && anchors.pixels[k].y == seed.pixels[k].y + dy;
+			ok = ok && moved == found;
+		}
+		tracker_free(t);
+	}
+	printf("%s [track] shift (%i, %i), radius %i: (%i, %i)\n", ok ? "OK" : "FAIL", dx, dy, radius,
+		anchors.pixels[0].x - seed.pixels[0].x, anchors.pixels[0].y - seed.pixels[0].y);
+}
+
+/* The transform is only solved again when what it depends on changes. */
+static void test_cache(void) {
+	pixelset anchors = { .pixels = { { 5, 9 }, { 90, 2 }, { 80, 66 }, { 12, 60 } }, .count = 4 };
+	pixelset moved = anchors;
+	moved.pixels[2].x++;
+	options opts;
+	options_init(&opts);
+	cache c;
+	memset(&c, 0, sizeof c);
+	bool reused[5];
+
+	transform *first = cache_transform(&c, &anchors, 113, 89, 97, 71, &opts, &reused[0]);
+	transform *same = cache_transform(&c, &anchors, 113, 89, 97, 71, &opts, &reused[1]);
+	bool ok = first && same == first;
+	ok = ok && cache_transform(&c, &moved, 113, 89, 97, 71, &opts, &reused[2]);
+	ok = ok && cache_transform(&c, &moved, 113, 89, 98, 71, &opts, &reused[3]);
+	opts.backend = BACKEND_GPU;
+	ok = ok && cache_transform(&c, &moved, 113, 89, 98, 71, &opts, &reused[4]);
+	cache_release(&c);
+
+	ok = ok && !reused[0] && reused[1] && !reused[2] && !reused[3] && !reused[4];
+	printf("%s [cache] reused on the same picture only\n", ok ? "OK" : "FAIL");
+}
+
 int main(void) {
 	/* Init */
 	pixelset ps = {
@@ -76,15 +1145,14 @@ int main(void) {
 		.count = 4
 	};
 
-	double transform[9];
-	make_transform_matrix(transform, &ps, 1024, 768);
+	double matrix[9];
+	make_transform_matrix(matrix, &ps, 1024, 768);
 
 	/* Tests */
-	gsl_matrix_view transform_mv = gsl_matrix_view_array(transform, 3, 3);
-	test_transform(&transform_mv.matrix, 32, 64);
-	test_transform(&transform_mv.matrix, 80, 48);
-	test_transform(&transform_mv.matrix, 48, 96);
-	test_transform(&transform_mv.matrix, 16, 384);
+	test_transform(matrix, 32, 64);
+	test_transform(matrix, 80, 48);
+	test_transform(matrix, 48, 96);
+	test_transform(matrix, 16, 384);
 
 	test_project(0, 0, 1, 2, 1, 3, 0, 1, true); /* 2 pairs aligned on X. */
 	test_project(0, 0, 1, 0, 3, 1, 2, 1, true); /* 2 pairs aligned on Y. */
@@ -98,6 +1166,113 @@ int main(void) {
 	test_project(-2, 1, -1, 2, 2, -1, 1, -2, false); /* Ambiguous input. */
 	test_project(0, 0, 0, 0, 0, 1, 1, 1, false); /* Two points share coordinates. */
 	test_project(0, 0, 1, 1, 2, 2, 3, 3, false); /* 4 aligned on a diagonal */
+	test_project(2, 3, 1, 0, 4, 4, 6, 6, false); /* 2 points on the same ray from the barycentre. */
+	test_opposed(2, 0, 10, 3, 8, 10, 0, 7); /* Both pairs through the barycentre. */
+	test_opposed(1, 1, 9, 2, 13, 7, 5, 6);
+	test_opposed(0, 0, 8, -3, 10, 10, -6, 5); /* bl and tr only. */
+
+	test_solver(32, 64, 80, 48, 48, 96, 16, 384, true);
+	test_solver(0, 0, 10, 0, 10, 10, 0, 10, true); /* Affine. */
+	test_solver(-500, -20, 3000, 40, 2500, 2000, 10, 1500, true);
+	test_solver(0, 0, 2, 0, 2, 2, 1, 1, false); /* 3 aligned: no solution. */
+	test_flat(0, 0, 2, 0, 2, 2, 1, 1, false);
+	test_flat(3258, 2148, 4292, 2532, 5326, 2916, 921, 3056, false);
+	test_flat(3258, 2148, 4292, 2533, 5326, 2916, 921, 3056, true); /* Off by a pixel. */
+	/* Differences overflowing a coord. */
+	test_flat(-2100000000, -1050000000, 2100000000, -1050000000, 2100000000, 1050000000, 0, 0, false);
+	test_flat(-2100000000, -1050000000, 2100000000, -1050000000, 2100000000, 1050000000, -1, 1, true);
+
+	test_warp(MAP_INVERSE, FILL_DISTANCE, "inverse");
+	test_warp(MAP_FORWARD, FILL_DISTANCE, "forward, distance fill");
+	test_warp(MAP_FORWARD, FILL_SQUARE, "forward, square fill");
+	test_threads(MAP_INVERSE, "inverse");
+	test_threads(MAP_FORWARD, "forward");
+	test_threads_random(FILL_DISTANCE, "distance");
+	test_threads_random(FILL_SQUARE, "square");
+	test_forward_positions(-5, 9, 310, 2, 320, 240, 12, 230);
+	test_forward_positions(40, 30, 300, 10, 250, 250, 60, 200);
+	test_forward_positions(0, 0, 330, 0, 200, 150, 130, 150);
+	test_collision();
+
+	test_reuse(MAP_INVERSE, "inverse");
+	test_reuse(MAP_FORWARD, "forward");
+
+	test_workspace(FILL_DISTANCE, OUTSIDE_BACKGROUND, "distance, background");
+	test_workspace(FILL_SQUARE, OUTSIDE_EXTEND, "square");
+	test_pool(MAP_INVERSE, "inverse");
+	test_pool(MAP_FORWARD, "forward");
+
+	test_progress(MAP_INVERSE, "inverse");
+	test_progress(MAP_FORWARD, "forward");
+
+	test_stats(MAP_INVERSE, FILL_DISTANCE, "inverse");
+	test_stats(MAP_FORWARD, FILL_DISTANCE, "forward, distance");
+	test_stats(MAP_FORWARD, FILL_SQUARE, "forward, square");
+
+	test_mipmap();
+
+	test_backend(INTERP_BILINEAR, OUTSIDE_EXTEND, "bilinear");
+	test_backend(INTERP_NEAREST, OUTSIDE_BACKGROUND, "nearest, background");
+	test_backend(INTERP_BICUBIC, OUTSIDE_EXTEND, "bicubic");
+
+	test_stream(INTERP_BILINEAR, OUTSIDE_EXTEND, 7, "bilinear");
+	test_stream(INTERP_NEAREST, OUTSIDE_BACKGROUND, 1, "nearest, background");
+	test_stream(INTERP_LANCZOS3, OUTSIDE_EXTEND, 16, "lanczos3");
+	test_stream(INTERP_BICUBIC, OUTSIDE_EXTEND, 1000, "bicubic");
+	test_stream_random(INTERP_NEAREST, OUTSIDE_EXTEND, "nearest");
+	test_stream_random(INTERP_BILINEAR, OUTSIDE_BACKGROUND, "bilinear, background");
+	test_stream_random(INTERP_LANCZOS3, OUTSIDE_EXTEND, "lanczos3");
+	test_stream_alpha();
+
+	test_outside(MAP_INVERSE, "inverse");
+	test_outside(MAP_FORWARD, "forward");
+
+	test_identity(INTERP_NEAREST, false, "nearest");
+	test_identity(INTERP_BILINEAR, false, "bilinear");
+	test_identity(INTERP_BICUBIC, false, "bicubic");
+	test_identity(INTERP_LANCZOS3, false, "lanczos3");
+	test_identity(INTERP_NEAREST, true, "nearest, fixed");
+	test_identity(INTERP_BILINEAR, true, "bilinear, fixed");
+
+	test_kernel(0.3, 0.7, 1, 0.51, 0.29, 0); /* Affine. */
+	test_kernel(-5, 30, 1, 0.7, -0.4, 0.001); /* Partly outside. */
+	test_kernel(12, 9, 0.5, 0.2, 0.1, -0.01); /* Crosses the horizon. */
+
+	test_fixed(0.3, 0.7, 1, 0.17, 0.1, 0); /* Affine. */
+	test_fixed(0.5, 0.5, 1, 0.3, 0.1, 0.003); /* Perspective. */
+	test_fixed(-5, 30, 1, 0.3, -0.1, 0.002); /* Partly outside. */
+	test_fixed(12, 9, 0.5, 0.2, 0.1, -0.01); /* Crosses the horizon. */
+
+	test_solve_anchors();
+
+	test_track(3, -2, 4, true);
+	test_track(-5, 5, 5, true);
+	test_track(6, 0, 4, false); /* Out of reach. */
+
+	test_sink_size(2, 100, 50); /* Bounding box. */
+	test_sink_size(4, 200, 50); /* Width grows. */
+	test_sink_size(0.5, 100, 200); /* Height grows. */
+
+	test_sink_fit(100, 0, 100, 75); /* Width. */
+	test_sink_fit(1000, 30, 40, 30); /* Height. */
+	test_sink_fit(0, 0, 400, 300); /* No limit. */
+
+	test_crop(CROP_ENLARGE, "enlarge");
+	test_crop(CROP_SHRINK, "shrink");
+	test_crop(CROP_KEEP, "keep");
+	test_crop(CROP_BIGGEST, "biggest");
+
+	test_manifest("\"in, 1.png\",1,2,3,4,5,6,7,-8,4:3,out.png\n", PARSE_OK);
+	test_manifest("{\"input\": \"in, 1.png\", \"anchors\": [[1, 2], [3, 4], [5, 6], [7, -8.2]], \"ratio\": \"4:3\", \"output\": \"out.png\"}\n", PARSE_OK);
+	test_manifest("{\"input\": \"in, 1.png\", \"anchors\": [[1, 2], [3, 4], [5, 6], [7, -8]], \"ratio\": \"4:3\", \"output\": \"out.png\", \"backend\": \"gpu\"}\n", PARSE_OK);
+	test_manifest("{\"input\": \"in, 1.png\", \"anchors\": [[1, 2], [3, 4], [5, 6], [7, -8]], \"ratio\": \"4:3\", \"output\": \"out.png\", \"backend\": \"tpu\"}\n", PARSE_ERROR);
+	test_manifest("  # comment\n", PARSE_SKIP);
+	test_manifest("in.png,1,2,3,4,5,6,7,8,out.png\n", PARSE_ERROR); /* Missing ratio. */
+	test_manifest("{\"input\": \"in.png\", \"anchors\": [[1, 2], [3, 4], [5, 6], [7, 8]], \"output\": \"out.png\"}\n", PARSE_ERROR);
+	test_manifest("in.png,1,2,,,,,,,1,out.png\n", PARSE_ERROR); /* Some anchors. */
+	test_frame("\"in, 1.png\",,,,,,,,,4:3,out.png\n");
+	test_frame("{\"input\": \"in, 1.png\", \"ratio\": \"4:3\", \"output\": \"out.png\"}\n");
+	test_cache();
 
 	return 0;
 }